@@ -0,0 +1,514 @@
+#include "batchsocket.h"
+#include "errmsg.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#endif
+
+// upper limit of the payload of one GSO datagram:
+#define MAXGSOBYTES 65000
+
+static bool same_endpoint(const endpoint_t& a, const endpoint_t& b)
+{
+  return (a.sin_addr.s_addr == b.sin_addr.s_addr) &&
+         (a.sin_port == b.sin_port);
+}
+
+udp_sendbatch_t::udp_sendbatch_t(int fd_, size_t maxmsg_)
+    : fd(fd_), maxmsg(maxmsg_), data(maxmsg_ * BUFSIZE), len(maxmsg_),
+      eps(maxmsg_), dest(maxmsg_), deferred(maxmsg_), destdrops(NODEST + 1),
+      destdeferred(NODEST + 1), destbacklog(NODEST + 1),
+      destcount(NODEST + 1), keep(maxmsg_)
+#ifdef LINUX
+      ,
+      hdr(maxmsg_), iov(maxmsg_), ctrl(maxmsg_ * CMSG_SPACE(sizeof(uint16_t))),
+      hdrcount(maxmsg_), hdrgso(maxmsg_)
+#endif
+{
+#if defined(LINUX) && defined(UDP_SEGMENT)
+  // a segment size of zero disables GSO on the socket, but tells us
+  // if the kernel supports it at all:
+  int gso_size(0);
+  use_gso = (setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &gso_size,
+                        sizeof(gso_size)) == 0);
+#endif
+}
+
+void udp_sendbatch_t::add(const char* buf, size_t len_, const endpoint_t& ep,
+                          stage_device_id_t dest_)
+{
+  if(len_ > BUFSIZE)
+    return;
+  dest_ = std::min(dest_, (stage_device_id_t)NODEST);
+  if(count == maxmsg)
+    flush();
+  // the socket buffer is still full:
+  if(count == maxmsg) {
+    drop(dest_);
+    return;
+  }
+  // the ring may still send from the data of the previous flush:
+  if(uring && !count && !uring->sends_done())
+    uring->complete_sends();
+  memcpy(&(data[count * BUFSIZE]), buf, len_);
+  len[count] = len_;
+  eps[count] = ep;
+  dest[count] = dest_;
+  deferred[count] = false;
+  ++count;
+}
+
+void udp_sendbatch_t::use_uring(udp_uring_t* ring)
+{
+  uring = ring;
+  // failed sends of the ring are dropped datagrams of their
+  // destination; a full socket buffer is also counted as deferred, as
+  // by flush(), although the ring cannot keep the datagrams:
+  if(uring)
+    uring->on_send_error = [this](stage_device_id_t d, size_t n, int err) {
+      d = std::min(d, (stage_device_id_t)NODEST);
+      bool full((err == EAGAIN) || (err == EWOULDBLOCK) || (err == ENOBUFS));
+      for(size_t k = 0; k < n; ++k) {
+        if(full)
+          ++destdeferred[d];
+        drop(d);
+      }
+    };
+}
+
+void udp_sendbatch_t::drop(stage_device_id_t dest_)
+{
+  ++destdrops[dest_];
+  ++num_dropped;
+}
+
+// keep the datagrams from first on, which were not sent because the
+// socket buffer is full, for the next flush:
+void udp_sendbatch_t::keep_unsent(size_t first)
+{
+  if(has_backlog)
+    for(auto& b : destbacklog)
+      b = 0;
+  has_backlog = false;
+  if(first == count) {
+    count = 0;
+    return;
+  }
+  std::fill(destcount.begin(), destcount.end(), 0);
+  // count from the newest datagram, so the oldest ones are dropped:
+  for(size_t k = count; k-- > first;) {
+    stage_device_id_t d(dest[k]);
+    // count each datagram once, not in every retry:
+    if(!deferred[k])
+      ++destdeferred[d];
+    deferred[k] = true;
+    keep[k] = (d == NODEST) || (destcount[d] < DESTQUEUELEN);
+    if(keep[k])
+      ++destcount[d];
+    else
+      drop(d);
+  }
+  size_t n(0);
+  for(size_t k = first; k < count; ++k) {
+    if(!keep[k])
+      continue;
+    if(n != k) {
+      memcpy(&(data[n * BUFSIZE]), &(data[k * BUFSIZE]), len[k]);
+      len[n] = len[k];
+      eps[n] = eps[k];
+      dest[n] = dest[k];
+      deferred[n] = deferred[k];
+    }
+    ++n;
+  }
+  count = n;
+  for(size_t d = 0; d <= NODEST; ++d)
+    destbacklog[d] = destcount[d];
+  has_backlog = true;
+}
+
+#ifdef LINUX
+size_t udp_sendbatch_t::build_headers(size_t first)
+{
+  size_t nhdr(0);
+  size_t k(first);
+  while(k < count) {
+    // find run of messages which can be sent as one GSO datagram:
+    size_t nseg(1);
+    size_t nbytes(len[k]);
+#ifdef UDP_SEGMENT
+    if(use_gso) {
+      while((k + nseg < count) && (nseg < MAXGSOSEGMENTS) &&
+            same_endpoint(eps[k], eps[k + nseg]) &&
+            (len[k + nseg] <= len[k]) &&
+            (nbytes + len[k + nseg] <= MAXGSOBYTES)) {
+        nbytes += len[k + nseg];
+        ++nseg;
+        // only the last segment may be shorter:
+        if(len[k + nseg - 1] < len[k])
+          break;
+      }
+    }
+#endif
+    for(size_t s = 0; s < nseg; ++s) {
+      iov[k + s].iov_base = &(data[(k + s) * BUFSIZE]);
+      iov[k + s].iov_len = len[k + s];
+    }
+    struct msghdr& mh(hdr[nhdr].msg_hdr);
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = &(eps[k]);
+    mh.msg_namelen = sizeof(endpoint_t);
+    mh.msg_iov = &(iov[k]);
+    mh.msg_iovlen = nseg;
+    hdrgso[nhdr] = false;
+#ifdef UDP_SEGMENT
+    if(nseg > 1) {
+      char* cbuf(&(ctrl[nhdr * CMSG_SPACE(sizeof(uint16_t))]));
+      memset(cbuf, 0, CMSG_SPACE(sizeof(uint16_t)));
+      mh.msg_control = cbuf;
+      mh.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      struct cmsghdr* cm(CMSG_FIRSTHDR(&mh));
+      cm->cmsg_level = IPPROTO_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t segsize(len[k]);
+      memcpy(CMSG_DATA(cm), &segsize, sizeof(segsize));
+      hdrgso[nhdr] = true;
+    }
+#endif
+    hdrcount[nhdr] = nseg;
+    k += nseg;
+    ++nhdr;
+  }
+  return nhdr;
+}
+
+void udp_sendbatch_t::flush()
+{
+  if(uring) {
+    if(uring->gso_failed)
+      use_gso = false;
+    // the requests are submitted with the next receive wait:
+    size_t nhdr(build_headers(0));
+    size_t k(0);
+    for(size_t h = 0; h < nhdr; ++h) {
+      // the datagrams of one header share the endpoint:
+      uring->queue_sendmsg(&(hdr[h].msg_hdr), hdrcount[h], hdrgso[h],
+                           dest[k]);
+      k += hdrcount[h];
+    }
+    num_datagrams += count;
+    count = 0;
+    return;
+  }
+  size_t first(0);
+  while(first < count) {
+    size_t nhdr(build_headers(first));
+    int r(sendmmsg(fd, hdr.data(), nhdr, MSG_DONTWAIT));
+    ++num_syscalls;
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      // do not wait for space in the socket buffer:
+      if((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS))
+        break;
+      if(hdrgso[0] && ((errno == EIO) || (errno == EINVAL))) {
+        // no GSO support in the outgoing path, use plain datagrams:
+        use_gso = false;
+        continue;
+      }
+      // drop the failing datagram and continue with the remainder:
+      num_errors += hdrcount[0];
+      for(size_t k = 0; k < hdrcount[0]; ++k)
+        drop(dest[first + k]);
+      first += hdrcount[0];
+      continue;
+    }
+    for(int h = 0; h < r; ++h) {
+      first += hdrcount[h];
+      num_datagrams += hdrcount[h];
+    }
+  }
+  keep_unsent(first);
+}
+
+void udp_sendbatch_t::flush_when_writable(int timeout_ms)
+{
+  while(count && !uring) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN | POLLOUT;
+    pfd.revents = 0;
+    if(poll(&pfd, 1, timeout_ms) <= 0)
+      return;
+    if(pfd.revents & POLLOUT) {
+      uint64_t sent(num_datagrams);
+      flush();
+      // writable, but the datagrams still do not fit (e.g. ENOBUFS):
+      if(num_datagrams == sent)
+        return;
+    }
+    if(pfd.revents & (POLLIN | POLLERR))
+      return;
+  }
+}
+#else
+void udp_sendbatch_t::flush()
+{
+  for(size_t k = 0; k < count; ++k) {
+    ssize_t r(sendto(fd, &(data[k * BUFSIZE]), len[k], 0,
+                     (const struct sockaddr*)(&(eps[k])), sizeof(endpoint_t)));
+    ++num_syscalls;
+    if(r < 0)
+      ++num_errors;
+    else
+      ++num_datagrams;
+  }
+  count = 0;
+}
+
+void udp_sendbatch_t::flush_when_writable(int) {}
+#endif
+
+udp_recvbatch_t::udp_recvbatch_t(int fd_, size_t maxmsg_)
+    : fd(fd_),
+      maxmsg(std::max((size_t)1, std::min(maxmsg_, (size_t)RECVBATCHSIZE))),
+      data(maxmsg * BUFSIZE), buf(maxmsg), len(maxmsg), eps(maxmsg),
+      tstamp(maxmsg), hwtstamp(maxmsg)
+#ifdef LINUX
+      ,
+      hdr(maxmsg), iov(maxmsg),
+      ctrl(maxmsg * (CMSG_SPACE(sizeof(struct timespec)) +
+                     CMSG_SPACE(sizeof(struct scm_timestamping))))
+#endif
+{
+  for(size_t k = 0; k < maxmsg; ++k)
+    buf[k] = &(data[k * BUFSIZE]);
+#ifdef LINUX
+  int on(1);
+  setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+#endif
+}
+
+#ifdef LINUX
+size_t udp_recvbatch_t::recv()
+{
+  if(uring) {
+    size_t n(uring->recv(maxmsg, buf.data(), len.data(), eps.data(),
+                         tstamp.data()));
+    num_datagrams += n;
+    return n;
+  }
+  const size_t ctrllen(CMSG_SPACE(sizeof(struct timespec)) +
+                       CMSG_SPACE(sizeof(struct scm_timestamping)));
+  for(size_t k = 0; k < maxmsg; ++k) {
+    buf[k] = &(data[k * BUFSIZE]);
+    iov[k].iov_base = buffer(k);
+    iov[k].iov_len = BUFSIZE;
+    struct msghdr& mh(hdr[k].msg_hdr);
+    mh.msg_name = &(eps[k]);
+    mh.msg_namelen = sizeof(endpoint_t);
+    mh.msg_iov = &(iov[k]);
+    mh.msg_iovlen = 1;
+    mh.msg_control = &(ctrl[k * ctrllen]);
+    mh.msg_controllen = ctrllen;
+    mh.msg_flags = 0;
+  }
+  // wait for the first datagram (limited by the socket timeout), then
+  // take what is already queued:
+  int r(recvmmsg(fd, hdr.data(), maxmsg, MSG_WAITFORONE, NULL));
+  ++num_syscalls;
+  if(r <= 0)
+    return 0;
+  struct timespec now;
+  bool has_now(false);
+  for(int k = 0; k < r; ++k) {
+    len[k] = hdr[k].msg_len;
+    bool has_ts(false);
+    memset(&(hwtstamp[k]), 0, sizeof(struct timespec));
+    struct msghdr& mh(hdr[k].msg_hdr);
+    for(struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm != NULL;
+        cm = CMSG_NXTHDR(&mh, cm)) {
+      if((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_TIMESTAMPNS)) {
+        memcpy(&(tstamp[k]), CMSG_DATA(cm), sizeof(struct timespec));
+        has_ts = true;
+      }
+      if((cm->cmsg_level == SOL_SOCKET) &&
+         (cm->cmsg_type == SCM_TIMESTAMPING)) {
+        // software, deprecated and raw hardware time stamp:
+        struct scm_timestamping ts;
+        memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+        hwtstamp[k] = ts.ts[2];
+      }
+    }
+    if(!has_ts) {
+      if(!has_now) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        has_now = true;
+      }
+      tstamp[k] = now;
+    }
+  }
+  num_datagrams += r;
+  return r;
+}
+#else
+size_t udp_recvbatch_t::recv()
+{
+  socklen_t addrlen(sizeof(endpoint_t));
+  ssize_t r(recvfrom(fd, buffer(0), BUFSIZE, 0, (struct sockaddr*)(&(eps[0])),
+                     &addrlen));
+  ++num_syscalls;
+  if(r <= 0)
+    return 0;
+  len[0] = r;
+  clock_gettime(CLOCK_REALTIME, &(tstamp[0]));
+  ++num_datagrams;
+  return 1;
+}
+#endif
+
+double udp_recvbatch_t::age_ms(size_t k) const
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return 1000.0 * (double)(now.tv_sec - tstamp[k].tv_sec) +
+         1.0e-6 * (double)(now.tv_nsec - tstamp[k].tv_nsec);
+}
+
+ovbox_batchsocket_t::ovbox_batchsocket_t(secret_t secret,
+                                         stage_device_id_t callerid)
+    : ovbox_udpsocket_t(secret, callerid), txbatch(sockfd), rxsecret(secret),
+      own_callerid(callerid)
+{
+}
+
+void ovbox_batchsocket_t::set_secret(secret_t secret)
+{
+  ovbox_udpsocket_t::set_secret(secret);
+  rxsecret = secret;
+}
+
+void ovbox_batchsocket_t::set_reuseport()
+{
+#ifdef SO_REUSEPORT
+  int on(1);
+  if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    throw ErrMsg("Unable to set SO_REUSEPORT.", errno);
+#else
+  throw ErrMsg("SO_REUSEPORT is not supported on this system.");
+#endif
+}
+
+void ovbox_batchsocket_t::set_rxbatch(size_t n)
+{
+  rxbatch.reset(new udp_recvbatch_t(sockfd, n));
+  if(uring)
+    rxbatch->use_uring(uring.get());
+}
+
+void ovbox_batchsocket_t::set_iouring()
+{
+  uring.reset(new udp_uring_t(sockfd));
+  if(!rxbatch)
+    set_rxbatch(RECVBATCHSIZE);
+  rxbatch->use_uring(uring.get());
+  txbatch.use_uring(uring.get());
+}
+
+void ovbox_batchsocket_t::release_uring()
+{
+  if(!uring)
+    return;
+  if(!uring->sends_done())
+    uring->complete_sends();
+  txbatch.use_uring(NULL);
+  if(rxbatch)
+    rxbatch->use_uring(NULL);
+  // closing the ring cancels the receive request, so no datagram is
+  // taken from the socket afterwards:
+  uring.reset();
+}
+
+port_t ovbox_batchsocket_t::adopt(int fd)
+{
+  // keep the descriptor number, which the batches already use:
+  if(dup2(fd, sockfd) < 0)
+    throw ErrMsg("Unable to take over socket.", errno);
+  ::close(fd);
+  endpoint_t ep;
+  socklen_t len(sizeof(ep));
+  if(getsockname(sockfd, (struct sockaddr*)(&ep), &len) < 0)
+    throw ErrMsg("Unable to get the port of the socket.", errno);
+  return ntohs(ep.sin_port);
+}
+
+char* ovbox_batchsocket_t::get_sec_msg(size_t k, size_t& len,
+                                       stage_device_id_t& cid,
+                                       port_t& destport, sequence_t& seq)
+{
+  return parse_sec_msg(rxbatch->buffer(k), rxbatch->length(k), len, cid,
+                       destport, seq, rxbatch->sender(k));
+}
+
+bool ovbox_batchsocket_t::recv_datagram(char* buf, size_t& len,
+                                        endpoint_t& addr)
+{
+  socklen_t addrlen(sizeof(endpoint_t));
+  ssize_t r(
+      ::recvfrom(sockfd, buf, len, 0, (struct sockaddr*)(&addr), &addrlen));
+  if(r < 0) {
+    len = 0;
+    return false;
+  }
+  len = r;
+  return true;
+}
+
+char* ovbox_batchsocket_t::parse_sec_msg(char* inputbuf, size_t ilen,
+                                         size_t& len, stage_device_id_t& cid,
+                                         port_t& destport, sequence_t& seq,
+                                         const endpoint_t& sender)
+{
+  if(ilen < HEADERLEN)
+    return NULL;
+  // the header consists of secret, caller ID, destination port and
+  // sequence number:
+  secret_t msgsecret;
+  memcpy(&msgsecret, inputbuf, sizeof(secret_t));
+  if(msgsecret != rxsecret)
+    return NULL;
+  size_t pos(sizeof(secret_t));
+  memcpy(&cid, &(inputbuf[pos]), sizeof(stage_device_id_t));
+  pos += sizeof(stage_device_id_t);
+  memcpy(&destport, &(inputbuf[pos]), sizeof(port_t));
+  pos += sizeof(port_t);
+  memcpy(&seq, &(inputbuf[pos]), sizeof(sequence_t));
+  len = ilen - HEADERLEN;
+  if(destport == PORT_PING) {
+    // answer pings directly, with the server as sender:
+    port_t pongport(PORT_PONG);
+    memcpy(&(inputbuf[sizeof(secret_t)]), &own_callerid,
+           sizeof(stage_device_id_t));
+    memcpy(&(inputbuf[sizeof(secret_t) + sizeof(stage_device_id_t)]),
+           &pongport, sizeof(port_t));
+    queue_send(inputbuf, ilen, sender);
+    return NULL;
+  }
+  return &(inputbuf[HEADERLEN]);
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,241 @@
+#ifndef BATCHSOCKET_H
+#define BATCHSOCKET_H
+
+#include "udpsocket.h"
+#include "uring.h"
+#include <atomic>
+#include <memory>
+#include <time.h>
+#include <vector>
+
+#ifdef LINUX
+#include <sys/socket.h>
+#endif
+
+// maximum number of datagrams collected before an automatic flush:
+#define SENDBATCHSIZE 256
+
+// upper limit of datagrams received with one system call:
+#define RECVBATCHSIZE 64
+
+// maximum number of GSO segments in one datagram (UDP_MAX_SEGMENTS
+// in the kernel):
+#define MAXGSOSEGMENTS 64
+
+// number of datagrams kept per destination while the socket buffer is
+// full:
+#define DESTQUEUELEN 4
+
+// destination of datagrams which are not assigned to an endpoint:
+#define NODEST MAX_STAGE_ID
+
+/**
+ * Collect outgoing datagrams and send them with as few system calls
+ * as possible.
+ *
+ * On Linux the queued messages are sent with a single sendmmsg()
+ * call. Consecutive messages of equal size to the same endpoint are
+ * merged into one UDP_SEGMENT (GSO) send. On other systems flush()
+ * falls back to one sendto() per message.
+ *
+ * On Linux flush() does not block. If the socket buffer is full, the
+ * unsent datagrams stay in the batch for the next flush, or for
+ * flush_when_writable(): for each destination only the newest ones up
+ * to its queue length, older datagrams are dropped. Datagrams without
+ * destination (control messages) are kept until they are sent. The
+ * socket buffer is shared by all destinations, so a full buffer does
+ * not tell which receiver is slow; the per destination counters only
+ * show whose datagrams were affected. With use_uring() the messages
+ * are queued as io_uring requests instead, and submitted with the
+ * next receive wait of that ring; failed sends are counted as drops
+ * of their destination.
+ *
+ * A batch is not thread safe; use one instance per sending thread.
+ */
+class udp_sendbatch_t {
+public:
+  udp_sendbatch_t(int fd, size_t maxmsg = SENDBATCHSIZE);
+  /// Copy a message into the batch, flush first if the batch is full
+  void add(const char* buf, size_t len, const endpoint_t& ep,
+           stage_device_id_t dest = NODEST);
+  /// Send all queued messages
+  void flush();
+  /**
+   * Wait until the socket is readable or the timeout expired, and
+   * send the datagrams kept by flush() as soon as the socket is
+   * writable. Returns immediately if no datagrams are kept.
+   */
+  void flush_when_writable(int timeout_ms);
+  /// Send through an io_uring instance, which must outlive the batch
+  void use_uring(udp_uring_t* ring);
+  size_t size() const { return count; };
+  /// Datagrams to dest which were dropped
+  uint64_t dest_drops(stage_device_id_t dest) const
+  {
+    return destdrops[dest];
+  };
+  /// Datagrams to dest which could not be sent in their first flush
+  uint64_t dest_deferred(stage_device_id_t dest) const
+  {
+    return destdeferred[dest];
+  };
+  /// Datagrams to dest waiting for the next flush
+  size_t dest_backlog(stage_device_id_t dest) const
+  {
+    return destbacklog[dest];
+  };
+  // statistics, can be read from any thread:
+  std::atomic<uint64_t> num_syscalls{0};
+  std::atomic<uint64_t> num_datagrams{0};
+  std::atomic<uint64_t> num_errors{0};
+  std::atomic<uint64_t> num_dropped{0};
+  bool gso_enabled() const { return use_gso; };
+
+private:
+  size_t build_headers(size_t first);
+  void keep_unsent(size_t first);
+  void drop(stage_device_id_t dest);
+  int fd;
+  size_t maxmsg;
+  size_t count = 0;
+  bool use_gso = false;
+  udp_uring_t* uring = NULL;
+  std::vector<char> data;
+  std::vector<size_t> len;
+  std::vector<endpoint_t> eps;
+  std::vector<stage_device_id_t> dest;
+  // the datagram was already counted as deferred:
+  std::vector<bool> deferred;
+  // per destination, the last entry counts datagrams without one:
+  std::vector<std::atomic<uint64_t>> destdrops;
+  std::vector<std::atomic<uint64_t>> destdeferred;
+  std::vector<std::atomic<uint32_t>> destbacklog;
+  std::vector<uint32_t> destcount;
+  std::vector<bool> keep;
+  bool has_backlog = false;
+#ifdef LINUX
+  std::vector<struct mmsghdr> hdr;
+  std::vector<struct iovec> iov;
+  std::vector<char> ctrl;
+  // number of queued messages merged into each header:
+  std::vector<size_t> hdrcount;
+  std::vector<bool> hdrgso;
+#endif
+};
+
+/**
+ * Receive up to maxmsg datagrams with one system call.
+ *
+ * On Linux recvmmsg() is used and each datagram keeps its kernel
+ * arrival time (SO_TIMESTAMPNS), and its hardware time stamp if
+ * enabled with SO_TIMESTAMPING. Other systems receive one datagram
+ * per call, time stamped in user space. With use_uring() the
+ * datagrams are taken from the provided buffers of an io_uring
+ * instance without copying; they stay valid until the next recv().
+ */
+class udp_recvbatch_t {
+public:
+  udp_recvbatch_t(int fd, size_t maxmsg);
+  /// Block until at least one datagram arrived or the socket timeout
+  /// expired, then return the number of received datagrams
+  size_t recv();
+  /// Receive through an io_uring instance, which must outlive the batch
+  void use_uring(udp_uring_t* ring) { uring = ring; };
+  char* buffer(size_t k) { return buf[k]; };
+  size_t length(size_t k) const { return len[k]; };
+  endpoint_t& sender(size_t k) { return eps[k]; };
+  const struct timespec& rxtime(size_t k) const { return tstamp[k]; };
+  /// Hardware arrival time of datagram k, zero if the NIC provides none
+  const struct timespec& hwrxtime(size_t k) const { return hwtstamp[k]; };
+  /// Time since arrival of datagram k, in milliseconds
+  double age_ms(size_t k) const;
+  size_t capacity() const { return maxmsg; };
+  std::atomic<uint64_t> num_syscalls{0};
+  std::atomic<uint64_t> num_datagrams{0};
+
+private:
+  int fd;
+  size_t maxmsg;
+  udp_uring_t* uring = NULL;
+  std::vector<char> data;
+  // start of each datagram, in data or in the buffers of the ring:
+  std::vector<char*> buf;
+  std::vector<size_t> len;
+  std::vector<endpoint_t> eps;
+  std::vector<struct timespec> tstamp;
+  std::vector<struct timespec> hwtstamp;
+#ifdef LINUX
+  std::vector<struct mmsghdr> hdr;
+  std::vector<struct iovec> iov;
+  std::vector<char> ctrl;
+#endif
+};
+
+/**
+ * UDP socket with batched send and receive paths.
+ *
+ * Messages are queued with queue_send() and sent with flush(),
+ * typically once for the whole fan-out of a received packet. If
+ * enabled with set_rxbatch(), recv_batch() drains several datagrams
+ * at once; get_sec_msg() then validates them. Without batching,
+ * recv_datagram() receives a single datagram. Both receive paths share
+ * parse_sec_msg(), which also answers pings.
+ * set_iouring() moves both paths to an io_uring instance.
+ */
+class ovbox_batchsocket_t : public ovbox_udpsocket_t {
+public:
+  ovbox_batchsocket_t(secret_t secret, stage_device_id_t callerid);
+  void queue_send(const char* buf, size_t len, const endpoint_t& ep,
+                  stage_device_id_t dest = NODEST)
+  {
+    txbatch.add(buf, len, ep, dest);
+  };
+  void flush() { txbatch.flush(); };
+  void set_secret(secret_t secret);
+  int get_sockfd() const { return sockfd; };
+  /// Allow several sockets on the same port, must be called before bind()
+  void set_reuseport();
+  /// Enable batched receive of up to n datagrams per system call
+  void set_rxbatch(size_t n);
+  /// Use io_uring for batched send and receive, throws if unsupported
+  void set_iouring();
+  /// Complete pending sends and close the ring, if any
+  void release_uring();
+  /// Replace the socket by fd, e.g. of a previous process; returns the port
+  port_t adopt(int fd);
+  size_t recv_batch() { return rxbatch->recv(); };
+  /// Validate header of received datagram k and return the payload
+  char* get_sec_msg(size_t k, size_t& len, stage_device_id_t& cid,
+                    port_t& destport, sequence_t& seq);
+  /**
+   * Receive one datagram without validating it, see parse_sec_msg().
+   *
+   * @param len Size of buf, set to the length of the datagram
+   * @return False if nothing was received
+   */
+  bool recv_datagram(char* buf, size_t& len, endpoint_t& addr);
+  /**
+   * Validate the header of a received datagram and return its
+   * payload. Datagrams with a wrong secret return NULL; pings are
+   * answered with a pong and return NULL as well.
+   */
+  char* parse_sec_msg(char* inputbuf, size_t ilen, size_t& len,
+                      stage_device_id_t& cid, port_t& destport,
+                      sequence_t& seq, const endpoint_t& sender);
+  udp_sendbatch_t txbatch;
+  std::unique_ptr<udp_recvbatch_t> rxbatch;
+  std::unique_ptr<udp_uring_t> uring;
+
+private:
+  std::atomic<secret_t> rxsecret;
+  stage_device_id_t own_callerid;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,227 @@
+#include "benchtools.h"
+#include "errmsg.h"
+#include "lobbyclient.h"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <chrono>
+#include <cmath>
+#include <errno.h>
+#include <fstream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+
+pid_t start_server(const std::string& server,
+                   const std::vector<std::string>& args)
+{
+  pid_t pid(fork());
+  if(pid == 0) {
+    std::vector<std::string> a(args);
+    a.insert(a.begin(), {server, "-q", "-l", "http://127.0.0.1:1"});
+    std::vector<char*> argv;
+    for(auto& s : a)
+      argv.push_back(&(s[0]));
+    argv.push_back(NULL);
+    execv(server.c_str(), argv.data());
+    _exit(1);
+  }
+  // give the server time to bind:
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  return pid;
+}
+
+void stop_server(pid_t pid)
+{
+  if(pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+double get_cputime(pid_t pid)
+{
+  if(pid <= 0)
+    return -1.0;
+  std::ifstream f("/proc/" + std::to_string(pid) + "/stat");
+  std::string stat;
+  if(!std::getline(f, stat))
+    return -1.0;
+  // the process name may contain spaces, skip it:
+  size_t pos(stat.rfind(')'));
+  if(pos == std::string::npos)
+    return -1.0;
+  unsigned long utime(0), stime(0);
+  if(sscanf(stat.c_str() + pos + 1,
+            " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime,
+            &stime) != 2)
+    return -1.0;
+  return (double)(utime + stime) / (double)sysconf(_SC_CLK_TCK);
+}
+
+latency_hist_t::latency_hist_t() : bins(LATBINS + 1, 0) {}
+
+void latency_hist_t::add(double ms)
+{
+  ++bins[std::min((size_t)LATBINS, (size_t)(std::max(0.0, ms) / LATBINMS))];
+  ++total;
+}
+
+double latency_hist_t::percentile(double p) const
+{
+  if(!total)
+    return 0.0;
+  uint64_t limit(0.01 * p * total);
+  uint64_t cnt(0);
+  for(size_t k = 0; k < bins.size(); ++k) {
+    cnt += bins[k];
+    if(cnt > limit)
+      return LATBINMS * (k + 1);
+  }
+  return LATBINMS * bins.size();
+}
+
+void bench_report_t::table(const std::string& name_,
+                           const std::string& description,
+                           const std::vector<std::string>& columns_)
+{
+  name = name_;
+  columns = columns_;
+  if(json)
+    return;
+  printf("\n# %s\n#", description.c_str());
+  for(const auto& c : columns)
+    printf(" %s", c.c_str());
+  printf("\n");
+}
+
+void bench_report_t::row(const std::vector<double>& values)
+{
+  if(json) {
+    printf("{\"bench\":\"%s\"", name.c_str());
+    for(size_t k = 0; k < std::min(values.size(), columns.size()); ++k)
+      // JSON has no representation of inf and nan:
+      if(std::isfinite(values[k]))
+        printf(",\"%s\":%.6g", columns[k].c_str(), values[k]);
+      else
+        printf(",\"%s\":null", columns[k].c_str());
+    printf("}\n");
+  } else {
+    for(size_t k = 0; k < values.size(); ++k)
+      printf("%s%.6g", k ? " " : "", values[k]);
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+lobby_stub_t::lobby_stub_t(bool legacy_) : legacy(legacy_)
+{
+  lfd = socket(AF_INET, SOCK_STREAM, 0);
+  if(lfd < 0)
+    throw ErrMsg("Unable to create lobby stub socket.", errno);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrlen(sizeof(addr));
+  // any free port:
+  if((bind(lfd, (struct sockaddr*)&addr, sizeof(addr)) < 0) ||
+     (listen(lfd, 16) < 0) ||
+     (getsockname(lfd, (struct sockaddr*)&addr, &addrlen) < 0)) {
+    ::close(lfd);
+    throw ErrMsg("Unable to start lobby stub.", errno);
+  }
+  port = ntohs(addr.sin_port);
+  thread = std::thread(&lobby_stub_t::service, this);
+}
+
+lobby_stub_t::~lobby_stub_t()
+{
+  run = false;
+  thread.join();
+  ::close(lfd);
+}
+
+std::string lobby_stub_t::url() const
+{
+  return "http://127.0.0.1:" + std::to_string(port) + "/";
+}
+
+void lobby_stub_t::service()
+{
+  struct pollfd pfd;
+  pfd.fd = lfd;
+  pfd.events = POLLIN;
+  while(run) {
+    if(poll(&pfd, 1, 100) <= 0)
+      continue;
+    int fd(accept(lfd, NULL, NULL));
+    if(fd < 0)
+      continue;
+    handle(fd);
+    ::close(fd);
+  }
+}
+
+void lobby_stub_t::handle(int fd)
+{
+  // read the header and the body of one request:
+  std::string req;
+  size_t hdrlen(std::string::npos);
+  size_t bodylen(0);
+  char buf[4096];
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while((hdrlen == std::string::npos) || (req.size() < hdrlen + bodylen)) {
+    if(poll(&pfd, 1, 1000) <= 0)
+      return;
+    ssize_t n(recv(fd, buf, sizeof(buf), 0));
+    if(n <= 0)
+      return;
+    req.append(buf, n);
+    if(hdrlen == std::string::npos) {
+      size_t pos(req.find("\r\n\r\n"));
+      if(pos != std::string::npos) {
+        hdrlen = pos + 4;
+        const char* cl(strcasestr(req.c_str(), "content-length:"));
+        if(cl && (cl < req.c_str() + hdrlen))
+          bodylen = atoi(cl + 15);
+      }
+    }
+  }
+  std::string line(req.substr(0, req.find("\r\n")));
+  std::string body(req.substr(hdrlen, bodylen));
+  const char* status("200 OK");
+  std::string content;
+  if(line.find("?latreports=") != std::string::npos) {
+    if(legacy) {
+      ++num_rejected;
+    } else {
+      ++num_batches;
+      num_reports += std::count(body.begin(), body.end(), '\n');
+      content = LOBBYLATREPORTSACK;
+    }
+  } else if(line.find("?latreport=") != std::string::npos) {
+    ++num_single;
+    ++num_reports;
+  } else if(line.find("?port=") != std::string::npos) {
+    ++num_announcements;
+  }
+  std::string resp(std::string("HTTP/1.1 ") + status +
+                   "\r\nContent-Length: " + std::to_string(content.size()) +
+                   "\r\nConnection: close\r\n\r\n" + content);
+  if(send(fd, resp.data(), resp.size(), MSG_NOSIGNAL) < 0) {
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
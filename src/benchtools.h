@@ -0,0 +1,117 @@
+#ifndef BENCHTOOLS_H
+#define BENCHTOOLS_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <thread>
+#include <vector>
+
+// resolution of the latency histogram, in ms:
+#define LATBINMS 0.01
+
+// number of latency histogram bins, the last bin collects all
+// packets above 100 ms:
+#define LATBINS 10000
+
+/**
+ * Start an ov-server instance for a measurement, with the arguments
+ * given after the program name. The server runs quietly and without
+ * a lobby.
+ *
+ * @return Process ID of the server.
+ */
+pid_t start_server(const std::string& server,
+                   const std::vector<std::string>& args);
+
+/// Terminate a server started with start_server()
+void stop_server(pid_t pid);
+
+/// CPU time of a process, in seconds, or a negative value if unknown
+double get_cputime(pid_t pid);
+
+/**
+ * Histogram of forwarding latencies, for percentiles without storing
+ * every packet. Not thread safe.
+ */
+class latency_hist_t {
+public:
+  latency_hist_t();
+  /// Add a latency in milliseconds
+  void add(double ms);
+  /// Latency percentile in milliseconds, zero if empty
+  double percentile(double p) const;
+  uint64_t count() const { return total; };
+
+private:
+  std::vector<uint64_t> bins;
+  uint64_t total = 0;
+};
+
+/**
+ * Results of a benchmark program, as tables with a comment header
+ * (for gnuplot and humans), or as one JSON object per result row
+ * (JSON Lines), e.g. for comparing releases with a script.
+ */
+class bench_report_t {
+public:
+  bench_report_t(bool json_) : json(json_){};
+  /**
+   * Start a new table.
+   *
+   * @param name Short name of the benchmark, the "bench" field in JSON
+   * @param description Comment line of the table
+   * @param columns Names of the parameters and results of each row
+   */
+  void table(const std::string& name, const std::string& description,
+             const std::vector<std::string>& columns);
+  /// Print a row of the current table, one value per column
+  void row(const std::vector<double>& values);
+
+private:
+  bool json;
+  std::string name;
+  std::vector<std::string> columns;
+};
+
+/**
+ * Minimal HTTP server on the loopback interface which stands in for
+ * the lobby in tests. Announcements get an empty response. Latency
+ * reports are counted, as batched POST requests (?latreports=) or as
+ * single GET requests (?latreport=). Batches are acknowledged with
+ * LOBBYLATREPORTSACK. In legacy mode batched reports get an empty
+ * response, like by a lobby which ignores unknown keys.
+ * One connection is served at a time, and closed after the response.
+ */
+class lobby_stub_t {
+public:
+  lobby_stub_t(bool legacy);
+  ~lobby_stub_t();
+  /// URL of the stub, for the -l option of the server
+  std::string url() const;
+  std::atomic<uint64_t> num_announcements{0};
+  std::atomic<uint64_t> num_batches{0};
+  std::atomic<uint64_t> num_rejected{0};
+  /// Latency reports, of batches and single requests
+  std::atomic<uint64_t> num_reports{0};
+  std::atomic<uint64_t> num_single{0};
+
+private:
+  void service();
+  void handle(int fd);
+  bool legacy;
+  int lfd = -1;
+  uint16_t port = 0;
+  std::atomic<bool> run{true};
+  std::thread thread;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,88 @@
+#include "boxcrypt.h"
+#include "protocol.h"
+#include <string.h>
+
+size_t encryptmsg_afternm(char* dest, size_t maxlen, const char* src,
+                          size_t len, const uint8_t* key)
+{
+  if(len < HEADERLEN)
+    return 0;
+  size_t clen(len + crypto_box_NONCEBYTES + crypto_box_MACBYTES);
+  if(clen > maxlen)
+    return 0;
+  memcpy(dest, src, HEADERLEN);
+  uint8_t* nonce((uint8_t*)(&(dest[HEADERLEN])));
+  randombytes_buf(nonce, crypto_box_NONCEBYTES);
+  if(crypto_box_easy_afternm(nonce + crypto_box_NONCEBYTES,
+                             (const uint8_t*)(&(src[HEADERLEN])),
+                             len - HEADERLEN, nonce, key) != 0)
+    return 0;
+  return clen;
+}
+
+size_t decryptmsg_afternm(char* dest, const char* src, size_t len,
+                          const uint8_t* key)
+{
+  if(len < HEADERLEN + crypto_box_NONCEBYTES + crypto_box_MACBYTES)
+    return 0;
+  const uint8_t* nonce((const uint8_t*)(&(src[HEADERLEN])));
+  if(crypto_box_open_easy_afternm(
+         (uint8_t*)(&(dest[HEADERLEN])), nonce + crypto_box_NONCEBYTES,
+         len - HEADERLEN - crypto_box_NONCEBYTES, nonce, key) != 0)
+    return 0;
+  memcpy(dest, src, HEADERLEN);
+  return len - crypto_box_NONCEBYTES - crypto_box_MACBYTES;
+}
+
+size_t groupkey_add_tag(char* buf, size_t len, size_t maxlen, uint8_t tag)
+{
+  if((len < HEADERLEN) || (len + GROUPKEY_TAGBYTES > maxlen))
+    return 0;
+  memmove(&(buf[HEADERLEN + GROUPKEY_TAGBYTES]), &(buf[HEADERLEN]),
+          len - HEADERLEN);
+  buf[HEADERLEN] = tag;
+  return len + GROUPKEY_TAGBYTES;
+}
+
+size_t groupkey_remove_tag(char* buf, size_t len, uint8_t& tag)
+{
+  if(len < HEADERLEN + GROUPKEY_TAGBYTES)
+    return 0;
+  tag = buf[HEADERLEN];
+  memmove(&(buf[HEADERLEN]), &(buf[HEADERLEN + GROUPKEY_TAGBYTES]),
+          len - HEADERLEN - GROUPKEY_TAGBYTES);
+  return len - GROUPKEY_TAGBYTES;
+}
+
+shared_key_cache_t::shared_key_cache_t() : keys(MAX_STAGE_ID) {}
+
+void shared_key_cache_t::update(stage_device_id_t cid, const uint8_t* pubkey,
+                                const uint8_t* server_secret)
+{
+  entry_t& e(keys[cid]);
+  if(e.valid && (memcmp(e.pubkey, pubkey, crypto_box_PUBLICKEYBYTES) == 0))
+    return;
+  e.valid = (crypto_box_beforenm(e.key, pubkey, server_secret) == 0);
+  memcpy(e.pubkey, pubkey, crypto_box_PUBLICKEYBYTES);
+}
+
+void shared_key_cache_t::clear(stage_device_id_t cid)
+{
+  entry_t& e(keys[cid]);
+  e.valid = false;
+  sodium_memzero(e.key, crypto_box_BEFORENMBYTES);
+}
+
+bool shared_key_cache_t::valid(stage_device_id_t cid,
+                               const uint8_t* pubkey) const
+{
+  const entry_t& e(keys[cid]);
+  return e.valid &&
+         (memcmp(e.pubkey, pubkey, crypto_box_PUBLICKEYBYTES) == 0);
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,77 @@
+#ifndef BOXCRYPT_H
+#define BOXCRYPT_H
+
+#include "common.h"
+#include <sodium.h>
+#include <vector>
+
+/**
+ * Encrypt a packed message with a precomputed shared key.
+ *
+ * The header is copied unencrypted, followed by a random nonce and
+ * the authenticated cipher text of the payload.
+ *
+ * @return Length of the encrypted message, or zero on error.
+ */
+size_t encryptmsg_afternm(char* dest, size_t maxlen, const char* src,
+                          size_t len, const uint8_t* key);
+
+/**
+ * Decrypt a message created by encryptmsg_afternm().
+ *
+ * @return Length of the decrypted message, or zero if the message
+ * could not be authenticated.
+ */
+size_t decryptmsg_afternm(char* dest, const char* src, size_t len,
+                          const uint8_t* key);
+
+/**
+ * Insert a key byte after the header, see GROUPKEY_TAG_SERVER.
+ *
+ * @return New length of the message, or zero if it does not fit.
+ */
+size_t groupkey_add_tag(char* buf, size_t len, size_t maxlen, uint8_t tag);
+
+/**
+ * Remove the key byte of a message.
+ *
+ * @return New length of the message, or zero if it has no key byte.
+ */
+size_t groupkey_remove_tag(char* buf, size_t len, uint8_t& tag);
+
+/**
+ * Shared keys (crypto_box_beforenm) of the server key pair with the
+ * public key of each endpoint.
+ */
+class shared_key_cache_t {
+public:
+  shared_key_cache_t();
+  /// Compute the shared key for a new or changed public key
+  void update(stage_device_id_t cid, const uint8_t* pubkey,
+              const uint8_t* server_secret);
+  void clear(stage_device_id_t cid);
+  /// True if a key is available which matches the public key
+  bool valid(stage_device_id_t cid, const uint8_t* pubkey) const;
+  const uint8_t* key(stage_device_id_t cid) const
+  {
+    return keys[cid].key;
+  };
+
+private:
+  class entry_t {
+  public:
+    bool valid = false;
+    uint8_t pubkey[crypto_box_PUBLICKEYBYTES];
+    uint8_t key[crypto_box_BEFORENMBYTES];
+  };
+  std::vector<entry_t> keys;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,182 @@
+#include "capture.h"
+#include "errmsg.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// idle time of the capture writer, in ms:
+#define CAPTUREIDLEMS 2
+
+capture_writer_t::capture_writer_t(const std::string& fname)
+{
+  // the datagrams may contain unencrypted audio, so only the owner
+  // may read them; an existing file keeps its mode on open:
+  fd = ::open(fname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if(fd < 0)
+    throw ErrMsg("Unable to create capture file \"" + fname + "\".", errno);
+  try {
+    if(fchmod(fd, 0600) < 0)
+      throw ErrMsg("Unable to restrict access to capture file \"" + fname +
+                       "\".",
+                   errno);
+    write(CAPTUREMAGIC, sizeof(CAPTUREMAGIC));
+  }
+  catch(...) {
+    ::close(fd);
+    throw;
+  }
+  thread = std::thread(&capture_writer_t::writer, this);
+}
+
+capture_writer_t::~capture_writer_t()
+{
+  run = false;
+  if(thread.joinable())
+    thread.join();
+  if(map)
+    munmap(map, maplen);
+  // remove the unused part of the last chunk:
+  if(ftruncate(fd, pos) < 0) {
+    // the file keeps trailing zeros, which end the replay
+  }
+  ::close(fd);
+}
+
+void capture_writer_t::add(const char* buf, size_t len,
+                           const endpoint_t& sender, const struct timespec& t)
+{
+  // a record of length zero marks the end of the file, and an empty
+  // datagram carries nothing to replay:
+  if(!len)
+    return;
+  // fill the record in place, so only the datagram is copied; drops
+  // the datagram if the queue is full:
+  size_t slot;
+  record_t* rec(queue.claim(slot));
+  if(!rec)
+    return;
+  rec->hdr.t_ns = (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+  rec->hdr.addr = sender.sin_addr.s_addr;
+  rec->hdr.port = sender.sin_port;
+  rec->hdr.len = std::min(len, (size_t)BUFSIZE);
+  memcpy(rec->data, buf, rec->hdr.len);
+  queue.commit(slot);
+}
+
+void capture_writer_t::writer()
+{
+  try {
+    while(true) {
+      // drain the queue once more after the last add():
+      bool quit(!run);
+      bool more(false);
+      record_t* rec;
+      while((rec = queue.front())) {
+        more = true;
+        write((const char*)(&(rec->hdr)), sizeof(rec->hdr));
+        write(rec->data, rec->hdr.len);
+        queue.release();
+        ++num_written;
+      }
+      if(quit)
+        break;
+      if(!more)
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(CAPTUREIDLEMS));
+    }
+  }
+  catch(const std::exception& e) {
+    // the queue fills up, further datagrams are counted as dropped:
+    std::cerr << "Error: capture stopped: " << e.what() << std::endl;
+  }
+}
+
+void capture_writer_t::write(const char* buf, size_t len)
+{
+  while(len) {
+    if(!map || (pos >= mapoffset + maplen))
+      map_chunk();
+    size_t n(std::min(len, mapoffset + maplen - pos));
+    memcpy(map + (pos - mapoffset), buf, n);
+    pos += n;
+    buf += n;
+    len -= n;
+  }
+}
+
+void capture_writer_t::map_chunk()
+{
+  if(map)
+    munmap(map, maplen);
+  map = NULL;
+  // mappings start at a page boundary:
+  size_t pagesize(sysconf(_SC_PAGESIZE));
+  mapoffset = pos - (pos % pagesize);
+  maplen = CAPTURECHUNKSIZE;
+  if(ftruncate(fd, mapoffset + maplen) < 0)
+    throw ErrMsg("Unable to extend capture file.", errno);
+  void* p(mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               mapoffset));
+  if(p == MAP_FAILED)
+    throw ErrMsg("Unable to map capture file.", errno);
+  map = (char*)p;
+}
+
+capture_reader_t::capture_reader_t(const std::string& fname)
+{
+  fd = ::open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0)
+    throw ErrMsg("Unable to open capture file \"" + fname + "\".", errno);
+  struct stat st;
+  if(fstat(fd, &st) < 0) {
+    ::close(fd);
+    throw ErrMsg("Unable to read capture file \"" + fname + "\".", errno);
+  }
+  len = st.st_size;
+  if((len < sizeof(CAPTUREMAGIC)) ||
+     ((map = (const char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+      MAP_FAILED)) {
+    ::close(fd);
+    throw ErrMsg("Unable to map capture file \"" + fname + "\".");
+  }
+  if(memcmp(map, CAPTUREMAGIC, sizeof(CAPTUREMAGIC)) != 0) {
+    munmap((void*)map, len);
+    ::close(fd);
+    throw ErrMsg("\"" + fname + "\" is not an ov-server capture file.");
+  }
+  rewind();
+}
+
+capture_reader_t::~capture_reader_t()
+{
+  munmap((void*)map, len);
+  ::close(fd);
+}
+
+void capture_reader_t::rewind()
+{
+  pos = sizeof(CAPTUREMAGIC);
+}
+
+bool capture_reader_t::next(capture_record_header_t& hdr, const char*& data)
+{
+  if(pos + sizeof(hdr) > len)
+    return false;
+  memcpy(&hdr, map + pos, sizeof(hdr));
+  // a file of a server which was killed ends with zeros:
+  if(!hdr.len || (pos + sizeof(hdr) + hdr.len > len))
+    return false;
+  data = map + pos + sizeof(hdr);
+  pos += sizeof(hdr) + hdr.len;
+  return true;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
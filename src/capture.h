@@ -0,0 +1,114 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "common.h"
+#include "ringbuffer.h"
+#include <atomic>
+#include <string>
+#include <thread>
+#include <time.h>
+
+// number of datagrams waiting for the capture writer:
+#define CAPTUREQUEUESIZE 4096
+
+// the capture file grows in steps of this size, in bytes:
+#define CAPTURECHUNKSIZE (16 * 1024 * 1024)
+
+// first bytes of a capture file:
+#define CAPTUREMAGIC "OVCAP01"
+
+/*
+ * A capture file starts with the 8 bytes of CAPTUREMAGIC, including
+ * the terminating zero. Each datagram follows as a
+ * capture_record_header_t and len bytes of the datagram, as received
+ * from the sender. Records are not aligned; all values are in host
+ * byte order, except the sender address and port, which are in
+ * network byte order like in endpoint_t. Empty datagrams are not
+ * captured, so a record of length zero marks the end of the file; the
+ * file of a server which was killed ends with zeros.
+ *
+ * The file is created readable by its owner only.
+ *
+ * Datagrams are captured as received, so those of encrypted rooms stay
+ * sealed with the key pair of the capturing server. The key pair is
+ * created at startup and only passed on by a hand-over, not stored,
+ * so a capture of an encrypted room cannot be replayed against a newly
+ * started server.
+ */
+struct capture_record_header_t {
+  // arrival time, CLOCK_REALTIME in ns:
+  int64_t t_ns;
+  uint32_t addr;
+  uint16_t port;
+  uint16_t len;
+};
+
+/**
+ * Write received datagrams to a capture file.
+ *
+ * add() copies the datagram into a lock-free queue and never blocks,
+ * so it can be called from the receive threads; only the used length
+ * is copied, and the writer reads the records in place. A background thread
+ * appends the queued datagrams to the file, which is mapped into
+ * memory chunk by chunk. If the writer does not keep up, datagrams
+ * are dropped and counted.
+ */
+class capture_writer_t {
+public:
+  capture_writer_t(const std::string& fname);
+  ~capture_writer_t();
+  /// Queue a received datagram (any thread)
+  void add(const char* buf, size_t len, const endpoint_t& sender,
+           const struct timespec& t);
+  /// Number of datagrams which were not captured
+  uint64_t num_dropped() const { return queue.num_dropped; };
+  std::atomic<uint64_t> num_written{0};
+
+private:
+  class record_t {
+  public:
+    capture_record_header_t hdr;
+    char data[BUFSIZE];
+  };
+  void writer();
+  void write(const char* buf, size_t len);
+  void map_chunk();
+  mpsc_ring_t<record_t> queue = mpsc_ring_t<record_t>(CAPTUREQUEUESIZE);
+  int fd = -1;
+  // current mapping of the file, and its offset in the file:
+  char* map = NULL;
+  size_t mapoffset = 0;
+  size_t maplen = 0;
+  // write position in the file:
+  size_t pos = 0;
+  std::atomic<bool> run{true};
+  std::thread thread;
+};
+
+/**
+ * Sequential reader of a capture file, which is mapped into memory.
+ */
+class capture_reader_t {
+public:
+  capture_reader_t(const std::string& fname);
+  ~capture_reader_t();
+  /// Get the next record, false at the end of the file
+  bool next(capture_record_header_t& hdr, const char*& data);
+  /// Restart at the first record
+  void rewind();
+
+private:
+  int fd = -1;
+  const char* map = NULL;
+  size_t len = 0;
+  size_t pos = 0;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,113 @@
+#include "controlqueue.h"
+#include "errmsg.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <sys/eventfd.h>
+#endif
+
+control_queue_t::control_queue_t(size_t capacity) : ring(capacity)
+{
+#ifdef LINUX
+  rfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(rfd < 0)
+    throw ErrMsg("Unable to create event file descriptor.", errno);
+  wfd = rfd;
+#else
+  int fds[2];
+  if(pipe(fds) < 0)
+    throw ErrMsg("Unable to create pipe.", errno);
+  for(auto fd : fds)
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  rfd = fds[0];
+  wfd = fds[1];
+#endif
+}
+
+control_queue_t::~control_queue_t()
+{
+  if(wfd != rfd)
+    close(wfd);
+  close(rfd);
+}
+
+void control_queue_t::commit(size_t slot)
+{
+  ring.commit(slot);
+  // pairs with the fence in wait(): either the consumer sees the
+  // message, or the producer sees the sleeping consumer:
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false))
+    signal();
+}
+
+void control_queue_t::wake()
+{
+  woken = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(sleeping.exchange(false))
+    signal();
+}
+
+void control_queue_t::signal()
+{
+  // a full pipe or counter already wakes the consumer:
+#ifdef LINUX
+  uint64_t v(1);
+  if(::write(wfd, &v, sizeof(v)) < 0) {
+  }
+#else
+  char v(0);
+  if(::write(wfd, &v, sizeof(v)) < 0) {
+  }
+#endif
+}
+
+void control_queue_t::clear()
+{
+  char buf[64];
+  while(::read(rfd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+void control_queue_t::wait(const std::vector<control_queue_t*>& queues,
+                           int timeout_ms, int fd)
+{
+  bool ready(false);
+  for(auto q : queues)
+    q->sleeping = true;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for(auto q : queues)
+    if(q->woken.exchange(false) || !q->ring.empty())
+      ready = true;
+  if(!ready) {
+    std::vector<struct pollfd> pfd(queues.size() + 1);
+    for(size_t k = 0; k < queues.size(); ++k)
+      pfd[k].fd = queues[k]->rfd;
+    // a negative descriptor is ignored by poll():
+    pfd.back().fd = fd;
+    for(auto& p : pfd) {
+      p.events = POLLIN;
+      p.revents = 0;
+    }
+    if(poll(pfd.data(), pfd.size(), timeout_ms) > 0)
+      for(size_t k = 0; k < queues.size(); ++k)
+        if(pfd[k].revents & POLLIN)
+          queues[k]->clear();
+  }
+  // a producer which saw the flag after the check signals once more,
+  // which causes one spurious wakeup:
+  for(auto q : queues) {
+    q->sleeping = false;
+    q->woken = false;
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,90 @@
+#ifndef CONTROLQUEUE_H
+#define CONTROLQUEUE_H
+
+#include "common.h"
+#include "ringbuffer.h"
+#include <atomic>
+#include <chrono>
+#include <time.h>
+#include <vector>
+
+/**
+ * Control message, copied from the receive buffer together with its
+ * arrival time.
+ */
+class control_msg_t {
+public:
+  stage_device_id_t sender_id = 0;
+  port_t destport = 0;
+  sequence_t seq = 0;
+  endpoint_t sender_endpoint;
+  // kernel arrival time, if known:
+  struct timespec rxtime = {0, 0};
+  struct timespec hwrxtime = {0, 0};
+  bool has_rxtime = false;
+  // arrival time on the clock of the ping payload:
+  std::chrono::high_resolution_clock::time_point arrival;
+  // unpacked message:
+  size_t len = 0;
+  char msg[BUFSIZE];
+};
+
+/**
+ * Queue of control messages from the receive threads of a room to its
+ * control thread.
+ *
+ * Messages are written and handled in place, so only their used
+ * length is copied. Producers never block, and signal the consumer
+ * only if it sleeps in wait(); on Linux the wakeup is an eventfd,
+ * elsewhere a pipe.
+ */
+class control_queue_t {
+public:
+  control_queue_t(size_t capacity);
+  ~control_queue_t();
+  /// Reserve a message to fill in place, NULL if the queue is full
+  control_msg_t* claim(size_t& slot) { return ring.claim(slot); };
+  /// Publish a message reserved by claim(), and wake the consumer
+  void commit(size_t slot);
+  /// The oldest message in place, or NULL (consumer thread)
+  control_msg_t* front() { return ring.front(); };
+  /// Free the message returned by front() (consumer thread)
+  void release() { ring.release(); };
+  /// Wake the consumer without a message, e.g. after a state change
+  void wake();
+  /**
+   * Wait until one of the queues is woken up, or the timeout expired.
+   *
+   * Returns at once if a message is ready or wake() was called since
+   * the last wait.
+   *
+   * @param queues Queues served by the calling thread
+   * @param timeout_ms Timeout in milliseconds
+   * @param fd Additional descriptor which ends the wait when it is
+   * readable, or -1
+   */
+  static void wait(const std::vector<control_queue_t*>& queues,
+                   int timeout_ms, int fd = -1);
+  /// Number of messages dropped because the queue was full
+  uint64_t num_dropped() const { return ring.num_dropped; };
+
+private:
+  void signal();
+  void clear();
+  mpsc_ring_t<control_msg_t> ring;
+  // the consumer waits for the file descriptor:
+  std::atomic<bool> sleeping{false};
+  // wake() was called while the consumer was busy:
+  std::atomic<bool> woken{false};
+  int rfd = -1;
+  int wfd = -1;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
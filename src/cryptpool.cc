@@ -0,0 +1,177 @@
+#include "cryptpool.h"
+#include "errmsg.h"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <sys/eventfd.h>
+#endif
+
+// hint to the CPU that the thread waits actively:
+static inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+crypt_event_t::crypt_event_t()
+{
+#ifdef LINUX
+  rfd = eventfd(0, EFD_CLOEXEC);
+  if(rfd < 0)
+    throw ErrMsg("Unable to create event file descriptor.", errno);
+  wfd = rfd;
+#else
+  int fds[2];
+  if(pipe(fds) < 0)
+    throw ErrMsg("Unable to create pipe.", errno);
+  rfd = fds[0];
+  wfd = fds[1];
+#endif
+}
+
+crypt_event_t::~crypt_event_t()
+{
+  if(wfd != rfd)
+    close(wfd);
+  close(rfd);
+}
+
+void crypt_event_t::signal()
+{
+#ifdef LINUX
+  uint64_t v(1);
+#else
+  char v(0);
+#endif
+  if(::write(wfd, &v, sizeof(v)) < 0) {
+  }
+}
+
+void crypt_event_t::wait()
+{
+#ifdef LINUX
+  uint64_t v;
+#else
+  char v;
+#endif
+  while((::read(rfd, &v, sizeof(v)) < 0) && (errno == EINTR))
+    ;
+}
+
+crypt_pool_t::crypt_pool_t(size_t nthreads, int prio_, unsigned int spinus_)
+    : prio(prio_), spinus(spinus_), out(MAX_STAGE_ID * BUFSIZE),
+      outlen(MAX_STAGE_ID, 0)
+{
+  // the number of woken workers is stored in one byte:
+  nthreads = std::min(nthreads, (size_t)255);
+  for(size_t k = 0; k < nthreads; ++k) {
+    profiles.emplace_back(new phase_profile_t());
+    start.emplace_back(new crypt_event_t());
+  }
+  for(size_t k = 0; k < nthreads; ++k)
+    threads.emplace_back(&crypt_pool_t::worker, this, k + 1);
+}
+
+crypt_pool_t::~crypt_pool_t()
+{
+  quit = true;
+  for(auto& s : start)
+    s->signal();
+  for(auto& th : threads)
+    if(th.joinable())
+      th.join();
+}
+
+// wait actively until v differs from old, at most spinus; false on
+// timeout:
+bool crypt_pool_t::spin(const std::atomic<uint64_t>& v, uint64_t old) const
+{
+  if(!spinus)
+    return false;
+  auto t_idle(std::chrono::steady_clock::now());
+  while(std::chrono::steady_clock::now() - t_idle <
+        std::chrono::microseconds(spinus)) {
+    if((v.load(std::memory_order_acquire) != old) || quit)
+      return true;
+    cpu_relax();
+  }
+  return false;
+}
+
+void crypt_pool_t::process(size_t k, size_t nparticipants)
+{
+  // receivers are distributed round robin among the caller (k=0) and
+  // the woken workers:
+  size_t ndest(job_end - job_begin);
+  for(size_t i = k; i < ndest; i += nparticipants)
+    outlen[i] = route_encrypt(&(out[i * BUFSIZE]), BUFSIZE, job_msg, job_len,
+                              job_begin[i]);
+}
+
+void crypt_pool_t::encrypt(const char* msg, size_t len,
+                           const route_dest_t* begin, const route_dest_t* end)
+{
+  size_t ndest(std::min((size_t)(end - begin), (size_t)MAX_STAGE_ID));
+  if(!ndest)
+    return;
+  job_msg = msg;
+  job_len = len;
+  job_begin = begin;
+  job_end = begin + ndest;
+  // the caller takes one share, a worker is only woken for a receiver
+  // of its own:
+  size_t nworkers(std::min(threads.size(), ndest - 1));
+  pending = nworkers;
+  // publishes the job:
+  uint64_t gen(generation.load(std::memory_order_relaxed));
+  generation.store(((gen >> 8) + 1) << 8 | nworkers,
+                   std::memory_order_release);
+  for(size_t k = 0; k < nworkers; ++k)
+    start[k]->signal();
+  process(0, nworkers + 1);
+  // the workers run in parallel, their share is done soon:
+  while(pending.load(std::memory_order_acquire))
+    if(!spin(pending, pending.load(std::memory_order_relaxed)))
+      done.wait();
+}
+
+void crypt_pool_t::worker(size_t k)
+{
+  set_thread_prio(prio);
+  uint64_t gen(0);
+  phase_profile_t& p(*profiles[k - 1]);
+  while(true) {
+    uint64_t g;
+    // a signal of an earlier job may be left in the event, so the job
+    // counter decides:
+    while(((g = generation.load(std::memory_order_acquire)) == gen) &&
+          !quit)
+      if(!spin(generation, gen))
+        start[k - 1]->wait();
+    if(quit)
+      return;
+    gen = g;
+    // not needed for this job; the caller waits for the woken workers,
+    // so the job cannot change while a woken worker runs:
+    size_t nworkers(g & 0xff);
+    if(k > nworkers)
+      continue;
+    uint64_t c0(profile_cycles());
+    process(k, nworkers + 1);
+    p.cycles[PHASE_ENCRYPT].add(profile_cycles() - c0);
+    if(pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+      done.signal();
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
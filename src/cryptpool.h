@@ -0,0 +1,106 @@
+#ifndef CRYPTPOOL_H
+#define CRYPTPOOL_H
+
+#include "profile.h"
+#include "routetable.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// minimum number of encrypted receivers for parallel encryption:
+#define CRYPTPOOL_MINDEST 3
+
+/**
+ * Wakeup of one waiting thread; on Linux an eventfd, elsewhere a
+ * pipe. Signals which arrive before wait() are not lost.
+ */
+class crypt_event_t {
+public:
+  crypt_event_t();
+  ~crypt_event_t();
+  void signal();
+  /// Block until signal() was called at least once since the last wait
+  void wait();
+
+private:
+  int rfd = -1;
+  int wfd = -1;
+};
+
+/**
+ * Pool of threads which encrypt one message for many receivers in
+ * parallel.
+ *
+ * The calling thread takes part in the work and returns when all
+ * receivers were served; it then sends the results itself, so all
+ * datagrams go through its send batch. Only as many workers as there
+ * are receivers besides the caller's share are woken. Idle workers
+ * and the waiting caller block on an eventfd; with a spin time, they
+ * wait actively for that long first, which saves the wakeup but keeps
+ * a core busy at the priority of the pool.
+ */
+class crypt_pool_t {
+public:
+  /**
+   * @param nthreads Number of worker threads
+   * @param prio Priority of the workers
+   * @param spinus Time to wait actively before blocking, in
+   * microseconds; zero blocks at once
+   */
+  crypt_pool_t(size_t nthreads, int prio, unsigned int spinus = 0);
+  ~crypt_pool_t();
+  /**
+   * Encrypt msg for all receivers in [begin,end), at most MAX_STAGE_ID.
+   *
+   * The results are valid until the next call, see result().
+   */
+  void encrypt(const char* msg, size_t len, const route_dest_t* begin,
+               const route_dest_t* end);
+  /**
+   * Encrypted message of receiver i of the last encrypt().
+   *
+   * @return The message, or NULL if it could not be encrypted
+   */
+  const char* result(size_t i, size_t& len) const
+  {
+    len = outlen[i];
+    return len ? &(out[i * BUFSIZE]) : NULL;
+  };
+  size_t size() const { return threads.size(); };
+  /// Phase profile of worker thread k
+  const phase_profile_t& profile(size_t k) const { return *profiles[k]; };
+
+private:
+  void worker(size_t k);
+  void process(size_t k, size_t nparticipants);
+  bool spin(const std::atomic<uint64_t>& v, uint64_t old) const;
+  std::vector<std::thread> threads;
+  std::vector<std::unique_ptr<phase_profile_t>> profiles;
+  std::vector<std::unique_ptr<crypt_event_t>> start;
+  crypt_event_t done;
+  int prio;
+  unsigned int spinus;
+  // job counter in the upper bits, number of woken workers in the
+  // lowest byte:
+  std::atomic<uint64_t> generation{0};
+  std::atomic<uint64_t> pending{0};
+  std::atomic<bool> quit{false};
+  // current job:
+  const char* job_msg = NULL;
+  size_t job_len = 0;
+  const route_dest_t* job_begin = NULL;
+  const route_dest_t* job_end = NULL;
+  // encrypted messages of the receivers, BUFSIZE bytes each:
+  std::vector<char> out;
+  std::vector<size_t> outlen;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
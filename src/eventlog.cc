@@ -0,0 +1,231 @@
+#include "eventlog.h"
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <time.h>
+
+// names of the event types, for the suppression reports:
+static const char* evlog_names[EVLOG_NUMTYPES] = {
+    "sequence error", "peer latency", "latency"};
+
+// label values of the event types, for the metrics:
+static const char* evlog_types[EVLOG_NUMTYPES] = {"seqerr", "peerlat",
+                                                  "latency"};
+
+static int64_t realtime_ns()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_REALTIME, &t);
+  return (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+event_log_t::event_log_t()
+{
+  for(size_t k = 0; k < EVLOG_NUMTYPES; ++k) {
+    rate[k] = 2.0;
+    burst[k] = 10.0;
+    suppressed[k] = 0;
+    reported_suppressed[k] = 0;
+  }
+  // every client reports all its peers every few seconds:
+  set_rate(EVLOG_PEERLAT, 10.0, 2.0 * MAX_STAGE_ID);
+  set_rate(EVLOG_LATENCY, 2.0, 5.0);
+}
+
+event_log_t::~event_log_t()
+{
+  flush();
+}
+
+event_log_t& event_log_t::instance()
+{
+  static event_log_t log;
+  return log;
+}
+
+void event_log_t::set_rate(uint8_t type, double r, double b)
+{
+  if(type < EVLOG_NUMTYPES) {
+    rate[type] = r;
+    burst[type] = std::max(1.0, b);
+  }
+}
+
+event_log_t::producer_t* event_log_t::local_producer()
+{
+  thread_local producer_t* p(NULL);
+  if(!p) {
+    std::lock_guard<std::mutex> lk(mtx);
+    producers.emplace_back(new producer_t());
+    p = producers.back().get();
+    for(size_t k = 0; k < EVLOG_NUMTYPES; ++k)
+      for(size_t c = 0; c <= MAX_STAGE_ID; ++c) {
+        p->tokens[k][c] = burst[k];
+        p->last_ns[k][c] = 0;
+      }
+    if(!run && !stopped) {
+      run = true;
+      thread = std::thread(&event_log_t::writer, this);
+    }
+  }
+  return p;
+}
+
+void event_log_t::add(evlog_record_t rec)
+{
+  if(rec.type >= EVLOG_NUMTYPES)
+    return;
+  producer_t* p(local_producer());
+  rec.t_ns = realtime_ns();
+  // refill the token bucket of the event type and client:
+  size_t c(std::min((size_t)rec.cid, (size_t)MAX_STAGE_ID));
+  double& tokens(p->tokens[rec.type][c]);
+  int64_t& last_ns(p->last_ns[rec.type][c]);
+  if(last_ns)
+    tokens = std::min(burst[rec.type],
+                      tokens + 1.0e-9 * rate[rec.type] *
+                                   (double)(rec.t_ns - last_ns));
+  last_ns = rec.t_ns;
+  if(tokens < 1.0) {
+    suppressed[rec.type].fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  tokens -= 1.0;
+  // drops the record if the queue is full:
+  p->queue.push(rec);
+  // pairs with the fence in flush(): either flush() drains the
+  // record, or the caller sees that it has to:
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(stopped.load(std::memory_order_relaxed)) {
+    std::vector<evlog_record_t> recs;
+    drain(recs);
+  }
+}
+
+uint64_t event_log_t::num_dropped() const
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  uint64_t n(0);
+  for(const auto& p : producers)
+    n += p->queue.num_dropped;
+  return n;
+}
+
+void event_log_t::write_metrics(metrics_writer_t& w)
+{
+  for(uint8_t k = 0; k < EVLOG_NUMTYPES; ++k)
+    w.add("ovserver_log_events_suppressed_total", "counter",
+          k ? "" : "Log events above the rate limit.",
+          "ovserver_log_events_suppressed_total",
+          metrics_label("type", evlog_types[k]), num_suppressed(k));
+  w.add("ovserver_log_events_dropped_total", "counter",
+        "Log events which did not fit into the queue of the log writer.",
+        "ovserver_log_events_dropped_total", "", num_dropped());
+}
+
+void event_log_t::flush()
+{
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    run = false;
+    stopped = true;
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if(thread.joinable())
+    thread.join();
+  std::vector<evlog_record_t> recs;
+  drain(recs);
+  std::lock_guard<std::mutex> dlk(drainmtx);
+  report(realtime_ns() + 1000000 * (int64_t)EVLOGREPORTMS);
+}
+
+void event_log_t::writer()
+{
+  std::vector<evlog_record_t> recs;
+  recs.reserve(EVLOGQUEUELEN);
+  while(run) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(EVLOGPERIODMS));
+    drain(recs);
+    report(realtime_ns());
+  }
+}
+
+void event_log_t::drain(std::vector<evlog_record_t>& recs)
+{
+  std::lock_guard<std::mutex> dlk(drainmtx);
+  recs.clear();
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    evlog_record_t rec;
+    for(auto& p : producers)
+      while(p->queue.pop(rec))
+        recs.push_back(rec);
+  }
+  // events of all threads in the order of their occurrence:
+  std::stable_sort(recs.begin(), recs.end(),
+                   [](const evlog_record_t& a, const evlog_record_t& b) {
+                     return a.t_ns < b.t_ns;
+                   });
+  for(const auto& rec : recs)
+    write(rec);
+}
+
+void event_log_t::write(const evlog_record_t& rec)
+{
+  char ctmp[1024];
+  last_port = rec.port;
+  switch(rec.type) {
+  case EVLOG_SEQERR:
+    snprintf(ctmp, sizeof(ctmp), "sequence error %d sender %d %d", rec.cid,
+             rec.i[0], rec.i[1]);
+    log(rec.port, ctmp);
+    break;
+  case EVLOG_PEERLAT:
+    snprintf(ctmp, sizeof(ctmp),
+             "peerlat %d-%g min=%1.2fms, mean=%1.2fms, max=%1.2fms", rec.cid,
+             rec.v[0], rec.v[1], rec.v[2], rec.v[3]);
+    log(rec.port, ctmp);
+    snprintf(ctmp, sizeof(ctmp), "packages %d-%g received=%g lost=%g (%1.2f%%)",
+             rec.cid, rec.v[0], rec.v[4], rec.v[5],
+             100.0 * rec.v[5] / (std::max(1.0, rec.v[4] + rec.v[5])));
+    log(rec.port, ctmp);
+    break;
+  case EVLOG_LATENCY:
+    snprintf(ctmp, sizeof(ctmp),
+             "latency %d min=%1.2fms, mean=%1.2fms, max=%1.2fms", rec.cid,
+             rec.v[0], rec.v[1], rec.v[2]);
+    log(rec.port, ctmp);
+    if(rec.v[4] > 0) {
+      snprintf(ctmp, sizeof(ctmp),
+               "kernel latency %d min=%1.2fms, mean=%1.2fms, max=%1.2fms",
+               rec.cid, rec.v[3], rec.v[4], rec.v[5]);
+      log(rec.port, ctmp);
+    }
+    break;
+  }
+}
+
+void event_log_t::report(int64_t now_ns)
+{
+  if(now_ns - last_report_ns < 1000000 * (int64_t)EVLOGREPORTMS)
+    return;
+  last_report_ns = now_ns;
+  for(size_t k = 0; k < EVLOG_NUMTYPES; ++k) {
+    uint64_t n(suppressed[k]);
+    if(n != reported_suppressed[k])
+      log(last_port, "suppressed " + std::to_string(n - reported_suppressed[k]) +
+                         " " + evlog_names[k] + " messages");
+    reported_suppressed[k] = n;
+  }
+  uint64_t dropped(num_dropped());
+  if(dropped != reported_dropped)
+    log(last_port, "dropped " + std::to_string(dropped - reported_dropped) +
+                       " log messages (log writer too slow)");
+  reported_dropped = dropped;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
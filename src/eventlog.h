@@ -0,0 +1,136 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+#include "common.h"
+#include "metrics.h"
+#include "ringbuffer.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// event types:
+// sequence error report of a client, i[0] = sender, i[1] = sequence:
+#define EVLOG_SEQERR 0
+// peer-to-peer latency report, v[0] = peer, v[1..3] = min, mean, max
+// in ms, v[4] = received, v[5] = lost packets:
+#define EVLOG_PEERLAT 1
+// ping latency of a client, v[0..2] = min, mean, max in ms, v[3..5]
+// the same from kernel time stamps, if measured:
+#define EVLOG_LATENCY 2
+#define EVLOG_NUMTYPES 3
+
+// number of queued records per thread:
+#define EVLOGQUEUELEN 256
+
+// period of the writer thread, in ms:
+#define EVLOGPERIODMS 20
+
+// suppressed and dropped events are reported at most once in this
+// period, in ms:
+#define EVLOGREPORTMS 10000
+
+/**
+ * Fixed size record of a log event.
+ */
+class evlog_record_t {
+public:
+  evlog_record_t() {}
+  evlog_record_t(uint8_t type_, int port_, stage_device_id_t cid_)
+      : port(port_), type(type_), cid(cid_){};
+  // CLOCK_REALTIME in ns, set by event_log_t::add():
+  int64_t t_ns = 0;
+  int32_t port = 0;
+  uint8_t type = 0;
+  stage_device_id_t cid = 0;
+  int32_t i[2] = {0, 0};
+  double v[6] = {0, 0, 0, 0, 0, 0};
+};
+
+/**
+ * Asynchronous log of frequent events.
+ *
+ * add() copies a binary record into a ring buffer of the calling
+ * thread and never blocks, formats or allocates, except when a thread
+ * logs for the first time. A background thread formats the records
+ * in the order of their time stamps and writes them with log().
+ *
+ * Each thread limits each event type of each client with a token
+ * bucket, so a client which floods one type does not suppress the
+ * events of the others. Events above the rate are suppressed, and
+ * events which do not fit into the queue are dropped; both are counted
+ * and reported by the writer thread at most once per EVLOGREPORTMS.
+ *
+ * After flush(), add() writes the events itself.
+ */
+class event_log_t : public metrics_source_t {
+public:
+  ~event_log_t();
+  /// The log of the process
+  static event_log_t& instance();
+  /// Queue an event (any thread)
+  void add(evlog_record_t rec);
+  /**
+   * Set the rate limit of an event type; call before logging.
+   *
+   * @param type Event type
+   * @param rate Events per second, thread and client
+   * @param burst Events which may exceed the rate at once
+   */
+  void set_rate(uint8_t type, double rate, double burst);
+  /// Format and write all queued events, and stop the writer thread
+  void flush();
+  uint64_t num_suppressed(uint8_t type) const { return suppressed[type]; };
+  uint64_t num_dropped() const;
+  void write_metrics(metrics_writer_t& w);
+
+private:
+  event_log_t();
+  class producer_t {
+  public:
+    producer_t() : queue(EVLOGQUEUELEN){};
+    spsc_ring_t<evlog_record_t> queue;
+    // token buckets of each type and client, the last one for other
+    // IDs, used by the producer thread only:
+    double tokens[EVLOG_NUMTYPES][MAX_STAGE_ID + 1];
+    int64_t last_ns[EVLOG_NUMTYPES][MAX_STAGE_ID + 1];
+  };
+  producer_t* local_producer();
+  void writer();
+  void drain(std::vector<evlog_record_t>& recs);
+  void write(const evlog_record_t& rec);
+  void report(int64_t now_ns);
+  double rate[EVLOG_NUMTYPES];
+  double burst[EVLOG_NUMTYPES];
+  std::atomic<uint64_t> suppressed[EVLOG_NUMTYPES];
+  uint64_t reported_suppressed[EVLOG_NUMTYPES];
+  uint64_t reported_dropped = 0;
+  int64_t last_report_ns = 0;
+  int last_port = 0;
+  // producers are registered once per thread and never removed:
+  mutable std::mutex mtx;
+  std::vector<std::unique_ptr<producer_t>> producers;
+  std::atomic<bool> run{false};
+  // flush() was called, no writer thread drains the queues:
+  std::atomic<bool> stopped{false};
+  // the queues are drained by one thread at a time:
+  std::mutex drainmtx;
+  std::thread thread;
+};
+
+/// The log of the process
+inline event_log_t& evlog()
+{
+  return event_log_t::instance();
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
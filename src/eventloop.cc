@@ -0,0 +1,127 @@
+#include "eventloop.h"
+#include "common.h"
+#include "errmsg.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <pthread.h>
+#include <sys/epoll.h>
+#endif
+
+// maximum number of events handled per epoll_wait call:
+#define MAXEVENTS 64
+
+// epoll timeout, to check for termination, in ms:
+#define EPOLLTIMEOUT_MS 100
+
+void fd_handler_t::wait_writable(bool on)
+{
+#ifdef LINUX
+  if((on == writable_wait) || (epfd < 0))
+    return;
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (on ? EPOLLOUT : 0);
+  ev.data.ptr = this;
+  if(epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+    writable_wait = on;
+#endif
+}
+
+epoll_pool_t::epoll_pool_t(size_t nthreads_, int prio_, bool pin_to_cores)
+    : nthreads(std::max((size_t)1, nthreads_)), prio(prio_), pin(pin_to_cores)
+{
+#ifdef LINUX
+  for(size_t k = 0; k < nthreads; ++k) {
+    int epfd(epoll_create1(0));
+    if(epfd < 0)
+      throw ErrMsg("Unable to create epoll instance.", errno);
+    epfds.push_back(epfd);
+  }
+#endif
+}
+
+epoll_pool_t::~epoll_pool_t()
+{
+  stop();
+  for(auto epfd : epfds)
+    ::close(epfd);
+}
+
+void epoll_pool_t::add(int fd, fd_handler_t* handler)
+{
+  handlers.push_back(handler);
+#ifdef LINUX
+  int flags(fcntl(fd, F_GETFL, 0));
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = handler;
+  // distribute file descriptors round robin among the threads:
+  if(epoll_ctl(epfds[next], EPOLL_CTL_ADD, fd, &ev) < 0)
+    throw ErrMsg("Unable to add file descriptor to epoll instance.", errno);
+  handler->fd = fd;
+  handler->epfd = epfds[next];
+  next = (next + 1) % nthreads;
+#endif
+}
+
+void epoll_pool_t::start()
+{
+  stop();
+  run = true;
+#ifdef LINUX
+  for(size_t k = 0; k < nthreads; ++k)
+    threads.emplace_back(&epoll_pool_t::worker, this, k);
+#else
+  for(size_t k = 0; k < handlers.size(); ++k)
+    threads.emplace_back(&epoll_pool_t::worker, this, k);
+#endif
+}
+
+void epoll_pool_t::stop()
+{
+  run = false;
+  for(auto& th : threads)
+    if(th.joinable())
+      th.join();
+  threads.clear();
+}
+
+void epoll_pool_t::worker(size_t k)
+{
+  set_thread_prio(prio);
+#ifdef LINUX
+  if(pin) {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(k % std::max(1u, std::thread::hardware_concurrency()), &cpuset);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+  }
+  struct epoll_event events[MAXEVENTS];
+  while(run) {
+    int n(epoll_wait(epfds[k], events, MAXEVENTS, EPOLLTIMEOUT_MS));
+    for(int e = 0; e < n; ++e) {
+      fd_handler_t* h((fd_handler_t*)(events[e].data.ptr));
+      // EPOLLERR is always reported, and level triggered:
+      if(events[e].events & EPOLLERR)
+        h->on_error();
+      if(events[e].events & EPOLLIN)
+        h->on_readable();
+      if(events[e].events & EPOLLOUT)
+        h->on_writable();
+    }
+  }
+#else
+  while(run)
+    handlers[k]->on_readable();
+#endif
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
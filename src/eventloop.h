@@ -0,0 +1,74 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/**
+ * Receiver of readiness events of a file descriptor.
+ */
+class fd_handler_t {
+public:
+  virtual ~fd_handler_t(){};
+  /// Called when the file descriptor is readable
+  virtual void on_readable() = 0;
+  /**
+   * Called while the error queue of the socket is not empty; the
+   * handler has to drain it, otherwise the event is reported again.
+   */
+  virtual void on_error() = 0;
+  /// Called when the file descriptor is writable, see wait_writable()
+  virtual void on_writable(){};
+
+protected:
+  /// Report writability with on_writable() until called with false
+  void wait_writable(bool on);
+
+private:
+  friend class epoll_pool_t;
+  int fd = -1;
+  int epfd = -1;
+  bool writable_wait = false;
+};
+
+/**
+ * Fixed pool of threads serving many file descriptors.
+ *
+ * On Linux each thread runs its own epoll loop, and each file
+ * descriptor is assigned to exactly one thread, so a handler is never
+ * called concurrently. File descriptors are switched to non-blocking
+ * mode. Threads can be pinned to one core each. On other systems one
+ * thread per file descriptor calls the handler in a loop, relying on
+ * the socket timeout.
+ */
+class epoll_pool_t {
+public:
+  epoll_pool_t(size_t nthreads, int prio, bool pin_to_cores);
+  ~epoll_pool_t();
+  /// Register a file descriptor; must be called before start()
+  void add(int fd, fd_handler_t* handler);
+  void start();
+  void stop();
+  size_t size() const { return nthreads; };
+
+private:
+  void worker(size_t k);
+  size_t nthreads;
+  int prio;
+  bool pin;
+  std::atomic<bool> run{false};
+  std::vector<std::thread> threads;
+  std::vector<int> epfds;
+  std::vector<fd_handler_t*> handlers;
+  size_t next = 0;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,240 @@
+#include "handoff.h"
+#include "errmsg.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static struct sockaddr_un unix_addr(const std::string& path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(path.size() >= sizeof(addr.sun_path))
+    throw ErrMsg("Hand-over socket path \"" + path + "\" is too long.");
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+static void write_all(int fd, const char* buf, size_t len)
+{
+  while(len) {
+    ssize_t r(::write(fd, buf, len));
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      throw ErrMsg("Unable to send the hand-over state.", errno);
+    }
+    buf += r;
+    len -= r;
+  }
+}
+
+static void read_all(int fd, char* buf, size_t len)
+{
+  while(len) {
+    ssize_t r(::read(fd, buf, len));
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      throw ErrMsg("Unable to receive the hand-over state.", errno);
+    }
+    if(r == 0)
+      throw ErrMsg("The running server closed the hand-over connection.");
+    buf += r;
+    len -= r;
+  }
+}
+
+handoff_listener_t::handoff_listener_t(const std::string& path_) : path(path_)
+{
+  struct sockaddr_un addr(unix_addr(path));
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0)
+    throw ErrMsg("Unable to create hand-over socket.", errno);
+  // a stale socket of a previous process:
+  unlink(path.c_str());
+  if((bind(fd, (struct sockaddr*)(&addr), sizeof(addr)) < 0) ||
+     (chmod(path.c_str(), 0600) < 0) || (listen(fd, 1) < 0)) {
+    int err(errno);
+    ::close(fd);
+    throw ErrMsg("Unable to listen for hand-over on \"" + path + "\".", err);
+  }
+  struct stat st;
+  if(stat(path.c_str(), &st) == 0)
+    ino = st.st_ino;
+}
+
+handoff_listener_t::~handoff_listener_t()
+{
+  if(conn >= 0)
+    ::close(conn);
+  ::close(fd);
+  // a new process which took over the room listens on the same path:
+  struct stat st;
+  if((stat(path.c_str(), &st) == 0) && (st.st_ino == ino))
+    unlink(path.c_str());
+}
+
+bool handoff_listener_t::poll()
+{
+  if(conn >= 0)
+    return true;
+  int c(accept4(fd, NULL, NULL, SOCK_CLOEXEC));
+  if(c < 0)
+    return false;
+#ifdef LINUX
+  // the sockets of the room are passed to processes of the same user
+  // only:
+  struct ucred cred;
+  socklen_t len(sizeof(cred));
+  if((getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) ||
+     (cred.uid != getuid())) {
+    ::close(c);
+    return false;
+  }
+#endif
+  // accepted sockets do not inherit O_NONBLOCK on Linux, but may on
+  // other systems; the state is sent with blocking writes:
+  int flags(fcntl(c, F_GETFL));
+  if(flags >= 0)
+    fcntl(c, F_SETFL, flags & ~O_NONBLOCK);
+  conn = c;
+  return true;
+}
+
+void handoff_listener_t::send(const handoff_state_t& state)
+{
+  if(conn < 0)
+    throw ErrMsg("No process is waiting for the hand-over.");
+  // the connection is used once, also if sending fails:
+  int c(conn);
+  conn = -1;
+  try {
+    send(c, state);
+  }
+  catch(...) {
+    ::close(c);
+    throw;
+  }
+  ::close(c);
+}
+
+void handoff_listener_t::send(int conn, const handoff_state_t& state)
+{
+  std::vector<int> fds(state.udpfds);
+  if(state.tcpfd >= 0)
+    fds.push_back(state.tcpfd);
+  if(fds.empty() || (fds.size() > HANDOFFMAXFDS))
+    throw ErrMsg("Invalid number of sockets for the hand-over.");
+  handoff_header_t hdr(state.hdr);
+  hdr.magic = HANDOFFMAGIC;
+  hdr.version = HANDOFFVERSION;
+  hdr.hdrsize = sizeof(handoff_header_t);
+  hdr.epsize = sizeof(handoff_endpoint_t);
+  hdr.nudp = state.udpfds.size();
+  hdr.has_tcp = (state.tcpfd >= 0);
+  hdr.nendpoints = state.endpoints.size();
+  // the header carries the sockets:
+  struct iovec iov;
+  iov.iov_base = &hdr;
+  iov.iov_len = sizeof(hdr);
+  std::vector<char> ctrl(CMSG_SPACE(fds.size() * sizeof(int)), 0);
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctrl.data();
+  mh.msg_controllen = ctrl.size();
+  struct cmsghdr* cm(CMSG_FIRSTHDR(&mh));
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+  memcpy(CMSG_DATA(cm), fds.data(), fds.size() * sizeof(int));
+  ssize_t r(sendmsg(conn, &mh, MSG_NOSIGNAL));
+  if(r < 0)
+    throw ErrMsg("Unable to send the hand-over sockets.", errno);
+  write_all(conn, ((const char*)(&hdr)) + r, sizeof(hdr) - r);
+  write_all(conn, (const char*)(state.endpoints.data()),
+            state.endpoints.size() * sizeof(handoff_endpoint_t));
+}
+
+void handoff_receive(const std::string& path, handoff_state_t& state)
+{
+  struct sockaddr_un addr(unix_addr(path));
+  int fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if(fd < 0)
+    throw ErrMsg("Unable to create hand-over socket.", errno);
+  // received sockets are closed if the state is incomplete:
+  std::vector<int> fds;
+  try {
+    struct timeval tv;
+    tv.tv_sec = HANDOFFTIMEOUTMS / 1000;
+    tv.tv_usec = 1000 * (HANDOFFTIMEOUTMS % 1000);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if(connect(fd, (struct sockaddr*)(&addr), sizeof(addr)) < 0)
+      throw ErrMsg("Unable to connect to the running server on \"" + path +
+                       "\".",
+                   errno);
+    handoff_header_t& hdr(state.hdr);
+    struct iovec iov;
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    std::vector<char> ctrl(CMSG_SPACE(HANDOFFMAXFDS * sizeof(int)), 0);
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl.data();
+    mh.msg_controllen = ctrl.size();
+    ssize_t r(recvmsg(fd, &mh, MSG_CMSG_CLOEXEC));
+    if(r <= 0)
+      throw ErrMsg("No hand-over state from the running server.", errno);
+    for(struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm;
+        cm = CMSG_NXTHDR(&mh, cm))
+      if((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_RIGHTS)) {
+        size_t n((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        fds.resize(n);
+        memcpy(fds.data(), CMSG_DATA(cm), n * sizeof(int));
+      }
+    if(mh.msg_flags & MSG_CTRUNC)
+      throw ErrMsg("Too many sockets in the hand-over state.");
+    // the format is checked before the rest of the header is read,
+    // whose size may differ:
+    size_t prefix(offsetof(handoff_header_t, epsize) + sizeof(hdr.epsize));
+    if((size_t)r < prefix)
+      read_all(fd, ((char*)(&hdr)) + r, prefix - r);
+    if((hdr.magic != HANDOFFMAGIC) || (hdr.version != HANDOFFVERSION) ||
+       (hdr.hdrsize != sizeof(handoff_header_t)) ||
+       (hdr.epsize != sizeof(handoff_endpoint_t)))
+      throw ErrMsg("The running server uses an incompatible hand-over format.");
+    if((size_t)r < sizeof(hdr))
+      read_all(fd, ((char*)(&hdr)) + std::max((size_t)r, prefix),
+               sizeof(hdr) - std::max((size_t)r, prefix));
+    if(!hdr.nudp || (fds.size() != (size_t)hdr.nudp + (hdr.has_tcp ? 1 : 0)))
+      throw ErrMsg("Invalid number of sockets in the hand-over state.");
+    state.endpoints.resize(hdr.nendpoints);
+    read_all(fd, (char*)(state.endpoints.data()),
+             state.endpoints.size() * sizeof(handoff_endpoint_t));
+  }
+  catch(...) {
+    for(auto s : fds)
+      ::close(s);
+    ::close(fd);
+    throw;
+  }
+  ::close(fd);
+  state.udpfds.assign(fds.begin(), fds.begin() + state.hdr.nudp);
+  state.tcpfd = state.hdr.has_tcp ? fds.back() : -1;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
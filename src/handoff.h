@@ -0,0 +1,115 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "boxcrypt.h"
+#include "callerlist.h"
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+// first bytes of a hand-over message, "OVHO":
+#define HANDOFFMAGIC 0x4f56484f
+
+// format version of the hand-over message:
+#define HANDOFFVERSION 2
+
+// maximum number of sockets passed to the new process:
+#define HANDOFFMAXFDS 32
+
+// time the new process waits for the state of the running one, in ms:
+#define HANDOFFTIMEOUTMS 5000
+
+/*
+ * The new process connects to the Unix socket of the running one. The
+ * running process stops receiving, then sends a handoff_header_t with
+ * its UDP sockets (and the TCP relay socket, if any) attached as
+ * SCM_RIGHTS, followed by nendpoints handoff_endpoint_t records. The
+ * state is exchanged between two builds on the same host, so all
+ * values are in host byte order and native layout. The sizes of both
+ * structures follow the version, so builds with a different layout
+ * reject the state instead of misreading it.
+ */
+struct handoff_header_t {
+  uint32_t magic;
+  uint32_t version;
+  // sizeof(handoff_header_t) and sizeof(handoff_endpoint_t) of the
+  // sender:
+  uint32_t hdrsize;
+  uint32_t epsize;
+  int32_t port;
+  secret_t secret;
+  uint8_t fixed_secret;
+  // UDP sockets, the first one is the main socket:
+  uint8_t nudp;
+  // a listening TCP relay socket follows the UDP sockets:
+  uint8_t has_tcp;
+  uint8_t nendpoints;
+  // key pair of the server, clients encrypt to its public key:
+  uint8_t public_key[crypto_box_PUBLICKEYBYTES];
+  uint8_t secret_key[crypto_box_SECRETKEYBYTES];
+};
+
+struct handoff_endpoint_t {
+  stage_device_id_t cid;
+  uint8_t has_pubkey;
+  epmode_t mode;
+  int32_t timeout;
+  endpoint_t ep;
+  endpoint_t localep;
+  uint8_t pubkey[crypto_box_PUBLICKEYBYTES];
+};
+
+/**
+ * State of a room passed to a new server process. The receiver owns
+ * the received sockets.
+ */
+class handoff_state_t {
+public:
+  handoff_header_t hdr;
+  std::vector<int> udpfds;
+  int tcpfd = -1;
+  std::vector<handoff_endpoint_t> endpoints;
+};
+
+/**
+ * Unix socket of a running server, on which a new process can take
+ * over the room.
+ *
+ * Only processes of the same user are accepted. poll() does not
+ * block; call it when get_fd() is readable.
+ */
+class handoff_listener_t {
+public:
+  handoff_listener_t(const std::string& path);
+  ~handoff_listener_t();
+  /// True if a new process connected and waits for the state
+  bool poll();
+  /// Send the state to the waiting process, and close the connection
+  void send(const handoff_state_t& state);
+  /// Listening socket, readable when a new process connects
+  int get_fd() const { return fd; };
+
+private:
+  void send(int conn, const handoff_state_t& state);
+  std::string path;
+  // inode of the socket file, which is removed on exit:
+  ino_t ino = 0;
+  int fd = -1;
+  int conn = -1;
+};
+
+/**
+ * Connect to the Unix socket of the running server and receive its
+ * state. Throws on error.
+ */
+void handoff_receive(const std::string& path, handoff_state_t& state);
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
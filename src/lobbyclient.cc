@@ -0,0 +1,184 @@
+#include "lobbyclient.h"
+#include "errmsg.h"
+
+static size_t write_to_string(void* contents, size_t size, size_t nmemb,
+                              void* userp)
+{
+  size_t realsize(size * nmemb);
+  ((std::string*)userp)->append((const char*)contents, realsize);
+  return realsize;
+}
+
+lobby_client_t::lobby_client_t()
+    : multi(curl_multi_init()), waiting(1), npending(1, 0)
+{
+  if(!multi)
+    throw ErrMsg("Unable to initialize curl multi handle.");
+}
+
+lobby_client_t::~lobby_client_t()
+{
+  for(auto& t : active) {
+    curl_multi_remove_handle(multi, t->easy);
+    curl_easy_cleanup(t->easy);
+  }
+  for(auto easy : idle)
+    curl_easy_cleanup(easy);
+  curl_multi_cleanup(multi);
+}
+
+size_t lobby_client_t::add_queue()
+{
+  waiting.emplace_back();
+  npending.push_back(0);
+  return waiting.size() - 1;
+}
+
+bool lobby_client_t::get(const std::string& url, const std::string& userpwd,
+                         handler_t handler, size_t queue)
+{
+  std::unique_ptr<transfer_t> t(new transfer_t());
+  t->url = url;
+  t->userpwd = userpwd;
+  t->handler = handler;
+  t->queue = queue;
+  return enqueue(std::move(t));
+}
+
+bool lobby_client_t::post(const std::string& url, const std::string& userpwd,
+                          const std::string& body, handler_t handler,
+                          size_t queue)
+{
+  std::unique_ptr<transfer_t> t(new transfer_t());
+  t->url = url;
+  t->userpwd = userpwd;
+  t->body = body;
+  t->handler = handler;
+  t->queue = queue;
+  t->is_post = true;
+  return enqueue(std::move(t));
+}
+
+bool lobby_client_t::enqueue(std::unique_ptr<transfer_t> t)
+{
+  if((t->queue >= waiting.size()) ||
+     (npending[t->queue] >= LOBBYMAXQUEUED)) {
+    ++num_rejected;
+    return false;
+  }
+  ++npending[t->queue];
+  waiting[t->queue].push_back(std::move(t));
+  launch();
+  return true;
+}
+
+// start waiting requests while transfers are free, one queue after
+// the other:
+void lobby_client_t::launch()
+{
+  size_t nempty(0);
+  while((active.size() < LOBBYMAXTRANSFERS) && (nempty < waiting.size())) {
+    size_t q(next_queue);
+    next_queue = (next_queue + 1) % waiting.size();
+    if(waiting[q].empty()) {
+      ++nempty;
+      continue;
+    }
+    nempty = 0;
+    std::unique_ptr<transfer_t> t(std::move(waiting[q].front()));
+    waiting[q].pop_front();
+    if(start(*t)) {
+      ++num_requests;
+      active.push_back(std::move(t));
+    } else {
+      // the handler is called by poll(), not by get() or post():
+      ++num_rejected;
+      failed.push_back(std::move(t));
+    }
+  }
+}
+
+bool lobby_client_t::start(transfer_t& t)
+{
+  if(idle.empty()) {
+    t.easy = curl_easy_init();
+    if(!t.easy)
+      return false;
+  } else {
+    // reuse a handle, to keep its connection alive:
+    t.easy = idle.back();
+    idle.pop_back();
+    curl_easy_reset(t.easy);
+  }
+  CURL* easy(t.easy);
+  curl_easy_setopt(easy, CURLOPT_URL, t.url.c_str());
+  if(t.userpwd.size())
+    curl_easy_setopt(easy, CURLOPT_USERPWD, t.userpwd.c_str());
+  curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, write_to_string);
+  curl_easy_setopt(easy, CURLOPT_WRITEDATA, (void*)&(t.response));
+  curl_easy_setopt(easy, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
+  curl_easy_setopt(easy, CURLOPT_USERAGENT, "libcurl-agent/1.0");
+  curl_easy_setopt(easy, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(easy, CURLOPT_TIMEOUT_MS, (long)LOBBYTIMEOUTMS);
+  curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+  if(t.is_post) {
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDS, t.body.c_str());
+    curl_easy_setopt(easy, CURLOPT_POSTFIELDSIZE, (long)t.body.size());
+  }
+  if(curl_multi_add_handle(multi, easy) != CURLM_OK) {
+    idle.push_back(easy);
+    t.easy = NULL;
+    return false;
+  }
+  return true;
+}
+
+// the handler may queue new requests:
+void lobby_client_t::finish(std::unique_ptr<transfer_t> t, CURLcode res,
+                            long httpcode)
+{
+  --npending[t->queue];
+  if(t->handler)
+    t->handler(res, httpcode, t->response);
+}
+
+void lobby_client_t::poll()
+{
+  std::vector<std::unique_ptr<transfer_t>> f;
+  f.swap(failed);
+  for(auto& t : f)
+    finish(std::move(t), CURLE_FAILED_INIT, 0);
+  if(active.empty())
+    return;
+  int running(0);
+  curl_multi_perform(multi, &running);
+  CURLMsg* msg;
+  int msgs_left(0);
+  while((msg = curl_multi_info_read(multi, &msgs_left))) {
+    if(msg->msg != CURLMSG_DONE)
+      continue;
+    CURL* easy(msg->easy_handle);
+    CURLcode res(msg->data.result);
+    curl_multi_remove_handle(multi, easy);
+    for(auto it = active.begin(); it != active.end(); ++it) {
+      if((*it)->easy == easy) {
+        std::unique_ptr<transfer_t> t(std::move(*it));
+        active.erase(it);
+        long httpcode(0);
+        curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &httpcode);
+        if((res != CURLE_OK) || (httpcode >= 400))
+          ++num_failed;
+        idle.push_back(easy);
+        finish(std::move(t), res, httpcode);
+        break;
+      }
+    }
+  }
+  launch();
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
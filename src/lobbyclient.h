@@ -0,0 +1,105 @@
+#ifndef LOBBYCLIENT_H
+#define LOBBYCLIENT_H
+
+#include <atomic>
+#include <curl/curl.h>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+// upper limit of concurrent lobby requests:
+#define LOBBYMAXTRANSFERS 8
+
+// upper limit of running and waiting requests of one queue:
+#define LOBBYMAXQUEUED 16
+
+// timeout of a single lobby request, in ms:
+#define LOBBYTIMEOUTMS 10000
+
+// response of a lobby which accepted batched latency reports
+// (?latreports=); any other response means that the lobby does not
+// support them, e.g. an empty one from a lobby which ignores unknown
+// keys:
+#define LOBBYLATREPORTSACK "latreports:ok"
+
+/**
+ * Asynchronous HTTP client for lobby requests, based on the curl multi
+ * interface.
+ *
+ * Requests are started with get() or post() and return immediately.
+ * poll() drives all transfers without blocking and calls the
+ * completion handlers of finished requests, so the handlers run in
+ * the thread which calls poll(). Easy handles are reused, which keeps
+ * the connections to the lobby alive between requests.
+ *
+ * Several rooms can share one client, and with it the connections.
+ * Each room then uses its own request queue (add_queue()); requests
+ * beyond LOBBYMAXTRANSFERS wait in their queue, and the queues are
+ * served in turn, so a room with many requests does not delay the
+ * announcements of the others.
+ *
+ * An instance is not thread safe; use it from a single thread.
+ */
+class lobby_client_t {
+public:
+  /// Completion handler: curl result, HTTP status code and response body
+  typedef std::function<void(CURLcode, long, const std::string&)>
+      handler_t;
+  lobby_client_t();
+  ~lobby_client_t();
+  /// Create a request queue; queue 0 always exists
+  size_t add_queue();
+  /// Queue a GET request, false if too many requests are pending
+  bool get(const std::string& url, const std::string& userpwd,
+           handler_t handler, size_t queue = 0);
+  /// Queue a POST request, false if too many requests are pending
+  bool post(const std::string& url, const std::string& userpwd,
+            const std::string& body, handler_t handler, size_t queue = 0);
+  /// Progress pending transfers and call handlers of finished ones
+  void poll();
+  size_t in_flight() const { return active.size(); };
+  /// Running and waiting requests of a queue
+  size_t pending(size_t queue) const { return npending[queue]; };
+  // statistics:
+  std::atomic<uint64_t> num_requests{0};
+  std::atomic<uint64_t> num_failed{0};
+  std::atomic<uint64_t> num_rejected{0};
+
+private:
+  class transfer_t {
+  public:
+    CURL* easy = NULL;
+    std::string url;
+    std::string userpwd;
+    std::string body;
+    std::string response;
+    handler_t handler;
+    size_t queue = 0;
+    bool is_post = false;
+  };
+  bool enqueue(std::unique_ptr<transfer_t> t);
+  void launch();
+  bool start(transfer_t& t);
+  void finish(std::unique_ptr<transfer_t> t, CURLcode res, long httpcode);
+  CURLM* multi;
+  std::vector<std::unique_ptr<transfer_t>> active;
+  // requests which could not be started:
+  std::vector<std::unique_ptr<transfer_t>> failed;
+  std::vector<CURL*> idle;
+  // waiting requests and number of pending requests of each queue:
+  std::vector<std::deque<std::unique_ptr<transfer_t>>> waiting;
+  std::vector<size_t> npending;
+  // queue which starts the next request:
+  size_t next_queue = 0;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
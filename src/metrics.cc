@@ -0,0 +1,171 @@
+#include "metrics.h"
+#include "errmsg.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+const double metrics_delay_bounds[METRICS_DELAYBUCKETS] = {
+    0.0001, 0.0002, 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1};
+
+void endpoint_metrics_t::add_delay(double seconds)
+{
+  size_t k(0);
+  while((k < METRICS_DELAYBUCKETS) && (seconds > metrics_delay_bounds[k]))
+    ++k;
+  delay_hist[k].add(1);
+  delay_ns.add((uint64_t)(std::max(0.0, seconds) * 1.0e9));
+}
+
+std::string metrics_label(const std::string& name, const std::string& value)
+{
+  std::string s(name + "=\"");
+  for(auto c : value) {
+    switch(c) {
+    case '\\':
+      s += "\\\\";
+      break;
+    case '"':
+      s += "\\\"";
+      break;
+    case '\n':
+      s += "\\n";
+      break;
+    default:
+      s += c;
+    }
+  }
+  return s + "\"";
+}
+
+void metrics_writer_t::add(const std::string& family, const char* type,
+                           const char* help, const std::string& name,
+                           const std::string& labels, double value)
+{
+  auto it(families.find(family));
+  if(it == families.end()) {
+    order.push_back(family);
+    family_t f;
+    f.type = type;
+    f.help = help;
+    it = families.insert(std::make_pair(family, f)).first;
+  }
+  char ctmp[64];
+  snprintf(ctmp, sizeof(ctmp), "%.17g", value);
+  it->second.samples += name + "{" + labels + "} " + ctmp + "\n";
+}
+
+std::string metrics_writer_t::str() const
+{
+  std::string s;
+  for(const auto& name : order) {
+    const family_t& f(families.find(name)->second);
+    s += "# HELP " + name + " " + f.help + "\n";
+    s += "# TYPE " + name + " " + f.type + "\n";
+    s += f.samples;
+  }
+  return s;
+}
+
+metrics_server_t::metrics_server_t(int port)
+{
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if(fd < 0)
+    throw ErrMsg("Unable to create metrics socket.", errno);
+  int on(1);
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  endpoint_t ep;
+  memset(&ep, 0, sizeof(ep));
+  ep.sin_family = AF_INET;
+  ep.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ep.sin_port = htons(port);
+  if((bind(fd, (struct sockaddr*)(&ep), sizeof(ep)) < 0) ||
+     (listen(fd, 8) < 0)) {
+    int err(errno);
+    close(fd);
+    throw ErrMsg("Unable to bind metrics socket to port " +
+                     std::to_string(port) + ".",
+                 err);
+  }
+  thread = std::thread(&metrics_server_t::service, this);
+}
+
+metrics_server_t::~metrics_server_t()
+{
+  running = false;
+  if(thread.joinable())
+    thread.join();
+  close(fd);
+}
+
+void metrics_server_t::add_source(metrics_source_t* src)
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  sources.push_back(src);
+}
+
+void metrics_server_t::service()
+{
+  while(running) {
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, 100) <= 0)
+      continue;
+    int cfd(accept(fd, NULL, NULL));
+    if(cfd < 0)
+      continue;
+    answer(cfd);
+    close(cfd);
+  }
+}
+
+void metrics_server_t::answer(int cfd)
+{
+  // read the request header, its content does not matter:
+  std::string req;
+  char buf[1024];
+  while(req.find("\r\n\r\n") == std::string::npos) {
+    struct pollfd pfd;
+    pfd.fd = cfd;
+    pfd.events = POLLIN;
+    if(poll(&pfd, 1, 1000) <= 0)
+      return;
+    ssize_t n(recv(cfd, buf, sizeof(buf), 0));
+    if(n <= 0)
+      return;
+    req.append(buf, n);
+    if(req.size() > 16384)
+      return;
+  }
+  metrics_writer_t w;
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    for(auto src : sources)
+      src->write_metrics(w);
+  }
+  std::string body(w.str());
+  std::string resp("HTTP/1.0 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: " +
+                   std::to_string(body.size()) +
+                   "\r\n"
+                   "Connection: close\r\n\r\n" +
+                   body);
+  size_t pos(0);
+  while(pos < resp.size()) {
+    ssize_t n(send(cfd, resp.data() + pos, resp.size() - pos, 0));
+    if(n <= 0)
+      return;
+    pos += n;
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
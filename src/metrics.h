@@ -0,0 +1,134 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "common.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// number of finite buckets of the forwarding delay histogram:
+#define METRICS_DELAYBUCKETS 10
+
+/// Upper bounds of the forwarding delay histogram buckets, in seconds
+extern const double metrics_delay_bounds[METRICS_DELAYBUCKETS];
+
+/**
+ * Counter with a single writer thread.
+ *
+ * The writer increments with a relaxed load and store instead of an
+ * atomic read-modify-write, so counting costs no more than a plain
+ * integer. Any thread may read the counter.
+ */
+class metrics_counter_t {
+public:
+  void add(uint64_t v)
+  {
+    val.store(val.load(std::memory_order_relaxed) + v,
+              std::memory_order_relaxed);
+  };
+  uint64_t get() const { return val.load(std::memory_order_relaxed); };
+
+private:
+  std::atomic<uint64_t> val{0};
+};
+
+/**
+ * Forwarding counters of one endpoint.
+ */
+class endpoint_metrics_t {
+public:
+  metrics_counter_t packets_in;
+  metrics_counter_t bytes_in;
+  metrics_counter_t packets_out;
+  metrics_counter_t bytes_out;
+  // packets which could not be decrypted, encrypted or routed:
+  metrics_counter_t drops;
+  // time spent on decryption and encryption, in nanoseconds:
+  metrics_counter_t crypto_ns;
+  // in-server delay of packets of this sender, the last bucket counts
+  // packets above the largest bound:
+  metrics_counter_t delay_hist[METRICS_DELAYBUCKETS + 1];
+  metrics_counter_t delay_ns;
+  void add_delay(double seconds);
+};
+
+/**
+ * Counters of all endpoints, written by one receive thread.
+ */
+class thread_metrics_t {
+public:
+  thread_metrics_t() : ep(MAX_STAGE_ID){};
+  std::vector<endpoint_metrics_t> ep;
+};
+
+/**
+ * Format a label as name="value", with backslash, double quote and
+ * line feed in the value escaped as the exposition format requires.
+ */
+std::string metrics_label(const std::string& name, const std::string& value);
+
+/**
+ * Collect samples of a scrape and format them in the Prometheus text
+ * exposition format, with one HELP and TYPE line per metric family.
+ */
+class metrics_writer_t {
+public:
+  /// Add a sample; name may extend the family name by a suffix
+  void add(const std::string& family, const char* type, const char* help,
+           const std::string& name, const std::string& labels, double value);
+  std::string str() const;
+
+private:
+  class family_t {
+  public:
+    std::string type;
+    std::string help;
+    std::string samples;
+  };
+  std::vector<std::string> order;
+  std::map<std::string, family_t> families;
+};
+
+/**
+ * Interface of objects which report metrics.
+ */
+class metrics_source_t {
+public:
+  virtual ~metrics_source_t(){};
+  virtual void write_metrics(metrics_writer_t& w) = 0;
+};
+
+/**
+ * Minimal HTTP server on the loopback interface, which answers every
+ * request with the metrics of all sources.
+ *
+ * Scrapes run in the thread of the server and only read counters, so
+ * they do not disturb the forwarding threads.
+ */
+class metrics_server_t {
+public:
+  metrics_server_t(int port);
+  ~metrics_server_t();
+  void add_source(metrics_source_t* src);
+
+private:
+  void service();
+  void answer(int fd);
+  int fd;
+  std::atomic<bool> running{true};
+  std::mutex mtx;
+  std::vector<metrics_source_t*> sources;
+  std::thread thread;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
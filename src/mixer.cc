@@ -0,0 +1,228 @@
+#include "mixer.h"
+#include "mixkernels.h"
+#include <string.h>
+
+// states of a block:
+#define MIXSTATE_FREE 0
+#define MIXSTATE_OPEN 1
+#define MIXSTATE_DONE 2
+
+// the state word: block number + 1, state, and number of
+// contributions:
+static inline uint64_t mix_word(int64_t num, uint64_t st, uint64_t count)
+{
+  return ((uint64_t)(num + 1) << 24) | (st << 16) | count;
+}
+
+static inline int64_t mix_num(uint64_t w)
+{
+  return (int64_t)(w >> 24) - 1;
+}
+
+static inline uint64_t mix_state(uint64_t w)
+{
+  return (w >> 16) & 0xff;
+}
+
+static inline uint64_t mix_count(uint64_t w)
+{
+  return w & 0xffff;
+}
+
+mix_block_t::mix_block_t()
+    : filled(MAX_STAGE_ID), data(MAX_STAGE_ID), nframes_in(MAX_STAGE_ID, 0),
+      nchannels_in(MAX_STAGE_ID, 0), mixed(MAX_STAGE_ID, 0)
+{
+  for(auto& f : filled)
+    f.store(-1, std::memory_order_relaxed);
+  senders.reserve(MAX_STAGE_ID);
+}
+
+audio_mixer_t::audio_mixer_t()
+    : offset(MAX_STAGE_ID, 0), joined(MAX_STAGE_ID, 0)
+{
+}
+
+size_t audio_mixer_t::add(stage_device_id_t sid, const char* payload,
+                          size_t len, size_t numsenders, mix_block_t** done)
+{
+  if((sid >= MAX_STAGE_ID) || (len < sizeof(mix_header_t)))
+    return 0;
+  mix_header_t hdr;
+  memcpy(&hdr, payload, sizeof(hdr));
+  size_t nsamples((size_t)hdr.nframes * hdr.nchannels);
+  size_t samplesize((hdr.format == MIX_INT16) ? sizeof(int16_t)
+                                              : sizeof(float));
+  if((hdr.nchannels == 0) || (hdr.nchannels > MIX_MAXCHANNELS) ||
+     ((hdr.format != MIX_FLOAT32) && (hdr.format != MIX_INT16)) ||
+     (len != sizeof(hdr) + nsamples * samplesize)) {
+    ++num_rejected;
+    return 0;
+  }
+  // block number of the packet; a new sender, or one which lost its
+  // place, joins the newest block, or the next one if it is already in
+  // the newest:
+  int64_t head(newest.load(std::memory_order_acquire));
+  int64_t k((int64_t)hdr.frame + offset[sid]);
+  if(!joined[sid] || (k + MIXBLOCKS - 2 < head) || (k > head + 1)) {
+    k = std::max(head, (int64_t)0);
+    if(blocks[k % MIXBLOCKS].filled[sid].load(std::memory_order_relaxed) ==
+       k)
+      ++k;
+    offset[sid] = k - (int64_t)hdr.frame;
+    joined[sid] = 1;
+  }
+  size_t ndone(0);
+  // the sender is one block ahead of the missing ones:
+  if(k > 0) {
+    mix_block_t& prev(blocks[(k - 1) % MIXBLOCKS]);
+    if(complete(prev, k - 1))
+      done[ndone++] = &prev;
+  }
+  if(!open(blocks[k % MIXBLOCKS], k)) {
+    if(mix_num(blocks[k % MIXBLOCKS].state.load()) != k) {
+      ++num_late;
+      return ndone;
+    }
+    // the block was completed without the sender, which arrives just
+    // after the others; it continues one block later:
+    ++offset[sid];
+    ++k;
+    if(!open(blocks[k % MIXBLOCKS], k)) {
+      ++num_late;
+      return ndone;
+    }
+  }
+  mix_block_t& b(blocks[k % MIXBLOCKS]);
+  // the data of a sender is written by its own thread only, and read
+  // after its block number was stored:
+  std::vector<float>& data(b.data[sid]);
+  if(data.size() != nsamples)
+    data.resize(nsamples);
+  const char* samples(payload + sizeof(hdr));
+  if(hdr.format == MIX_INT16)
+    mix_from_int16(data.data(), (const int16_t*)samples, nsamples);
+  else
+    memcpy(data.data(), samples, nsamples * sizeof(float));
+  b.nframes_in[sid] = hdr.nframes;
+  b.nchannels_in[sid] = hdr.nchannels;
+  b.filled[sid].store(k, std::memory_order_release);
+  // count the contribution, the last sender completes the block:
+  uint64_t w(b.state.load(std::memory_order_acquire));
+  while((mix_num(w) == k) && (mix_state(w) == MIXSTATE_OPEN)) {
+    uint64_t count(mix_count(w) + 1);
+    bool full(count >= numsenders);
+    if(b.state.compare_exchange_weak(
+           w, mix_word(k, full ? MIXSTATE_DONE : MIXSTATE_OPEN, count),
+           std::memory_order_acq_rel, std::memory_order_acquire)) {
+      if(full) {
+        sum(b, k);
+        done[ndone++] = &b;
+      }
+      break;
+    }
+  }
+  return ndone;
+}
+
+// let the block hold block number num, false if it holds a newer
+// block, or if an older one is still rendered:
+bool audio_mixer_t::open(mix_block_t& b, int64_t num)
+{
+  uint64_t w(b.state.load(std::memory_order_acquire));
+  while(true) {
+    int64_t cur(mix_num(w));
+    if(cur == num)
+      return mix_state(w) == MIXSTATE_OPEN;
+    if((cur > num) || (mix_state(w) == MIXSTATE_DONE))
+      return false;
+    // an older incomplete block is dropped:
+    if(b.state.compare_exchange_weak(w, mix_word(num, MIXSTATE_OPEN, 0),
+                                     std::memory_order_acq_rel,
+                                     std::memory_order_acquire))
+      break;
+  }
+  int64_t n(newest.load(std::memory_order_relaxed));
+  while((n < num) && !newest.compare_exchange_weak(n, num))
+    ;
+  return true;
+}
+
+// complete an open block, true if the calling thread completed it and
+// owns it until release():
+bool audio_mixer_t::complete(mix_block_t& b, int64_t num)
+{
+  uint64_t w(b.state.load(std::memory_order_acquire));
+  while((mix_num(w) == num) && (mix_state(w) == MIXSTATE_OPEN))
+    if(b.state.compare_exchange_weak(
+           w, mix_word(num, MIXSTATE_DONE, mix_count(w)),
+           std::memory_order_acq_rel, std::memory_order_acquire)) {
+      sum(b, num);
+      return true;
+    }
+  return false;
+}
+
+// sum the senders of a completed block; the format of the block is
+// the one of its first sender:
+void audio_mixer_t::sum(mix_block_t& b, int64_t num)
+{
+  for(auto sid : b.senders)
+    b.mixed[sid] = 0;
+  b.senders.clear();
+  b.num = num;
+  for(stage_device_id_t sid = 0; sid != MAX_STAGE_ID; ++sid) {
+    if(b.filled[sid].load(std::memory_order_acquire) != num)
+      continue;
+    if(b.senders.empty()) {
+      b.nframes = b.nframes_in[sid];
+      b.nchannels = b.nchannels_in[sid];
+    } else if((b.nframes != b.nframes_in[sid]) ||
+              (b.nchannels != b.nchannels_in[sid])) {
+      ++num_rejected;
+      continue;
+    }
+    b.senders.push_back(sid);
+    b.mixed[sid] = 1;
+  }
+  size_t nsamples((size_t)b.nframes * b.nchannels);
+  b.sum.assign(nsamples, 0.0f);
+  for(auto sid : b.senders)
+    mix_add(b.sum.data(), b.data[sid].data(), nsamples);
+}
+
+size_t audio_mixer_t::render(const mix_block_t& b, stage_device_id_t rid,
+                             char* dest, size_t maxlen) const
+{
+  if(b.senders.empty())
+    return 0;
+  size_t nsamples((size_t)b.nframes * b.nchannels);
+  size_t len(sizeof(mix_header_t) + nsamples * sizeof(float));
+  if(len > maxlen)
+    return 0;
+  mix_header_t hdr;
+  hdr.frame = (uint32_t)b.num;
+  hdr.nframes = b.nframes;
+  hdr.nchannels = b.nchannels;
+  hdr.format = MIX_FLOAT32;
+  memcpy(dest, &hdr, sizeof(hdr));
+  float* out((float*)(dest + sizeof(hdr)));
+  if((rid < MAX_STAGE_ID) && b.mixed[rid])
+    // mix minus the receiver's own signal:
+    mix_sub(out, b.sum.data(), b.data[rid].data(), nsamples);
+  else
+    memcpy(out, b.sum.data(), nsamples * sizeof(float));
+  return len;
+}
+
+void audio_mixer_t::release(mix_block_t* b)
+{
+  b->state.store(mix_word(b->num, MIXSTATE_FREE, 0),
+                 std::memory_order_release);
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
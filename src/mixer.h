@@ -0,0 +1,111 @@
+#ifndef MIXER_H
+#define MIXER_H
+
+#include "common.h"
+#include "protocol.h"
+#include <atomic>
+#include <vector>
+
+// number of blocks in flight; a sender may run this many blocks ahead
+// of a block which is still rendered:
+#define MIXBLOCKS 4
+
+// maximum number of blocks completed by one call of add():
+#define MIXMAXDONE 2
+
+/**
+ * One block of the mix, in a ring of MIXBLOCKS.
+ *
+ * The state word holds the block number, the state and the number of
+ * contributions, so a block is opened, filled and completed with one
+ * compare-and-swap each. A completed block is owned by the thread
+ * which completed it until release().
+ */
+class mix_block_t {
+public:
+  mix_block_t();
+  // block number, the frame of the mix:
+  int64_t num = -1;
+  uint16_t nframes = 0;
+  uint8_t nchannels = 0;
+  // senders in the mix, and their sum:
+  std::vector<stage_device_id_t> senders;
+  std::vector<float> sum;
+
+private:
+  friend class audio_mixer_t;
+  std::atomic<uint64_t> state{0};
+  // block number filled in by each sender, and its data:
+  std::vector<std::atomic<int64_t>> filled;
+  std::vector<std::vector<float>> data;
+  std::vector<uint16_t> nframes_in;
+  std::vector<uint8_t> nchannels_in;
+  // the sender is in the sum:
+  std::vector<uint8_t> mixed;
+};
+
+/**
+ * Server side mixer for downmix receivers.
+ *
+ * The senders' payloads (see B_MIXPCM) are collected into blocks of
+ * one packet per sender. The frame counter of each sender is mapped to
+ * the common block number when it joins, so the packets of all
+ * senders are aligned to the same block boundaries. A block is
+ * complete when all mixing senders contributed, or when a sender
+ * delivers its next block before that, so a missing sender delays the
+ * mix by at most one period. The sum of a complete block is computed
+ * once; render() then subtracts the receiver's own signal, which costs
+ * O(N) instead of O(N^2) for N senders and receivers.
+ *
+ * The mixer does not lock: add() can be called from several threads,
+ * as long as all packets of one sender are added by the same thread.
+ */
+class audio_mixer_t {
+public:
+  audio_mixer_t();
+  /**
+   * Add the payload of a sender.
+   *
+   * @param numsenders Number of senders which take part in the mix
+   * @param done Blocks completed by this call, in order; render them
+   * and pass them to release()
+   * @return Number of completed blocks, at most MIXMAXDONE
+   */
+  size_t add(stage_device_id_t sid, const char* payload, size_t len,
+             size_t numsenders, mix_block_t** done);
+  /**
+   * Pack the mix of a completed block without the receiver's own
+   * signal.
+   *
+   * @return Length of the payload, or zero on error.
+   */
+  size_t render(const mix_block_t& b, stage_device_id_t rid, char* dest,
+                size_t maxlen) const;
+  /// Return a completed block to the ring
+  void release(mix_block_t* b);
+  /// Packets which did not match the format of the block
+  std::atomic<uint64_t> num_rejected{0};
+  /// Packets which found their block completed, or its slot in use
+  std::atomic<uint64_t> num_late{0};
+
+private:
+  bool open(mix_block_t& b, int64_t num);
+  bool complete(mix_block_t& b, int64_t num);
+  void sum(mix_block_t& b, int64_t num);
+  mix_block_t blocks[MIXBLOCKS];
+  // newest opened block:
+  std::atomic<int64_t> newest{-1};
+  // offset of the frame counter of each sender to the block number,
+  // used by the thread of the sender only:
+  std::vector<int64_t> offset;
+  std::vector<uint8_t> joined;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
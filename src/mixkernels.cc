@@ -0,0 +1,149 @@
+#include "mixkernels.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(__AVX__)
+
+void mix_add(float* acc, const float* x, size_t n)
+{
+  size_t k(0);
+  for(; k + 8 <= n; k += 8)
+    _mm256_storeu_ps(acc + k, _mm256_add_ps(_mm256_loadu_ps(acc + k),
+                                            _mm256_loadu_ps(x + k)));
+  for(; k < n; ++k)
+    acc[k] += x[k];
+}
+
+void mix_sub(float* dest, const float* a, const float* b, size_t n)
+{
+  size_t k(0);
+  for(; k + 8 <= n; k += 8)
+    _mm256_storeu_ps(dest + k, _mm256_sub_ps(_mm256_loadu_ps(a + k),
+                                             _mm256_loadu_ps(b + k)));
+  for(; k < n; ++k)
+    dest[k] = a[k] - b[k];
+}
+
+#elif defined(__SSE2__)
+
+void mix_add(float* acc, const float* x, size_t n)
+{
+  size_t k(0);
+  for(; k + 4 <= n; k += 4)
+    _mm_storeu_ps(acc + k,
+                  _mm_add_ps(_mm_loadu_ps(acc + k), _mm_loadu_ps(x + k)));
+  for(; k < n; ++k)
+    acc[k] += x[k];
+}
+
+void mix_sub(float* dest, const float* a, const float* b, size_t n)
+{
+  size_t k(0);
+  for(; k + 4 <= n; k += 4)
+    _mm_storeu_ps(dest + k,
+                  _mm_sub_ps(_mm_loadu_ps(a + k), _mm_loadu_ps(b + k)));
+  for(; k < n; ++k)
+    dest[k] = a[k] - b[k];
+}
+
+#elif defined(__ARM_NEON)
+
+void mix_add(float* acc, const float* x, size_t n)
+{
+  size_t k(0);
+  for(; k + 4 <= n; k += 4)
+    vst1q_f32(acc + k, vaddq_f32(vld1q_f32(acc + k), vld1q_f32(x + k)));
+  for(; k < n; ++k)
+    acc[k] += x[k];
+}
+
+void mix_sub(float* dest, const float* a, const float* b, size_t n)
+{
+  size_t k(0);
+  for(; k + 4 <= n; k += 4)
+    vst1q_f32(dest + k, vsubq_f32(vld1q_f32(a + k), vld1q_f32(b + k)));
+  for(; k < n; ++k)
+    dest[k] = a[k] - b[k];
+}
+
+#else
+
+void mix_add(float* acc, const float* x, size_t n)
+{
+  for(size_t k = 0; k < n; ++k)
+    acc[k] += x[k];
+}
+
+void mix_sub(float* dest, const float* a, const float* b, size_t n)
+{
+  for(size_t k = 0; k < n; ++k)
+    dest[k] = a[k] - b[k];
+}
+
+#endif
+
+#if defined(__SSE2__)
+
+void mix_from_int16(float* dest, const int16_t* src, size_t n)
+{
+  const __m128 scale(_mm_set1_ps(1.0f / 32768.0f));
+  size_t k(0);
+  for(; k + 8 <= n; k += 8) {
+    __m128i v(_mm_loadu_si128((const __m128i*)(src + k)));
+    // sign extend to 32 bit:
+    __m128i lo(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+    __m128i hi(_mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16));
+    _mm_storeu_ps(dest + k, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dest + k + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+  for(; k < n; ++k)
+    dest[k] = src[k] * (1.0f / 32768.0f);
+}
+
+#elif defined(__ARM_NEON)
+
+void mix_from_int16(float* dest, const int16_t* src, size_t n)
+{
+  size_t k(0);
+  for(; k + 4 <= n; k += 4)
+    vst1q_f32(dest + k,
+              vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vld1_s16(src + k))),
+                          1.0f / 32768.0f));
+  for(; k < n; ++k)
+    dest[k] = src[k] * (1.0f / 32768.0f);
+}
+
+#else
+
+void mix_from_int16(float* dest, const int16_t* src, size_t n)
+{
+  for(size_t k = 0; k < n; ++k)
+    dest[k] = src[k] * (1.0f / 32768.0f);
+}
+
+#endif
+
+const char* mix_kernel_name()
+{
+#if defined(__AVX__)
+  return "avx";
+#elif defined(__SSE2__)
+  return "sse2";
+#elif defined(__ARM_NEON)
+  return "neon";
+#else
+  return "scalar";
+#endif
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
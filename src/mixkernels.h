@@ -0,0 +1,32 @@
+#ifndef MIXKERNELS_H
+#define MIXKERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Vectorized kernels of the server side mixer. SSE2 (or AVX, if
+ * enabled at compile time) is used on x86, NEON on ARM, and plain
+ * loops elsewhere. Pointers need not be aligned.
+ */
+
+/// acc[k] += x[k]
+void mix_add(float* acc, const float* x, size_t n);
+
+/// dest[k] = a[k] - b[k]
+void mix_sub(float* dest, const float* a, const float* b, size_t n);
+
+/// dest[k] = src[k] / 32768
+void mix_from_int16(float* dest, const int16_t* src, size_t n);
+
+/// Name of the instruction set used by the kernels
+const char* mix_kernel_name();
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
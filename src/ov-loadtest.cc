@@ -0,0 +1,759 @@
+#include "benchtools.h"
+#include "boxcrypt.h"
+#include "common.h"
+#include "protocol.h"
+#include "routetable.h"
+#include "tcprelay.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <errno.h>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// destination port of simulated audio packets:
+#define AUDIOPORT 100
+
+// registration period, in ms:
+#define REGISTERPERIODMS 500
+
+// maximum time to wait for the public key of the server, which is
+// announced once per second, in ms:
+#define PUBKEYWAITMS 3000
+
+// longest interruption of the forwarded audio during a hand-over to a
+// new server process, in ms:
+#define HANDOFFMAXGAPMS 50
+
+static bool quit_app = false;
+
+static void sighandler(int sig)
+{
+  quit_app = true;
+}
+
+// simulated client:
+class client_t {
+public:
+  int fd = -1;
+  stage_device_id_t cid = 0;
+  epmode_t mode = 0;
+  // server node of the client:
+  size_t node = 0;
+  endpoint_t server;
+  std::atomic<uint64_t> received{0};
+  // key pair of the client, and the key shared with the server once
+  // its public key arrived:
+  uint8_t pubkey[crypto_box_PUBLICKEYBYTES];
+  uint8_t seckey[crypto_box_SECRETKEYBYTES];
+  uint8_t key[crypto_box_BEFORENMBYTES];
+  std::atomic<bool> has_key{false};
+  // connected through the TCP relay of the server:
+  bool tcp = false;
+  std::vector<char> rxbuf;
+  size_t rxlen = 0;
+  // the sender and the receiver thread write to the connection:
+  std::mutex txmtx;
+};
+
+class loadtest_t {
+public:
+  loadtest_t(const std::vector<endpoint_t>& servers, secret_t pin,
+             size_t numclients, double rate, size_t size, bool encrypt,
+             double p2p, double tcp);
+  ~loadtest_t();
+  void run(double duration);
+  uint64_t sent = 0;
+  uint64_t received() const;
+  /// Number of packets the server should forward per sent packet
+  double expected_receivers() const;
+  latency_hist_t latency;
+  /// Longest time without forwarded audio after the first packet, in ms
+  double maxgap = 0.0;
+
+private:
+  void send_registration();
+  bool send_msg(client_t& c, const char* msg, size_t n);
+  void handle_msg(client_t& c, char* buffer, ssize_t n);
+  void read_tcp(client_t& c);
+  void sender(double duration);
+  void receiver();
+  bool wait_for_keys();
+  secret_t pin;
+  std::vector<client_t> clients;
+  double rate;
+  size_t size;
+  // encrypt for the server, which decrypts and encrypts again for
+  // each receiver:
+  bool encrypt;
+  std::atomic<bool> running{false};
+  // arrival of the last audio packet, used by the receiver thread:
+  std::chrono::steady_clock::time_point last_audio;
+  bool has_audio = false;
+};
+
+loadtest_t::loadtest_t(const std::vector<endpoint_t>& servers, secret_t pin_,
+                       size_t numclients, double rate_, size_t size_,
+                       bool encrypt_, double p2p, double tcp)
+    : pin(pin_), clients(numclients), rate(rate_),
+      size(std::max(size_, (size_t)HEADERLEN + sizeof(int64_t))),
+      encrypt(encrypt_)
+{
+  size_t nump2p(std::min(numclients, (size_t)(p2p * numclients + 0.5)));
+  size_t numtcp(std::min(numclients, (size_t)(tcp * numclients + 0.5)));
+  for(size_t k = 0; k < clients.size(); ++k) {
+    clients[k].cid = k;
+    // clients are spread evenly among the server nodes:
+    clients[k].node = k % servers.size();
+    clients[k].server = servers[clients[k].node];
+    // the last clients use TCP, which implies server mode:
+    if(k + numtcp >= clients.size()) {
+      clients[k].tcp = true;
+      clients[k].rxbuf.resize(16 * (TCPFRAMEHEADERLEN + BUFSIZE));
+      clients[k].fd = socket(AF_INET, SOCK_STREAM, 0);
+      int on(1);
+      setsockopt(clients[k].fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      if(connect(clients[k].fd, (const struct sockaddr*)(&clients[k].server),
+                 sizeof(clients[k].server)) < 0)
+        std::cerr << "Unable to connect to the TCP relay: " << strerror(errno)
+                  << std::endl;
+    } else {
+      clients[k].fd = socket(AF_INET, SOCK_DGRAM, 0);
+      if(k < nump2p)
+        clients[k].mode |= B_PEER2PEER;
+    }
+    if(encrypt) {
+      clients[k].mode |= B_ENCRYPTION | B_SHAREDKEY;
+      crypto_box_keypair(clients[k].pubkey, clients[k].seckey);
+    }
+    int bufsize(1 << 22);
+    setsockopt(clients[k].fd, SOL_SOCKET, SO_RCVBUF, &bufsize,
+               sizeof(bufsize));
+  }
+}
+
+loadtest_t::~loadtest_t()
+{
+  for(auto& c : clients)
+    close(c.fd);
+}
+
+uint64_t loadtest_t::received() const
+{
+  uint64_t n(0);
+  for(const auto& c : clients)
+    n += c.received;
+  return n;
+}
+
+double loadtest_t::expected_receivers() const
+{
+  // peer-to-peer pairs do not exchange audio via the server:
+  std::vector<ep_desc_t> eps(clients.size(), ep_desc_t());
+  for(size_t k = 0; k < clients.size(); ++k) {
+    eps[k].timeout = 10;
+    eps[k].mode = clients[k].mode;
+  }
+  size_t n(0);
+  for(size_t s = 0; s < eps.size(); ++s)
+    for(size_t d = 0; d < eps.size(); ++d) {
+      // the trunk forwards to all clients of other nodes:
+      ep_desc_t src(eps[s]);
+      if(clients[s].node != clients[d].node)
+        src.mode &= ~B_PEER2PEER;
+      if(route_is_receiver(s, src, d, eps[d]))
+        ++n;
+    }
+  return (double)n / (double)std::max((size_t)1, clients.size());
+}
+
+void loadtest_t::send_registration()
+{
+  char buffer[BUFSIZE];
+  const char* version("ov-loadtest");
+  for(auto& c : clients) {
+    // the sequence field of registration messages carries the mode:
+    size_t n(packmsg(buffer, BUFSIZE, pin, c.cid, PORT_REGISTER, c.mode,
+                     version, strlen(version) + 1));
+    send_msg(c, buffer, n);
+    if(encrypt) {
+      n = packmsg(buffer, BUFSIZE, pin, c.cid, PORT_PUBKEY, 0,
+                  (const char*)(c.pubkey), crypto_box_PUBLICKEYBYTES);
+      send_msg(c, buffer, n);
+    }
+  }
+}
+
+bool loadtest_t::send_msg(client_t& c, const char* msg, size_t n)
+{
+  if(!c.tcp)
+    return sendto(c.fd, msg, n, 0, (const struct sockaddr*)(&c.server),
+                  sizeof(c.server)) > 0;
+  char hdr[TCPFRAMEHEADERLEN];
+  tcp_frame_header(hdr, n);
+  struct iovec iov[2];
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = TCPFRAMEHEADERLEN;
+  iov[1].iov_base = (void*)msg;
+  iov[1].iov_len = n;
+  std::lock_guard<std::mutex> lk(c.txmtx);
+  return writev(c.fd, iov, 2) == (ssize_t)(TCPFRAMEHEADERLEN + n);
+}
+
+void loadtest_t::sender(double duration)
+{
+  char payload[BUFSIZE];
+  char buffer[BUFSIZE];
+  char cbuffer[BUFSIZE];
+  memset(payload, 0, sizeof(payload));
+  size_t payloadlen(size - HEADERLEN);
+  auto start(std::chrono::steady_clock::now());
+  auto next(start);
+  auto nextreg(start);
+  auto period(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+      std::chrono::duration<double>(1.0 / rate)));
+  sequence_t seq(0);
+  while(running && !quit_app) {
+    auto now(std::chrono::steady_clock::now());
+    if(std::chrono::duration<double>(now - start).count() >= duration)
+      break;
+    if(now >= nextreg) {
+      send_registration();
+      nextreg += std::chrono::milliseconds(REGISTERPERIODMS);
+    }
+    if(now < next) {
+      std::this_thread::sleep_until(next);
+      continue;
+    }
+    // one audio packet per client and period:
+    ++seq;
+    for(auto& c : clients) {
+      // the payload starts with the send time, for the latency
+      // measurement:
+      int64_t t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now().time_since_epoch())
+                    .count());
+      memcpy(payload, &t, sizeof(t));
+      size_t n(packmsg(buffer, BUFSIZE, pin, c.cid, AUDIOPORT, seq, payload,
+                       payloadlen));
+      const char* msg(buffer);
+      if(encrypt) {
+        // not sent before the key of the server is known:
+        if(!c.has_key.load(std::memory_order_acquire))
+          continue;
+        n = encryptmsg_afternm(cbuffer, BUFSIZE, buffer, n, c.key);
+        msg = cbuffer;
+      }
+      if(n && send_msg(c, msg, n))
+        ++sent;
+    }
+    next += period;
+  }
+}
+
+void loadtest_t::handle_msg(client_t& c, char* buffer, ssize_t n)
+{
+  if(n < (ssize_t)HEADERLEN)
+    return;
+  auto now(std::chrono::steady_clock::now());
+  char pbuffer[BUFSIZE];
+  stage_device_id_t cid;
+  port_t destport;
+  memcpy(&cid, &(buffer[sizeof(secret_t)]), sizeof(stage_device_id_t));
+  memcpy(&destport, &(buffer[sizeof(secret_t) + sizeof(stage_device_id_t)]),
+         sizeof(port_t));
+  if(destport == AUDIOPORT) {
+    const char* msg(buffer);
+    if(encrypt) {
+      // packets which cannot be decrypted are lost:
+      if(!c.has_key.load(std::memory_order_acquire))
+        return;
+      n = decryptmsg_afternm(pbuffer, buffer, n, c.key);
+      if(!n)
+        return;
+      msg = pbuffer;
+    }
+    ++c.received;
+    if(has_audio)
+      maxgap = std::max(
+          maxgap,
+          std::chrono::duration<double, std::milli>(now - last_audio).count());
+    last_audio = now;
+    has_audio = true;
+    if(n >= (ssize_t)(HEADERLEN + sizeof(int64_t))) {
+      int64_t t;
+      memcpy(&t, &(msg[HEADERLEN]), sizeof(t));
+      double lat(1.0e-6 *
+                 (double)(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              now.time_since_epoch())
+                              .count() -
+                          t));
+      latency.add(lat);
+    }
+  } else if((destport == PORT_PUBKEY) && (cid == STAGE_ID_SERVER)) {
+    // the key of the server does not change, it is computed once and
+    // then read by the sender thread:
+    if(encrypt && !c.has_key &&
+       (n == (ssize_t)(HEADERLEN + crypto_box_PUBLICKEYBYTES)) &&
+       (crypto_box_beforenm(c.key, (const uint8_t*)(&(buffer[HEADERLEN])),
+                            c.seckey) == 0))
+      c.has_key.store(true, std::memory_order_release);
+  } else if(destport == PORT_PING) {
+    // answer pings of the server:
+    port_t pongport(PORT_PONG);
+    memcpy(&(buffer[sizeof(secret_t)]), &(c.cid), sizeof(stage_device_id_t));
+    memcpy(&(buffer[sizeof(secret_t) + sizeof(stage_device_id_t)]),
+           &pongport, sizeof(port_t));
+    send_msg(c, buffer, n);
+  }
+}
+
+void loadtest_t::read_tcp(client_t& c)
+{
+  ssize_t r(recv(c.fd, &(c.rxbuf[c.rxlen]), c.rxbuf.size() - c.rxlen,
+                 MSG_DONTWAIT));
+  if(r <= 0)
+    return;
+  c.rxlen += r;
+  size_t pos(0);
+  while(c.rxlen - pos >= TCPFRAMEHEADERLEN) {
+    size_t len(tcp_frame_len(&(c.rxbuf[pos])));
+    if(c.rxlen - pos < TCPFRAMEHEADERLEN + len)
+      break;
+    handle_msg(c, &(c.rxbuf[pos + TCPFRAMEHEADERLEN]), len);
+    pos += TCPFRAMEHEADERLEN + len;
+  }
+  memmove(c.rxbuf.data(), &(c.rxbuf[pos]), c.rxlen - pos);
+  c.rxlen -= pos;
+}
+
+void loadtest_t::receiver()
+{
+  std::vector<struct pollfd> pfd(clients.size());
+  for(size_t k = 0; k < clients.size(); ++k) {
+    pfd[k].fd = clients[k].fd;
+    pfd[k].events = POLLIN;
+  }
+  char buffer[BUFSIZE];
+  while(running) {
+    if(poll(pfd.data(), pfd.size(), 10) <= 0)
+      continue;
+    for(size_t k = 0; k < clients.size(); ++k) {
+      if(!(pfd[k].revents & POLLIN))
+        continue;
+      if(clients[k].tcp) {
+        read_tcp(clients[k]);
+        continue;
+      }
+      ssize_t n;
+      while((n = recv(clients[k].fd, buffer, BUFSIZE, MSG_DONTWAIT)) >=
+            (ssize_t)HEADERLEN)
+        handle_msg(clients[k], buffer, n);
+    }
+  }
+}
+
+// wait until all clients share a key with their server, false on
+// timeout:
+bool loadtest_t::wait_for_keys()
+{
+  auto start(std::chrono::steady_clock::now());
+  while(!quit_app && (std::chrono::steady_clock::now() - start <
+                      std::chrono::milliseconds(PUBKEYWAITMS))) {
+    bool all(true);
+    for(const auto& c : clients)
+      if(!c.has_key)
+        all = false;
+    if(all)
+      return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+void loadtest_t::run(double duration)
+{
+  running = true;
+  // register before sending audio, so no packet is counted as lost
+  // due to the registration delay:
+  std::thread rxthread(&loadtest_t::receiver, this);
+  send_registration();
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  if(encrypt && !wait_for_keys())
+    std::cerr << "Warning: not all clients received the public key of the "
+                 "server."
+              << std::endl;
+  sender(duration);
+  // wait for packets in flight:
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  running = false;
+  rxthread.join();
+}
+
+static std::vector<size_t> parse_list(const char* arg, int minval)
+{
+  std::vector<size_t> list;
+  std::string s(arg);
+  size_t pos(0);
+  while(pos < s.size()) {
+    list.push_back(std::max(minval, atoi(s.c_str() + pos)));
+    pos = s.find(',', pos);
+    if(pos == std::string::npos)
+      break;
+    ++pos;
+  }
+  return list;
+}
+
+// server options of the I/O backends compared with --backends:
+static std::vector<std::string> backend_args(const std::string& backend)
+{
+  if(backend == "iouring")
+    return {"-u"};
+  if(backend != "default")
+    std::cerr << "Unknown backend \"" << backend << "\", using default."
+              << std::endl;
+  return {};
+}
+
+int main(int argc, char** argv)
+{
+  signal(SIGINT, &sighandler);
+  signal(SIGTERM, &sighandler);
+  std::string host("127.0.0.1");
+  int port(9000);
+  secret_t pin(1234);
+  std::vector<size_t> clientlist = {16};
+  double rate(500);
+  size_t size(200);
+  double duration(5);
+  bool encrypt(false);
+  double p2p(0.0);
+  double tcp(0.0);
+  size_t nodes(1);
+  // lobby stub mode, "batch" or "legacy", or empty:
+  std::string lobbymode;
+  // a second server takes over the room in the middle of each run:
+  bool handoff(false);
+  std::string server;
+  std::vector<size_t> threadlist;
+  std::vector<std::string> backends = {"default"};
+  const char* options = "H:p:P:n:r:s:d:x:t:e2:b:T:N:L:Oh";
+  struct option long_options[] = {{"host", 1, 0, 'H'},
+                                  {"port", 1, 0, 'p'},
+                                  {"pin", 1, 0, 'P'},
+                                  {"clients", 1, 0, 'n'},
+                                  {"rate", 1, 0, 'r'},
+                                  {"size", 1, 0, 's'},
+                                  {"duration", 1, 0, 'd'},
+                                  {"server", 1, 0, 'x'},
+                                  {"threads", 1, 0, 't'},
+                                  {"encrypt", 0, 0, 'e'},
+                                  {"p2p", 1, 0, '2'},
+                                  {"backends", 1, 0, 'b'},
+                                  {"tcp", 1, 0, 'T'},
+                                  {"nodes", 1, 0, 'N'},
+                                  {"lobby", 1, 0, 'L'},
+                                  {"handoff", 0, 0, 'O'},
+                                  {"help", 0, 0, 'h'},
+                                  {0, 0, 0, 0}};
+  int opt(0);
+  int option_index(0);
+  while((opt = getopt_long(argc, argv, options, long_options,
+                           &option_index)) != -1) {
+    switch(opt) {
+    case 'h':
+      app_usage(
+          "ov-loadtest", long_options, "",
+          "Stream simulated audio through an ov-server instance and "
+          "report the\nforwarding throughput, latency and loss. --clients "
+          "takes a comma separated\nlist of room sizes. With --server the "
+          "server is started for each room\nsize and each entry of the "
+          "comma separated --threads list (SO_REUSEPORT\nshards), and its "
+          "CPU load is reported. --encrypt encrypts the audio for the\n"
+          "server, which decrypts it and encrypts it again for each "
+          "receiver\n(B_SHAREDKEY), --p2p sets the fraction of "
+          "peer-to-peer clients, --tcp the fraction of clients which "
+          "connect\nthrough the TCP relay of the server (ov-server --tcp)."
+          "\n--backends compares the socket I/O "
+          "backends of the server, e.g.\n\"default,iouring\". --nodes "
+          "starts several servers on consecutive ports,\nlinked with "
+          "--trunk, and spreads the clients among them; the reported\n"
+          "server CPU is the maximum of the nodes. --lobby runs a stub "
+          "lobby for the servers,\n\"batch\" or \"legacy\" (without "
+          "batched latency reports), and fails if\nno latency reports "
+          "arrive. --handoff starts a second server halfway through\neach "
+          "run, which takes over the room (ov-server --takeover), and fails "
+          "if\nthe forwarded audio stops for more than " +
+              std::to_string(HANDOFFMAXGAPMS) + " ms.");
+      return 0;
+    case 'H':
+      host = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'P':
+      pin = atoll(optarg);
+      break;
+    case 'n':
+      clientlist = parse_list(optarg, 2);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 's':
+      size = atoi(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'x':
+      server = optarg;
+      break;
+    case 't':
+      threadlist = parse_list(optarg, 1);
+      break;
+    case 'e':
+      encrypt = true;
+      break;
+    case '2':
+      p2p = std::min(1.0, std::max(0.0, atof(optarg)));
+      break;
+    case 'T':
+      tcp = std::min(1.0, std::max(0.0, atof(optarg)));
+      break;
+    case 'N':
+      nodes = std::max(1, atoi(optarg));
+      break;
+    case 'L':
+      lobbymode = optarg;
+      break;
+    case 'O':
+      handoff = true;
+      break;
+    case 'b': {
+      backends.clear();
+      std::string s(optarg);
+      size_t pos(0);
+      while(pos <= s.size()) {
+        size_t end(std::min(s.find(',', pos), s.size()));
+        if(end > pos)
+          backends.push_back(s.substr(pos, end - pos));
+        pos = end + 1;
+      }
+      break;
+    }
+    }
+  }
+  if(server.empty() || threadlist.empty())
+    threadlist = {0};
+  // the backend can only be selected when the server is started here:
+  if(server.empty() || backends.empty())
+    backends = {"default"};
+  if(clientlist.empty())
+    clientlist = {16};
+  // several nodes can only be linked when the servers are started here:
+  if(server.empty())
+    nodes = 1;
+  if((!lobbymode.empty()) &&
+     (server.empty() || ((lobbymode != "batch") && (lobbymode != "legacy")))) {
+    std::cerr << "--lobby needs --server, and \"batch\" or \"legacy\"."
+              << std::endl;
+    return 1;
+  }
+  if(handoff && (server.empty() || (nodes > 1))) {
+    std::cerr << "--handoff needs --server, and one node." << std::endl;
+    return 1;
+  }
+  std::string handoffpath("/tmp/ov-loadtest-" + std::to_string(getpid()) +
+                          ".sock");
+  std::unique_ptr<lobby_stub_t> lobbystub;
+  if(!lobbymode.empty())
+    lobbystub.reset(new lobby_stub_t(lobbymode == "legacy"));
+  bool failed(false);
+  if((nodes > 1) && encrypt) {
+    std::cerr << "Encryption is not supported in trunk mode, use --encrypt "
+                 "with one node."
+              << std::endl;
+    return 1;
+  }
+  if(sodium_init() < 0) {
+    std::cerr << "Unable to initialize libsodium." << std::endl;
+    return 1;
+  }
+  std::vector<endpoint_t> eps(nodes);
+  for(size_t k = 0; k < nodes; ++k) {
+    memset(&eps[k], 0, sizeof(eps[k]));
+    eps[k].sin_family = AF_INET;
+    eps[k].sin_addr.s_addr = inet_addr(host.c_str());
+    eps[k].sin_port = htons(port + k);
+  }
+  // key pairs of the nodes, the secret keys are passed in files:
+  std::vector<std::string> nodekeyfiles;
+  std::vector<std::string> nodepubkeys;
+  for(size_t k = 0; (k < nodes) && (nodes > 1); ++k) {
+    uint8_t pk[crypto_box_PUBLICKEYBYTES];
+    uint8_t sk[crypto_box_SECRETKEYBYTES];
+    crypto_box_keypair(pk, sk);
+    char hex[2 * crypto_box_SECRETKEYBYTES + 1];
+    std::string fname("/tmp/ov-loadtest-" + std::to_string(getpid()) + "-" +
+                      std::to_string(k) + ".key");
+    FILE* fh(fopen(fname.c_str(), "w"));
+    if(!fh) {
+      std::cerr << "Unable to create " << fname << "." << std::endl;
+      return 1;
+    }
+    sodium_bin2hex(hex, sizeof(hex), sk, sizeof(sk));
+    fprintf(fh, "%s\n", hex);
+    fclose(fh);
+    nodekeyfiles.push_back(fname);
+    sodium_bin2hex(hex, sizeof(hex), pk, sizeof(pk));
+    nodepubkeys.push_back(hex);
+  }
+  printf("# rate=%g size=%zu duration=%g encrypt=%d p2p=%g tcp=%g "
+         "nodes=%zu\n",
+         rate, size, duration, encrypt, p2p, tcp, nodes);
+  printf("# backend threads clients sent_pps fwd_pps expected_pps loss_percent "
+         "lat_p50_ms lat_p90_ms lat_p99_ms lat_p999_ms server_cpu_percent\n");
+  for(const auto& backend : backends) {
+    for(auto threads : threadlist) {
+      for(auto numclients : clientlist) {
+        if(quit_app)
+          break;
+        std::vector<pid_t> pids(nodes, 0);
+        std::vector<std::string> args0;
+        for(size_t k = 0; k < nodes && !server.empty(); ++k) {
+          std::vector<std::string> args = {"-p", std::to_string(port + k),
+                                           "-P", std::to_string(pin),
+                                           "-s", std::to_string(threads),
+                                           "-b", "16"};
+          if(tcp > 0)
+            args.push_back("--tcp");
+          if(lobbystub) {
+            args.push_back("-l");
+            args.push_back(lobbystub->url());
+          }
+          for(const auto& a : backend_args(backend))
+            args.push_back(a);
+          // each node is linked to all others:
+          std::string trunk;
+          for(size_t j = 0; j < nodes; ++j)
+            if(j != k)
+              trunk += (trunk.empty() ? "" : ",") + host + ":" +
+                       std::to_string(port + j) + "/" + nodepubkeys[j];
+          if(!trunk.empty()) {
+            args.push_back("--trunk");
+            args.push_back(trunk);
+            args.push_back("--trunkkey");
+            args.push_back(nodekeyfiles[k]);
+          }
+          if(handoff) {
+            args.push_back("--handoff");
+            args.push_back(handoffpath);
+          }
+          if(!k)
+            args0 = args;
+          pids[k] = start_server(server, args);
+        }
+        uint64_t reports0(lobbystub ? lobbystub->num_reports.load() : 0);
+        loadtest_t test(eps, pin, numclients, rate, size, encrypt, p2p, tcp);
+        std::vector<double> cpu0;
+        for(auto pid : pids)
+          cpu0.push_back(get_cputime(pid));
+        auto t0(std::chrono::steady_clock::now());
+        // the new server waits for the state of the running one:
+        pid_t newpid(0);
+        std::thread takeover;
+        if(handoff)
+          takeover = std::thread([&]() {
+            std::this_thread::sleep_for(
+                std::chrono::duration<double>(0.5 * duration));
+            std::vector<std::string> args(args0);
+            args.push_back("--takeover");
+            args.push_back(handoffpath);
+            newpid = start_server(server, args);
+          });
+        test.run(duration);
+        if(takeover.joinable())
+          takeover.join();
+        std::vector<double> cpu1;
+        for(auto pid : pids)
+          cpu1.push_back(get_cputime(pid));
+        double walltime(std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - t0)
+                            .count());
+        if(handoff) {
+          // the first server exits after the hand-over:
+          bool handed_over(waitpid(pids[0], NULL, WNOHANG) == pids[0]);
+          bool taken_over((newpid > 0) && !waitpid(newpid, NULL, WNOHANG));
+          printf("# handoff: handed_over=%d taken_over=%d gap_ms=%1.1f\n",
+                 handed_over, taken_over, test.maxgap);
+          if(handed_over)
+            pids[0] = 0;
+          stop_server(newpid);
+          if(!(handed_over && taken_over)) {
+            std::cerr << "The new server did not take over the room."
+                      << std::endl;
+            failed = true;
+          } else if(test.maxgap > HANDOFFMAXGAPMS) {
+            std::cerr << "The audio stopped for " << test.maxgap
+                      << " ms during the hand-over." << std::endl;
+            failed = true;
+          }
+        }
+        for(auto pid : pids)
+          stop_server(pid);
+        double expected((double)test.sent * test.expected_receivers());
+        double rx(test.received());
+        double cpu(-1.0);
+        for(size_t k = 0; k < nodes; ++k)
+          if((cpu0[k] >= 0) && (cpu1[k] >= 0))
+            cpu = std::max(cpu, 100.0 * (cpu1[k] - cpu0[k]) / walltime);
+        printf("%s %zu %zu %1.0f %1.0f %1.0f %1.2f %1.2f %1.2f %1.2f %1.2f "
+               "%1.1f\n",
+               backend.c_str(), threads, numclients, test.sent / duration,
+               rx / duration, expected / duration,
+               100.0 * (1.0 - rx / std::max(1.0, expected)),
+               test.latency.percentile(50), test.latency.percentile(90),
+               test.latency.percentile(99), test.latency.percentile(99.9),
+               cpu);
+        if(lobbystub) {
+          uint64_t reports(lobbystub->num_reports - reports0);
+          printf("# lobby: announcements=%lu batches=%lu rejected=%lu "
+                 "single=%lu reports=%lu\n",
+                 (unsigned long)lobbystub->num_announcements,
+                 (unsigned long)lobbystub->num_batches,
+                 (unsigned long)lobbystub->num_rejected,
+                 (unsigned long)lobbystub->num_single,
+                 (unsigned long)reports);
+          if(!reports) {
+            std::cerr << "No latency reports arrived at the lobby stub."
+                      << std::endl;
+            failed = true;
+          }
+        }
+        fflush(stdout);
+      }
+    }
+  }
+  for(const auto& fname : nodekeyfiles)
+    unlink(fname.c_str());
+  return failed ? 1 : 0;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,393 @@
+#include "benchtools.h"
+#include "capture.h"
+#include "common.h"
+#include "errmsg.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <math.h>
+#include <mutex>
+#include <poll.h>
+#include <signal.h>
+#include <sstream>
+#include <string.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// time to wait for forwarded packets after the last datagram, in ms:
+#define REPLAYDRAINMS 200
+
+static bool quit_app = false;
+
+static void sighandler(int sig)
+{
+  quit_app = true;
+}
+
+// one original sender of the capture, replayed from its own socket:
+class replay_endpoint_t {
+public:
+  int fd = -1;
+  // stage device ID of the first valid datagram of the sender:
+  int cid = -1;
+  uint64_t sent = 0;
+  // forwarded audio packets by sender ID, and other messages:
+  std::map<int, uint64_t> fwd;
+  uint64_t other = 0;
+};
+
+class replay_t {
+public:
+  replay_t(const std::string& fname);
+  ~replay_t();
+  void run(const endpoint_t& server, double speed);
+  std::string summary() const;
+  secret_t pin = 0;
+  uint64_t num_datagrams = 0;
+  double duration = 0;
+  double walltime = 0;
+  latency_hist_t latency;
+  std::vector<replay_endpoint_t> eps;
+
+private:
+  void sender(const endpoint_t& server, double speed);
+  void receiver();
+  static uint64_t seqkey(const char* buf);
+  capture_reader_t capture;
+  std::map<uint64_t, size_t> epindex;
+  // send times of audio packets, by sender, port and sequence number:
+  std::unordered_map<uint64_t, std::chrono::steady_clock::time_point>
+      sendtime;
+  std::mutex mtx;
+  std::atomic<bool> running{false};
+};
+
+replay_t::replay_t(const std::string& fname) : capture(fname)
+{
+  capture_record_header_t hdr;
+  const char* data;
+  int64_t t0(0);
+  int64_t t1(0);
+  bool haspin(false);
+  while(capture.next(hdr, data)) {
+    if(!num_datagrams)
+      t0 = hdr.t_ns;
+    t1 = hdr.t_ns;
+    ++num_datagrams;
+    uint64_t key(((uint64_t)hdr.addr << 16) | hdr.port);
+    if(epindex.find(key) == epindex.end()) {
+      epindex[key] = eps.size();
+      eps.emplace_back();
+    }
+    replay_endpoint_t& ep(eps[epindex[key]]);
+    if(hdr.len >= HEADERLEN) {
+      if(!haspin) {
+        memcpy(&pin, data, sizeof(secret_t));
+        haspin = true;
+      }
+      stage_device_id_t cid;
+      memcpy(&cid, &(data[sizeof(secret_t)]), sizeof(cid));
+      if((ep.cid < 0) && (cid < MAX_STAGE_ID))
+        ep.cid = cid;
+    }
+  }
+  duration = 1.0e-9 * (double)(t1 - t0);
+  for(auto& ep : eps) {
+    ep.fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int bufsize(1 << 22);
+    setsockopt(ep.fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+  }
+}
+
+replay_t::~replay_t()
+{
+  for(auto& ep : eps)
+    close(ep.fd);
+}
+
+// forwarded packets keep the header of the sender:
+uint64_t replay_t::seqkey(const char* buf)
+{
+  stage_device_id_t cid;
+  port_t port;
+  sequence_t seq;
+  memcpy(&cid, &(buf[sizeof(secret_t)]), sizeof(cid));
+  memcpy(&port, &(buf[sizeof(secret_t) + sizeof(cid)]), sizeof(port));
+  memcpy(&seq, &(buf[sizeof(secret_t) + sizeof(cid) + sizeof(port)]),
+         sizeof(seq));
+  return ((uint64_t)cid << 48) | ((uint64_t)port << 32) | (uint32_t)seq;
+}
+
+void replay_t::sender(const endpoint_t& server, double speed)
+{
+  capture.rewind();
+  capture_record_header_t hdr;
+  const char* data;
+  int64_t t0(0);
+  bool first(true);
+  auto start(std::chrono::steady_clock::now());
+  while(running && !quit_app && capture.next(hdr, data)) {
+    if(first) {
+      t0 = hdr.t_ns;
+      first = false;
+    }
+    // keep the original pace, scaled by the speed factor:
+    if(speed > 0)
+      std::this_thread::sleep_until(
+          start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::duration<double, std::nano>(
+                          (double)(hdr.t_ns - t0) / speed)));
+    uint64_t key(((uint64_t)hdr.addr << 16) | hdr.port);
+    replay_endpoint_t& ep(eps[epindex[key]]);
+    if(hdr.len >= HEADERLEN) {
+      port_t port;
+      memcpy(&port, &(data[sizeof(secret_t) + sizeof(stage_device_id_t)]),
+             sizeof(port));
+      if(port > MAXSPECIALPORT) {
+        std::lock_guard<std::mutex> lk(mtx);
+        sendtime[seqkey(data)] = std::chrono::steady_clock::now();
+      }
+    }
+    if(sendto(ep.fd, data, hdr.len, 0, (const struct sockaddr*)(&server),
+              sizeof(server)) > 0)
+      ++ep.sent;
+  }
+}
+
+void replay_t::receiver()
+{
+  std::vector<struct pollfd> pfd(eps.size());
+  for(size_t k = 0; k < eps.size(); ++k) {
+    pfd[k].fd = eps[k].fd;
+    pfd[k].events = POLLIN;
+  }
+  char buffer[BUFSIZE];
+  while(running) {
+    if(poll(pfd.data(), pfd.size(), 10) <= 0)
+      continue;
+    for(size_t k = 0; k < eps.size(); ++k) {
+      if(!(pfd[k].revents & POLLIN))
+        continue;
+      ssize_t n;
+      while((n = recv(eps[k].fd, buffer, BUFSIZE, MSG_DONTWAIT)) >=
+            (ssize_t)HEADERLEN) {
+        auto now(std::chrono::steady_clock::now());
+        stage_device_id_t cid;
+        port_t port;
+        memcpy(&cid, &(buffer[sizeof(secret_t)]), sizeof(cid));
+        memcpy(&port, &(buffer[sizeof(secret_t) + sizeof(cid)]),
+               sizeof(port));
+        if(port <= MAXSPECIALPORT) {
+          ++eps[k].other;
+          continue;
+        }
+        ++eps[k].fwd[cid];
+        std::lock_guard<std::mutex> lk(mtx);
+        auto t(sendtime.find(seqkey(buffer)));
+        if(t != sendtime.end())
+          latency.add(
+              std::chrono::duration<double, std::milli>(now - t->second)
+                  .count());
+      }
+    }
+  }
+}
+
+void replay_t::run(const endpoint_t& server, double speed)
+{
+  running = true;
+  auto t0(std::chrono::steady_clock::now());
+  std::thread rxthread(&replay_t::receiver, this);
+  sender(server, speed);
+  std::this_thread::sleep_for(std::chrono::milliseconds(REPLAYDRAINMS));
+  running = false;
+  rxthread.join();
+  walltime = std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                           t0)
+                 .count();
+}
+
+// One line per value, sorted, so two runs can be compared with diff or
+// with --reference: forwarded audio packets by sender and receiver ID,
+// other messages by receiver ID, and latency percentiles in ms.
+std::string replay_t::summary() const
+{
+  std::map<std::pair<int, int>, uint64_t> fwd;
+  std::map<int, uint64_t> ctl;
+  for(const auto& ep : eps) {
+    for(const auto& f : ep.fwd)
+      fwd[std::make_pair(f.first, ep.cid)] += f.second;
+    ctl[ep.cid] += ep.other;
+  }
+  std::string s;
+  char ctmp[1024];
+  for(const auto& f : fwd) {
+    sprintf(ctmp, "fwd %d %d %lu\n", f.first.first, f.first.second,
+            (unsigned long)f.second);
+    s += ctmp;
+  }
+  for(const auto& c : ctl) {
+    sprintf(ctmp, "ctl %d %lu\n", c.first, (unsigned long)c.second);
+    s += ctmp;
+  }
+  sprintf(ctmp,
+          "lat p50 %1.2f\nlat p90 %1.2f\nlat p99 %1.2f\nlat p999 %1.2f\n",
+          latency.percentile(50), latency.percentile(90),
+          latency.percentile(99), latency.percentile(99.9));
+  s += ctmp;
+  return s;
+}
+
+// Compare forwarding counts with a previous summary, return the number
+// of differences beyond the tolerance (in percent). Changes of the
+// control messages and latencies are reported, but not counted, since
+// they depend on the timing of the host.
+static size_t compare(const std::string& fname, const std::string& current,
+                      double tolerance)
+{
+  std::ifstream f(fname);
+  if(!f.good())
+    throw ErrMsg("Unable to read reference \"" + fname + "\".");
+  std::map<std::string, double> ref;
+  std::map<std::string, double> cur;
+  auto parse([](std::istream& is, std::map<std::string, double>& m) {
+    std::string line;
+    while(std::getline(is, line)) {
+      if(line.empty() || (line[0] == '#'))
+        continue;
+      size_t pos(line.rfind(' '));
+      if(pos != std::string::npos)
+        m[line.substr(0, pos)] = atof(line.c_str() + pos + 1);
+    }
+  });
+  parse(f, ref);
+  std::istringstream is(current);
+  parse(is, cur);
+  for(const auto& r : cur)
+    if(ref.find(r.first) == ref.end())
+      ref[r.first] = 0;
+  size_t ndiff(0);
+  for(const auto& r : ref) {
+    double now(cur.count(r.first) ? cur[r.first] : 0.0);
+    double diff(fabs(now - r.second));
+    if(diff <= 0.01 * tolerance * std::max(fabs(now), fabs(r.second)))
+      continue;
+    bool isfwd(r.first.compare(0, 4, "fwd ") == 0);
+    printf("# %s %s: reference %g, now %g\n", isfwd ? "differs" : "changed",
+           r.first.c_str(), r.second, now);
+    if(isfwd)
+      ++ndiff;
+  }
+  return ndiff;
+}
+
+int main(int argc, char** argv)
+{
+  signal(SIGINT, &sighandler);
+  signal(SIGTERM, &sighandler);
+  std::string host("127.0.0.1");
+  int port(9000);
+  double speed(1.0);
+  double tolerance(1.0);
+  std::string server;
+  std::string reference;
+  const char* options = "H:p:S:x:R:T:h";
+  struct option long_options[] = {{"host", 1, 0, 'H'},
+                                  {"port", 1, 0, 'p'},
+                                  {"speed", 1, 0, 'S'},
+                                  {"server", 1, 0, 'x'},
+                                  {"reference", 1, 0, 'R'},
+                                  {"tolerance", 1, 0, 'T'},
+                                  {"help", 0, 0, 'h'},
+                                  {0, 0, 0, 0}};
+  int opt(0);
+  int option_index(0);
+  while((opt = getopt_long(argc, argv, options, long_options,
+                           &option_index)) != -1) {
+    switch(opt) {
+    case 'h':
+      app_usage(
+          "ov-replay", long_options, "capturefile",
+          "Send the datagrams of an ov-server capture (--capture) to a "
+          "server, one\nsocket per original sender, and print the "
+          "forwarded packets and their\nlatency. --speed scales the "
+          "original pace, 0 sends as fast as possible.\nWith --server "
+          "the server is started with the pin of the capture. With\n"
+          "--reference the result is compared to the output of a "
+          "previous run; the\nexit code is 2 if the forwarding "
+          "differs by more than --tolerance percent.\nDatagrams of "
+          "encrypted rooms are sealed with the key pair of the\ncapturing "
+          "server, which a new server does not have: the server\ndrops "
+          "them, and their forwarding cannot be compared.");
+      return 0;
+    case 'H':
+      host = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'S':
+      speed = std::max(0.0, atof(optarg));
+      break;
+    case 'x':
+      server = optarg;
+      break;
+    case 'R':
+      reference = optarg;
+      break;
+    case 'T':
+      tolerance = atof(optarg);
+      break;
+    }
+  }
+  if(optind >= argc) {
+    app_usage("ov-replay", long_options, "capturefile");
+    return 1;
+  }
+  try {
+    replay_t replay(argv[optind]);
+    endpoint_t ep;
+    memset(&ep, 0, sizeof(ep));
+    ep.sin_family = AF_INET;
+    ep.sin_addr.s_addr = inet_addr(host.c_str());
+    ep.sin_port = htons(port);
+    printf("# capture %s: %lu datagrams from %zu endpoints in %1.1f s, "
+           "pin %d\n",
+           argv[optind], (unsigned long)replay.num_datagrams,
+           replay.eps.size(), replay.duration, replay.pin);
+    fflush(stdout);
+    pid_t pid(0);
+    if(!server.empty())
+      pid = start_server(server, {"-p", std::to_string(port), "-P",
+                                  std::to_string(replay.pin)});
+    double cpu0(get_cputime(pid));
+    replay.run(ep, speed);
+    double cpu1(get_cputime(pid));
+    stop_server(pid);
+    printf("# replayed at speed %g in %1.1f s", speed, replay.walltime);
+    if((cpu0 >= 0) && (cpu1 >= 0))
+      printf(", server cpu %1.1f%%",
+             100.0 * (cpu1 - cpu0) / std::max(1e-3, replay.walltime));
+    printf("\n");
+    std::string summary(replay.summary());
+    fputs(summary.c_str(), stdout);
+    if(!reference.empty() && compare(reference, summary, tolerance))
+      return 2;
+  }
+  catch(const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
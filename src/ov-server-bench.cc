@@ -0,0 +1,363 @@
+#include "batchsocket.h"
+#include "benchtools.h"
+#include "boxcrypt.h"
+#include "callerlist.h"
+#include "mixer.h"
+#include "mixkernels.h"
+#include "protocol.h"
+#include "roster.h"
+#include "routetable.h"
+#include <arpa/inet.h>
+#include <chrono>
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// number of simulated packets per measurement:
+#define NUMPACKETS 200000
+
+// number of mixed periods per measurement:
+#define NUMPERIODS 2000
+
+// frames per period of the mixing benchmark (2 ms at 48 kHz):
+#define MIXFRAMES 96
+
+// number of encrypted or decrypted packets per measurement:
+#define NUMCRYPT 20000
+
+// number of roster and announcement rounds per measurement:
+#define NUMROUNDS 200
+
+// destination port of simulated audio packets:
+#define AUDIOPORT 100
+
+// payload sizes of audio packets, from 2 ms mono 16 bit to 4 ms
+// stereo 24 bit at 48 kHz:
+static const size_t payload_sizes[] = {64, 192, 576, 1152};
+
+static double ns_since(std::chrono::steady_clock::time_point t1, size_t n)
+{
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - t1)
+             .count() /
+         (double)n;
+}
+
+static void create_room(std::vector<ep_desc_t>& endpoints, size_t roomsize)
+{
+  endpoints.resize(MAX_STAGE_ID, ep_desc_t());
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+    auto& ep(endpoints[cid]);
+    ep.timeout = (cid < roomsize) ? 10 : 0;
+    ep.mode = 0;
+    ep.ep.sin_family = AF_INET;
+    ep.ep.sin_addr.s_addr = htonl(0x7f000001);
+    ep.ep.sin_port = htons(10000 + cid);
+    ep.localep = ep.ep;
+    // all members announce a public key:
+    ep.has_pubkey = (cid < roomsize);
+    for(size_t k = 0; k < crypto_box_PUBLICKEYBYTES; ++k)
+      ep.pubkey[k] = cid + k;
+  }
+}
+
+// emulate a send call:
+static volatile uint32_t sink = 0;
+
+static double bench_scan(const std::vector<ep_desc_t>& endpoints,
+                         size_t roomsize)
+{
+  auto t1(std::chrono::steady_clock::now());
+  uint32_t acc(0);
+  for(size_t p = 0; p < NUMPACKETS; ++p) {
+    stage_device_id_t sender_id(p % roomsize);
+    const auto& src(endpoints[sender_id]);
+    for(stage_device_id_t target_id = 0; target_id != MAX_STAGE_ID;
+        ++target_id) {
+      const auto& dest(endpoints[target_id]);
+      if(route_is_receiver(sender_id, src, target_id, dest))
+        acc += dest.ep.sin_port;
+    }
+  }
+  sink = acc;
+  auto t2(std::chrono::steady_clock::now());
+  return std::chrono::duration<double, std::nano>(t2 - t1).count() /
+         NUMPACKETS;
+}
+
+static double bench_table(const std::vector<ep_desc_t>& endpoints,
+                          size_t roomsize)
+{
+  route_table_t routes;
+  shared_key_cache_t keys;
+  routes.build(endpoints, keys);
+  auto t1(std::chrono::steady_clock::now());
+  uint32_t acc(0);
+  for(size_t p = 0; p < NUMPACKETS; ++p) {
+    stage_device_id_t sender_id(p % roomsize);
+    for(const route_dest_t* dest = routes.dest_begin(sender_id);
+        dest != routes.dest_end(sender_id); ++dest)
+      acc += dest->ep.sin_port;
+  }
+  sink = acc;
+  auto t2(std::chrono::steady_clock::now());
+  return std::chrono::duration<double, std::nano>(t2 - t1).count() /
+         NUMPACKETS;
+}
+
+// Mix one period of all room members for all room members, return
+// the time per period in microseconds:
+static double bench_mix(size_t roomsize, size_t channels)
+{
+  audio_mixer_t mixer;
+  size_t nsamples(MIXFRAMES * channels);
+  std::vector<char> payload(sizeof(mix_header_t) + nsamples * sizeof(float));
+  mix_header_t hdr;
+  hdr.frame = 0;
+  hdr.nframes = MIXFRAMES;
+  hdr.nchannels = channels;
+  hdr.format = MIX_FLOAT32;
+  memcpy(payload.data(), &hdr, sizeof(hdr));
+  for(size_t k = 0; k < nsamples; ++k) {
+    float v(0.001f * (float)k);
+    memcpy(&(payload[sizeof(hdr) + k * sizeof(float)]), &v, sizeof(v));
+  }
+  char out[BUFSIZE];
+  mix_block_t* done[MIXMAXDONE];
+  uint32_t acc(0);
+  auto t1(std::chrono::steady_clock::now());
+  for(size_t p = 0; p < NUMPERIODS; ++p) {
+    // all senders are at the same frame:
+    hdr.frame = p;
+    memcpy(payload.data(), &hdr, sizeof(hdr));
+    for(stage_device_id_t sid = 0; sid < roomsize; ++sid) {
+      size_t ndone(
+          mixer.add(sid, payload.data(), payload.size(), roomsize, done));
+      for(size_t k = 0; k < ndone; ++k) {
+        for(stage_device_id_t rid = 0; rid < roomsize; ++rid)
+          acc += mixer.render(*done[k], rid, out, BUFSIZE);
+        mixer.release(done[k]);
+      }
+    }
+  }
+  sink = acc;
+  auto t2(std::chrono::steady_clock::now());
+  return std::chrono::duration<double, std::micro>(t2 - t1).count() /
+         NUMPERIODS;
+}
+
+// Pack an audio packet, return the time per packet in ns:
+static double bench_packmsg(size_t size)
+{
+  std::vector<char> payload(size, 1);
+  char buffer[BUFSIZE];
+  uint32_t acc(0);
+  auto t1(std::chrono::steady_clock::now());
+  for(size_t p = 0; p < NUMPACKETS; ++p)
+    acc += packmsg(buffer, BUFSIZE, 1234, p % 16, AUDIOPORT, p,
+                   payload.data(), size);
+  sink = acc;
+  return ns_since(t1, NUMPACKETS);
+}
+
+// Validate the headers of a batch of received audio packets, return
+// the time per packet in ns, or a negative value if the loopback
+// socket is not available:
+static double bench_header(size_t size)
+{
+  ovbox_batchsocket_t sock(1234, STAGE_ID_SERVER);
+  sock.set_timeout_usec(100000);
+  port_t port(sock.bind(0, true));
+  sock.set_rxbatch(RECVBATCHSIZE);
+  endpoint_t ep;
+  memset(&ep, 0, sizeof(ep));
+  ep.sin_family = AF_INET;
+  ep.sin_addr.s_addr = htonl(0x7f000001);
+  ep.sin_port = htons(port);
+  std::vector<char> payload(size, 1);
+  char buffer[BUFSIZE];
+  for(size_t k = 0; k < RECVBATCHSIZE; ++k) {
+    size_t n(packmsg(buffer, BUFSIZE, 1234, k % 16, AUDIOPORT, k,
+                     payload.data(), size));
+    sock.send(buffer, n, ep);
+  }
+  size_t nmsg(sock.recv_batch());
+  sock.close();
+  if(!nmsg)
+    return -1.0;
+  uint32_t acc(0);
+  auto t1(std::chrono::steady_clock::now());
+  for(size_t p = 0; p < NUMPACKETS; ++p) {
+    size_t un(0);
+    stage_device_id_t cid(0);
+    port_t destport(0);
+    sequence_t seq(0);
+    if(sock.get_sec_msg(p % nmsg, un, cid, destport, seq))
+      acc += un + cid;
+  }
+  sink = acc;
+  return ns_since(t1, NUMPACKETS);
+}
+
+// Encrypt and decrypt a packed audio packet, with the public key of
+// the receiver (sealed box) and with a precomputed shared key; the
+// times per packet in ns are returned in t:
+static void bench_crypt(size_t size, double* t)
+{
+  uint8_t pk[crypto_box_PUBLICKEYBYTES];
+  uint8_t sk[crypto_box_SECRETKEYBYTES];
+  uint8_t key[crypto_box_BEFORENMBYTES];
+  crypto_box_keypair(pk, sk);
+  crypto_box_beforenm(key, pk, sk);
+  std::vector<char> payload(size, 1);
+  char msg[BUFSIZE];
+  char cmsg[BUFSIZE];
+  char dmsg[BUFSIZE];
+  size_t n(packmsg(msg, BUFSIZE, 1234, 1, AUDIOPORT, 0, payload.data(), size));
+  uint32_t acc(0);
+  size_t cn(0);
+  auto t1(std::chrono::steady_clock::now());
+  for(size_t p = 0; p < NUMCRYPT; ++p)
+    acc += (cn = encryptmsg(cmsg, BUFSIZE, msg, n, pk));
+  t[0] = ns_since(t1, NUMCRYPT);
+  t1 = std::chrono::steady_clock::now();
+  for(size_t p = 0; p < NUMCRYPT; ++p)
+    acc += decryptmsg(dmsg, cmsg, cn, pk, sk);
+  t[1] = ns_since(t1, NUMCRYPT);
+  t1 = std::chrono::steady_clock::now();
+  for(size_t p = 0; p < NUMCRYPT; ++p)
+    acc += (cn = encryptmsg_afternm(cmsg, BUFSIZE, msg, n, key));
+  t[2] = ns_since(t1, NUMCRYPT);
+  t1 = std::chrono::steady_clock::now();
+  for(size_t p = 0; p < NUMCRYPT; ++p)
+    acc += decryptmsg_afternm(dmsg, cmsg, cn, key);
+  t[3] = ns_since(t1, NUMCRYPT);
+  sink = acc;
+}
+
+// Build the participant list of a room, as the ping thread does once
+// per announcement period: the versioned roster with a full snapshot
+// for a joining client, and the legacy announcement of every member
+// to every client without roster support. The times per round in us
+// are returned in t:
+static void bench_roster(const std::vector<ep_desc_t>& endpoints,
+                         size_t roomsize, double* t)
+{
+  std::vector<ep_desc_t> eps(endpoints);
+  roster_t roster;
+  std::vector<std::string> msgs;
+  uint32_t acc(0);
+  auto t1(std::chrono::steady_clock::now());
+  for(size_t r = 0; r < NUMROUNDS; ++r) {
+    // one member changes its mode in each round:
+    eps[r % roomsize].mode ^= B_RECEIVEDOWNMIX;
+    roster.update(eps, false);
+    roster.pack_delta(msgs);
+    acc += msgs.size();
+  }
+  t[0] = 1.0e-3 * ns_since(t1, NUMROUNDS);
+  t1 = std::chrono::steady_clock::now();
+  for(size_t r = 0; r < NUMROUNDS; ++r) {
+    roster.pack_full(msgs);
+    acc += msgs.size();
+  }
+  t[1] = 1.0e-3 * ns_since(t1, NUMROUNDS);
+  // the server packs the legacy announcement once, and copies it to
+  // the send queue of each client:
+  std::vector<char> queue(BUFSIZE);
+  t1 = std::chrono::steady_clock::now();
+  for(size_t r = 0; r < NUMROUNDS; ++r) {
+    roster.pack_legacy(msgs, 1234);
+    for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+      if(!eps[cid].timeout)
+        continue;
+      for(const auto& m : msgs) {
+        memcpy(queue.data(), m.data(), m.size());
+        acc += m.size();
+      }
+    }
+  }
+  t[2] = 1.0e-3 * ns_since(t1, NUMROUNDS);
+  sink = acc;
+}
+
+int main(int argc, char** argv)
+{
+  bool json(false);
+  const char* options = "jh";
+  struct option long_options[] = {
+      {"json", 0, 0, 'j'}, {"help", 0, 0, 'h'}, {0, 0, 0, 0}};
+  int opt(0);
+  int option_index(0);
+  while((opt = getopt_long(argc, argv, options, long_options,
+                           &option_index)) != -1) {
+    switch(opt) {
+    case 'h':
+      app_usage("ov-server-bench", long_options, "",
+                "Measure the cost of the packet hot path of ov-server at "
+                "typical payload and\nroom sizes. The results are printed as "
+                "tables, or with --json as one JSON\nobject per line.");
+      return 0;
+    case 'j':
+      json = true;
+      break;
+    }
+  }
+  if(sodium_init() < 0) {
+    std::cerr << "Unable to initialize libsodium." << std::endl;
+    return 1;
+  }
+  bench_report_t report(json);
+  report.table("packet", "packing and header validation per packet, in ns",
+               {"size", "packmsg_ns", "header_ns"});
+  for(auto size : payload_sizes)
+    report.row({(double)size, bench_packmsg(size), bench_header(size)});
+  report.table("crypt",
+               "encryption and decryption per packet, with the public key "
+               "and with a shared key, in ns",
+               {"size", "encrypt_ns", "decrypt_ns", "encrypt_afternm_ns",
+                "decrypt_afternm_ns"});
+  for(auto size : payload_sizes) {
+    double t[4];
+    bench_crypt(size, t);
+    report.row({(double)size, t[0], t[1], t[2], t[3]});
+  }
+  std::vector<ep_desc_t> endpoints;
+  report.table("routing", "routing cost per forwarded packet, in ns",
+               {"roomsize", "scan_ns", "table_ns"});
+  for(size_t roomsize = 2; roomsize <= 64; roomsize *= 2) {
+    create_room(endpoints, roomsize);
+    report.row({(double)roomsize, bench_scan(endpoints, roomsize),
+                bench_table(endpoints, roomsize)});
+  }
+  report.table("roster",
+               "participant list per announcement round, roster delta, full "
+               "roster and\n# legacy announcement to all clients, in us",
+               {"roomsize", "delta_us", "full_us", "legacy_us"});
+  for(size_t roomsize = 2; roomsize <= 64; roomsize *= 2) {
+    create_room(endpoints, roomsize);
+    double t[3];
+    bench_roster(endpoints, roomsize, t);
+    report.row({(double)roomsize, t[0], t[1], t[2]});
+  }
+  report.table("mix",
+               "server side mix of " + std::to_string(MIXFRAMES) +
+                   " frames per period (" + mix_kernel_name() + " kernels)",
+               {"roomsize", "channels", "us_per_period",
+                "ns_per_receiver_channel"});
+  for(size_t roomsize = 2; roomsize <= 64; roomsize *= 2) {
+    for(size_t channels = 1; channels <= 2; ++channels) {
+      double tmix(bench_mix(roomsize, channels));
+      report.row({(double)roomsize, (double)channels, tmix,
+                  1000.0 * tmix / (double)(roomsize * channels)});
+    }
+  }
+  return 0;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -1,81 +1,39 @@
 #include <arpa/inet.h>
 
 #include "../tascar/libtascar/include/tscconfig.h"
+#include "batchsocket.h"
 #include "callerlist.h"
+#include "capture.h"
 #include "common.h"
+#include "controlqueue.h"
+#include "cryptpool.h"
 #include "errmsg.h"
-#include "ovtcpsocket.h"
+#include "eventloop.h"
+#include "eventlog.h"
+#include "handoff.h"
+#include "lobbyclient.h"
+#include "metrics.h"
+#include "mixer.h"
+#include "pingts.h"
+#include "profile.h"
+#include "protocol.h"
+#include "ringbuffer.h"
+#include "roster.h"
+#include "routetable.h"
+#include "scheduler.h"
+#include "tcprelay.h"
+#include "trunk.h"
 #include "udpsocket.h"
 #include <condition_variable>
-#include <queue>
+#include <math.h>
 #include <signal.h>
 #include <string.h>
 #include <thread>
+#include <unistd.h>
 #include <vector>
 
 #include <curl/curl.h>
 
-CURL* curl;
-std::mutex curlmtx;
-
-namespace webCURL {
-
-  struct MemoryStruct {
-    char* memory;
-    size_t size;
-  };
-
-  static size_t WriteMemoryCallback(void* contents, size_t size, size_t nmemb,
-                                    void* userp)
-  {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct* mem = (struct MemoryStruct*)userp;
-    char* ptr = (char*)realloc(mem->memory, mem->size + realsize + 1);
-    if(ptr == NULL) {
-      /* out of memory! */
-      printf("not enough memory (realloc returned NULL)\n");
-      return 0;
-    }
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
-    return realsize;
-  }
-
-  CURLcode curl_get_http_response(const std::string& url,
-                                  const std::string& userpwd, std::string& retv)
-  {
-    // std::string retv;
-    struct webCURL::MemoryStruct chunk;
-    chunk.memory =
-        (char*)malloc(1); /* will be grown as needed by the realloc above */
-    chunk.size = 0;       /* no data at this point */
-    std::lock_guard<std::mutex> lock(curlmtx);
-    curl_easy_reset(curl);
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    if(userpwd.size())
-      curl_easy_setopt(curl, CURLOPT_USERPWD, userpwd.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, webCURL::WriteMemoryCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&chunk);
-    curl_easy_setopt(curl, CURLOPT_IPRESOLVE, CURL_IPRESOLVE_V4);
-    curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-    // curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "PUT");
-    // curl_easy_setopt(curl, CURLOPT_POSTFIELDS, curlstrdevice.c_str());
-    CURLcode res = curl_easy_perform(curl);
-    if(res == CURLE_OK) {
-      retv.clear();
-      retv.insert(0, chunk.memory, chunk.size);
-    } else {
-      DEBUG(url);
-      DEBUG(curl_easy_strerror(res));
-    }
-    free(chunk.memory);
-    return res;
-  }
-
-} // namespace webCURL
-
 class latreport_t {
 public:
   latreport_t() : src(0), dest(0), tmean(0), jitter(0){};
@@ -86,6 +44,28 @@ public:
   stage_device_id_t dest;
   double tmean;
   double jitter;
+  // mean round trip time from kernel time stamps, or negative:
+  double kernel = -1.0;
+};
+
+// control messages waiting for the control thread, per room:
+#define CTLQUEUELEN 128
+
+// datagram types of the ping period, see ping_tx_t:
+#define PINGTX_MSG 0
+#define PINGTX_PING 1
+#define PINGTX_PUBKEY 2
+
+// datagram of the ping period, collected with the control mutex and
+// sent without it; messages are packed into a shared buffer, pings
+// and public keys are packed when they are sent:
+class ping_tx_t {
+public:
+  uint8_t type = PINGTX_MSG;
+  stage_device_id_t cid = 0;
+  endpoint_t ep;
+  size_t pos = 0;
+  size_t len = 0;
 };
 
 // period time of participant list announcement, in ping periods:
@@ -99,14 +79,149 @@ public:
 
 #define ANNOUNCEMENTPERIOD_FAILURE_MS 50000
 
+// period time of batched latency reports to the lobby, in ping periods:
+#define LATREPORTPERIOD 20
+
+// maximum number of latency reports waiting for the lobby:
+#define LATFIFOSIZE 1024
+
+// period time of forwarding statistics log, in ping periods:
+#define STATISTICSPERIOD 1200
+
+// period of the load estimate, in ping periods:
+#define LOADPERIOD 20
+
+// upper limit of the adaptive ping interval, in ping periods:
+#define MAXPINGINTERVAL 8
+
+// number of stable round trip times before the ping interval grows:
+#define PINGSTABLECOUNT 4
+
+// period of the quit flag check, without signalfd support, in ms:
+#define QUITCHECKPERIODMS 100
+
+// period of pings and lobby requests while the room is empty, in ms:
+#define IDLEPERIODMS 1000
+
+// receive timeout, in ms; a stopped session interrupts the receive
+// threads with WAKESIGNAL, the timeout only catches a signal which
+// arrived before the thread blocked:
+#define RECVTIMEOUTMS 1000
+
+// signal which interrupts blocking receive calls:
+#define WAKESIGNAL SIGUSR1
+
 static bool quit_app(false);
 
-class ov_server_t : public endpoint_list_t {
+// count down a period counter by n ping periods:
+static void count_down(uint32_t& cnt, uint32_t n)
+{
+  cnt -= std::min(cnt, n);
+}
+
+// adaptive ping interval of one endpoint: endpoints with a stable
+// round trip time are pinged less often.
+class ping_schedule_t {
+public:
+  // interval between pings, in ping periods:
+  uint32_t interval = 1;
+  // ping periods until the next ping:
+  uint32_t countdown = 0;
+  void add_rtt(double t);
+  void reset();
+
+private:
+  double mean = -1.0;
+  uint32_t stable = 0;
+};
+
+void ping_schedule_t::add_rtt(double t)
+{
+  if(mean < 0) {
+    mean = t;
+    return;
+  }
+  double dev(fabs(t - mean));
+  mean += 0.125 * (t - mean);
+  if(dev <= std::max(1.0, 0.1 * mean)) {
+    ++stable;
+    if(stable >= PINGSTABLECOUNT) {
+      stable = 0;
+      interval = std::min(2 * interval, (uint32_t)MAXPINGINTERVAL);
+    }
+  } else {
+    // measure unstable connections at full rate:
+    stable = 0;
+    interval = 1;
+    countdown = 0;
+  }
+}
+
+void ping_schedule_t::reset()
+{
+  interval = 1;
+  countdown = 0;
+  mean = -1.0;
+  stable = 0;
+}
+
+// state of one receiving thread:
+class rx_context_t {
 public:
-  ov_server_t(int portno, int prio, const std::string& group_);
+  rx_context_t(ovbox_batchsocket_t& sock_) : sock(sock_){};
+  ovbox_batchsocket_t& sock;
+  // snapshot of the routing table, and its version:
+  std::shared_ptr<const route_table_t> routes;
+  uint64_t routes_version = 0;
+  char buffer[BUFSIZE];
+  char cmsg[BUFSIZE];
+  char mixbuf[BUFSIZE];
+  // forwarding counters, written by this thread only:
+  thread_metrics_t metrics;
+  phase_profile_t profile;
+  // kernel arrival time of the current datagram, if known:
+  struct timespec rxtime;
+  struct timespec hwrxtime;
+  bool has_rxtime = false;
+  // decryption and encryption cycles of the current batch:
+  uint64_t decrypt_cycles = 0;
+  uint64_t encrypt_cycles = 0;
+};
+
+class ov_server_t : public endpoint_list_t,
+                    public fd_handler_t,
+                    public metrics_source_t {
+public:
+  ov_server_t(int portno, int prio, const std::string& group_,
+              size_t nshards = 1, const handoff_state_t* takeover = NULL);
   ~ov_server_t();
   int portno;
   void srv();
+  // event loop interface, for hosting many rooms in one process:
+  void on_readable();
+  void on_writable();
+  void on_error();
+  int get_sockfd() const { return socket.get_sockfd(); };
+  void ping_tick();
+  void announce_tick();
+  void process_control();
+  control_queue_t& control_queue() { return ctlqueue; };
+  void add_serverjitter(double t);
+  void set_rxbatch(size_t n);
+  void set_iouring();
+  void set_cryptthreads(int n, unsigned int spinus = 0);
+  void set_fixed_secret(secret_t s);
+  void set_capture(const std::string& fname);
+  void set_kernelts(bool hardware);
+  void set_trunk_key(const std::string& path);
+  void add_trunk_peer(const endpoint_t& ep, const std::string& pubkey);
+  void set_handoff(const std::string& path);
+  /// A new process waits for the state of the room
+  bool handoff_pending() const { return handoff_requested; };
+  /// Pass the sockets and endpoints to the new process
+  void hand_over(int tcpfd);
+  /// Serve the room again after a failed hand-over
+  void resume();
   void announce_new_connection(stage_device_id_t cid, const ep_desc_t& ep);
   void announce_connection_lost(stage_device_id_t cid);
   void announce_latency(stage_device_id_t cid, double lmin, double lmean,
@@ -116,6 +231,13 @@ public:
     std::lock_guard<std::mutex> lk(settings_mtx);
     lobbyurl = url;
   };
+  /// Send lobby requests with a client shared with other rooms, whose
+  /// announcements run in the same thread; call before start
+  void set_lobby_client(std::shared_ptr<lobby_client_t> client)
+  {
+    lobby = client;
+    lobbyqueue = lobby->add_queue();
+  };
   void set_roomname(const std::string& name)
   {
     std::lock_guard<std::mutex> lk(settings_mtx);
@@ -123,43 +245,225 @@ public:
   };
   void start_services();
   void stop_services();
+  /// Stop receiving, and wake the threads of the room
+  void stop_session();
+  /// Nobody is connected, and no peer node is known
+  bool is_idle();
+  /// Ping periods per call of ping_tick() and announce_tick()
+  void set_tickperiods(uint32_t n) { tickperiods = n; };
+  /// Called by the control thread when an endpoint connects
+  std::function<void()> on_connect;
+  void write_metrics(metrics_writer_t& w);
 
 private:
-  void jittermeasurement_service();
-  std::thread jittermeasurement_thread;
-  void announce_service();
-  std::thread announce_thread;
-  void ping_and_callerlist_service();
-  std::thread logthread;
-  void quitwatch();
-  std::thread quitthread;
+  void process_msg(rx_context_t& ctx, char* buffer, size_t n, char* msg,
+                   size_t un, stage_device_id_t sender_id, port_t destport,
+                   sequence_t seq, endpoint_t& sender_endpoint);
+  void queue_control(rx_context_t& ctx, char* msg, size_t un,
+                     stage_device_id_t sender_id, port_t destport,
+                     sequence_t seq, const endpoint_t& sender_endpoint);
+  void handle_control(control_msg_t& m);
+  void forward_groupkeys(stage_device_id_t sender_id, const char* msg,
+                         size_t un);
+  void forward_roomkey(rx_context_t& ctx, const route_table_t& routes,
+                       stage_device_id_t sender_id, const char* buffer,
+                       size_t n);
+  void mix_and_send(rx_context_t& ctx, const route_table_t& routes,
+                    stage_device_id_t sender_id, const char* buffer,
+                    size_t n);
+  void update_routes(rx_context_t& ctx);
+  void publish_routes();
+  void invalidate_routes();
+  void send_roster(stage_device_id_t cid,
+                   const std::vector<std::string>& msgs);
+  void send_trunk(bool all);
+  char* pingtx_reserve();
+  void pingtx_queue(uint8_t type, const endpoint_t& ep, stage_device_id_t cid,
+                    size_t len);
+  void send_pingtx();
+  void announce_legacy();
+  void set_room_secret(secret_t s);
+  void shard_service(size_t k);
+  void control_service();
+  size_t receive_and_forward(rx_context_t& ctx);
+  void queue_latreport(const latreport_t& rep);
+  void send_latreports();
+  void send_single_latreports();
+  void log_statistics();
+  void update_load();
+  size_t phase_cycles(uint64_t* cycles);
+  std::vector<udp_sendbatch_t*> send_batches();
+  void restore(const handoff_state_t& state);
+  void set_idle(bool idle);
+  // runs pings, roster and lobby announcements of a single room:
+  std::unique_ptr<task_scheduler_t> sched;
+  size_t pingtask = 0;
+  size_t announcetask = 0;
+  // ping periods per tick, more than one while the room is idle:
+  std::atomic<uint32_t> tickperiods{1};
+  // receive threads of srv(), interrupted by stop_session():
+  std::vector<pthread_t> rx_threads;
+  std::mutex rxmtx;
   const int prio = 0;
 
   secret_t secret = 1234;
-  ovbox_udpsocket_t socket;
+  // do not create a new pin when the room is empty:
+  bool fixed_secret = false;
+  ovbox_batchsocket_t socket;
   std::atomic<bool> runsession{false};
   std::string roomname = "";
   std::string lobbyurl = "http://localhost";
   std::mutex settings_mtx;
 
-  std::queue<latreport_t> latfifo;
-  std::mutex latfifomtx;
+  // latency reports from the receive threads to the announce thread:
+  mpsc_ring_t<latreport_t> latfifo = mpsc_ring_t<latreport_t>(LATFIFOSIZE);
+  std::atomic<uint64_t> latreports_dropped{0};
+  uint64_t last_latreports_dropped = 0;
+  // lobby requests, used by the announce thread only; rooms of one
+  // process share the client, each with its own queue:
+  std::shared_ptr<lobby_client_t> lobby =
+      std::make_shared<lobby_client_t>();
+  size_t lobbyqueue = 0;
+  bool announce_pending = false;
+  std::vector<latreport_t> latbatch;
+  bool latbatch_pending = false;
+  // the lobby accepts batched reports, otherwise one request per report:
+  bool latreports_batched = true;
+  uint32_t latreportcnt = 0;
 
   double serverjitter = -1.0;
 
+  // participant announcement counter, in ping periods:
+  uint32_t participantannouncementcnt = PARTICIPANTANNOUNCEPERIOD;
+  // statistics log counter, in ping periods:
+  uint32_t statisticscnt = STATISTICSPERIOD;
+  // lobby announcement counter, in ping periods:
+  uint32_t announcementCounter = 0;
+  // endpoints which were alive in the previous ping period:
+  std::vector<bool> alive = std::vector<bool>(MAX_STAGE_ID, false);
+  // participant list for clients with B_ROSTER, guarded by ctlmtx:
+  roster_t roster;
+  // legacy announcement of the ping period, see announce_legacy():
+  std::vector<std::string> legacymsgs;
+  // the endpoint received a full roster since it joined:
+  std::vector<bool> roster_sent = std::vector<bool>(MAX_STAGE_ID, false);
+  // last ping round trip time of each endpoint, in ms:
+  std::vector<std::atomic<double>> rtt =
+      std::vector<std::atomic<double>>(MAX_STAGE_ID);
+  // round trip times from kernel time stamps, or NULL; guarded by
+  // pingtsmtx:
+  std::unique_ptr<ping_timestamps_t> pingts;
+  std::mutex pingtsmtx;
+  // datagrams of the ping period, used by the ping thread only:
+  std::vector<ping_tx_t> pingtx;
+  std::vector<char> pingtx_data;
+  size_t pingtx_len = 0;
+  // ping intervals, guarded by ctlmtx:
+  std::vector<ping_schedule_t> pingsched =
+      std::vector<ping_schedule_t>(MAX_STAGE_ID);
+
+  // number of received packets which were forwarded:
+  std::atomic<uint64_t> num_forwarded{0};
+  uint64_t last_forwarded = 0;
+  uint64_t last_syscalls = 0;
+  uint64_t last_datagrams = 0;
+  // in-server queueing delay of batch-received packets, in ms:
+  std::atomic<double> rx_queuedelay_sum{0.0};
+  std::atomic<double> rx_queuedelay_max{0.0};
+  std::atomic<uint64_t> rx_queuedelay_n{0};
+  double last_queuedelay_sum = 0.0;
+  uint64_t last_queuedelay_n = 0;
+  // utilization and capacity estimate, used by the ping thread only:
+  load_estimator_t load;
+  uint32_t loadcnt = LOADPERIOD;
+  // published estimate, for the metrics:
+  std::atomic<double> utilization{0.0};
+  std::atomic<int> capacity{-1};
+  std::atomic<double> cycles_per_second{0.0};
+
   std::string group;
+
+  // current snapshot of the forwarding destinations of each sender,
+  // accessed with std::atomic_load/std::atomic_store; built by the
+  // control thread, or by a receive thread for a new sender:
+  std::shared_ptr<const route_table_t> routes =
+      std::shared_ptr<const route_table_t>(new route_table_t());
+  std::atomic<uint64_t> routes_version{0};
+  // set when the routing table needs to be rebuilt:
+  std::atomic<bool> routes_dirty{true};
+  // serializes the builds, taken before ctlmtx:
+  std::mutex publishmtx;
+  // control messages from the receive threads to the control thread:
+  control_queue_t ctlqueue = control_queue_t(CTLQUEUELEN);
+  std::atomic<uint64_t> num_control{0};
+  // serializes control messages, which modify the endpoint list:
+  std::mutex ctlmtx;
+  // shared keys of the server with each endpoint, guarded by ctlmtx:
+  shared_key_cache_t keys;
+  // all endpoints use a shared room key (B_GROUPKEY):
+  std::atomic<bool> groupkey_active{false};
+  // server side mix for downmix receivers (B_MIXPCM), shared by the
+  // receive threads without a lock:
+  audio_mixer_t mixer;
+  // threads for parallel encryption, or NULL:
+  std::unique_ptr<crypt_pool_t> cryptpool;
+  // peer nodes of the room and their endpoints, guarded by ctlmtx:
+  trunk_t trunk;
+  std::atomic<uint64_t> num_trunk_in{0};
+  std::atomic<uint64_t> num_trunk_out{0};
+  // Unix socket for a new process which takes over the room, or NULL:
+  std::unique_ptr<handoff_listener_t> handoff;
+  std::atomic<bool> handoff_requested{false};
+  // the sockets use io_uring, also after a failed hand-over:
+  bool iouring = false;
+  // writer of received datagrams, or NULL:
+  std::unique_ptr<capture_writer_t> capture;
+  uint64_t last_capture_dropped = 0;
+
+  rx_context_t main_ctx;
+  // additional sockets on the same port (SO_REUSEPORT), each with its
+  // own receive thread:
+  std::vector<std::unique_ptr<ovbox_batchsocket_t>> shards;
+  std::vector<std::unique_ptr<rx_context_t>> shard_ctx;
+  std::vector<std::thread> shard_threads;
 };
 
-ov_server_t::ov_server_t(int portno_, int prio, const std::string& group_)
+ov_server_t::ov_server_t(int portno_, int prio, const std::string& group_,
+                         size_t nshards, const handoff_state_t* takeover)
     : portno(portno_), prio(prio), socket(secret, STAGE_ID_SERVER),
-      roomname(addr2str(getipaddr().sin_addr) + ":" + std::to_string(portno)),
-      group(group_)
+      group(group_), main_ctx(socket)
 {
   endpoints.resize(255, ep_desc_t());
   // for(auto& ep:endpoints)
   //  memset(&ep,0,sizeof(ep));
-  socket.set_timeout_usec(100000);
+  socket.set_timeout_usec(1000 * RECVTIMEOUTMS);
+  if(takeover) {
+    // the sockets of the previous process are already bound, and keep
+    // the datagrams which arrived during the hand-over:
+    portno = socket.adopt(takeover->udpfds[0]);
+    for(size_t k = 1; k < takeover->udpfds.size(); ++k) {
+      shards.emplace_back(new ovbox_batchsocket_t(secret, STAGE_ID_SERVER));
+      shards.back()->set_timeout_usec(1000 * RECVTIMEOUTMS);
+      shards.back()->adopt(takeover->udpfds[k]);
+      shard_ctx.emplace_back(new rx_context_t(*shards.back()));
+    }
+    roomname = addr2str(getipaddr().sin_addr) + ":" + std::to_string(portno);
+    restore(*takeover);
+    return;
+  }
+  if(nshards > 1)
+    socket.set_reuseport();
   portno = socket.bind(portno);
+  // the kernel distributes senders among the sockets by their address:
+  for(size_t k = 1; k < nshards; ++k) {
+    shards.emplace_back(new ovbox_batchsocket_t(secret, STAGE_ID_SERVER));
+    shards.back()->set_timeout_usec(1000 * RECVTIMEOUTMS);
+    shards.back()->set_reuseport();
+    shards.back()->bind(portno);
+    shard_ctx.emplace_back(new rx_context_t(*shards.back()));
+  }
+  // the default name uses the bound port, also for "-p 0":
+  roomname = addr2str(getipaddr().sin_addr) + ":" + std::to_string(portno);
 }
 
 ov_server_t::~ov_server_t()
@@ -169,44 +473,266 @@ ov_server_t::~ov_server_t()
   socket.close();
 }
 
+void ov_server_t::set_rxbatch(size_t n)
+{
+  if(n > 1) {
+    socket.set_rxbatch(n);
+    for(auto& sock : shards)
+      sock->set_rxbatch(n);
+  }
+}
+
+void ov_server_t::set_iouring()
+{
+  try {
+    socket.set_iouring();
+    for(auto& sock : shards)
+      sock->set_iouring();
+    iouring = true;
+    log(portno, "using io_uring for socket I/O");
+  }
+  catch(const std::exception& e) {
+    // all sockets of the room use the same backend, the sockets
+    // without a ring keep using recvmmsg/sendmmsg:
+    socket.release_uring();
+    for(auto& sock : shards)
+      sock->release_uring();
+    iouring = false;
+    log(portno, std::string("io_uring not available: ") + e.what());
+  }
+}
+
+void ov_server_t::set_fixed_secret(secret_t s)
+{
+  fixed_secret = true;
+  set_room_secret(s);
+}
+
+void ov_server_t::set_capture(const std::string& fname)
+{
+  capture.reset(new capture_writer_t(fname));
+  log(portno, "capturing received datagrams to " + fname);
+}
+
+void ov_server_t::set_kernelts(bool hardware)
+{
+  // the arrival times of the pongs are taken from batched receive:
+  if(!socket.rxbatch) {
+    set_rxbatch(RECVBATCHSIZE);
+    log(portno, "kernel time stamps need batched receive, using --rxbatch " +
+                    std::to_string(RECVBATCHSIZE));
+  }
+  std::lock_guard<std::mutex> lk(ctlmtx);
+  pingts.reset(new ping_timestamps_t(socket.get_sockfd(), hardware));
+  for(auto& sock : shards)
+    ping_timestamps_t::enable_rx(sock->get_sockfd(), hardware);
+  log(portno, std::string("measuring ping round trip times with ") +
+                  (hardware ? "hardware" : "software") + " time stamps");
+}
+
+void ov_server_t::set_trunk_key(const std::string& path)
+{
+  trunk.set_node_key(path);
+  log(portno, "trunk public key " + trunk.public_key());
+}
+
+void ov_server_t::add_trunk_peer(const endpoint_t& ep,
+                                 const std::string& pubkey)
+{
+  trunk.add_peer(ep, pubkey);
+  log(portno, "trunk to " + ep2str(ep));
+}
+
+void ov_server_t::set_handoff(const std::string& path)
+{
+  handoff.reset(new handoff_listener_t(path));
+  log(portno, "waiting for hand-over requests on " + path);
+}
+
+void ov_server_t::hand_over(int tcpfd)
+{
+  // the ring would take datagrams from the shared socket; it is
+  // created again by resume() if the hand-over fails:
+  socket.release_uring();
+  for(auto& sock : shards)
+    sock->release_uring();
+  handoff_state_t state;
+  memset(&(state.hdr), 0, sizeof(state.hdr));
+  state.hdr.port = portno;
+  state.hdr.secret = secret;
+  state.hdr.fixed_secret = fixed_secret;
+  memcpy(state.hdr.public_key, socket.recipient_public,
+         crypto_box_PUBLICKEYBYTES);
+  memcpy(state.hdr.secret_key, socket.recipient_secret,
+         crypto_box_SECRETKEYBYTES);
+  state.udpfds.push_back(socket.get_sockfd());
+  for(auto& sock : shards)
+    state.udpfds.push_back(sock->get_sockfd());
+  state.tcpfd = tcpfd;
+  {
+    std::lock_guard<std::mutex> lk(ctlmtx);
+    for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+      const ep_desc_t& ep(endpoints[cid]);
+      // endpoints of peer nodes are announced again by their node:
+      if((ep.timeout <= 0) || trunk.is_remote(cid))
+        continue;
+      handoff_endpoint_t e;
+      memset(&e, 0, sizeof(e));
+      e.cid = cid;
+      e.mode = ep.mode;
+      e.timeout = ep.timeout;
+      e.ep = ep.ep;
+      e.localep = ep.localep;
+      e.has_pubkey = ep.has_pubkey;
+      if(ep.has_pubkey)
+        memcpy(e.pubkey, ep.pubkey, crypto_box_PUBLICKEYBYTES);
+      state.endpoints.push_back(e);
+    }
+  }
+  handoff->send(state);
+  log(portno, "handed over " + std::to_string(state.endpoints.size()) +
+                  " endpoints to the new process");
+}
+
+void ov_server_t::resume()
+{
+  handoff_requested = false;
+  runsession = true;
+  // the rings were released by hand_over():
+  if(iouring)
+    set_iouring();
+}
+
+void ov_server_t::restore(const handoff_state_t& state)
+{
+  // clients encrypt to the public key of the previous process:
+  memcpy(socket.recipient_public, state.hdr.public_key,
+         crypto_box_PUBLICKEYBYTES);
+  memcpy(socket.recipient_secret, state.hdr.secret_key,
+         crypto_box_SECRETKEYBYTES);
+  fixed_secret = state.hdr.fixed_secret;
+  set_room_secret(state.hdr.secret);
+  std::lock_guard<std::mutex> lk(ctlmtx);
+  for(const auto& e : state.endpoints) {
+    if(e.cid >= MAX_STAGE_ID)
+      continue;
+    ep_desc_t& ep(endpoints[e.cid]);
+    ep.mode = e.mode;
+    ep.timeout = e.timeout;
+    ep.ep = e.ep;
+    ep.localep = e.localep;
+    ep.has_pubkey = e.has_pubkey;
+    if(e.has_pubkey) {
+      memcpy(ep.pubkey, e.pubkey, crypto_box_PUBLICKEYBYTES);
+      keys.update(e.cid, ep.pubkey, socket.recipient_secret);
+    }
+  }
+  invalidate_routes();
+  log(portno, "took over " + std::to_string(state.endpoints.size()) +
+                  " endpoints from the previous process");
+}
+
+void ov_server_t::set_room_secret(secret_t s)
+{
+  secret = s;
+  socket.set_secret(secret);
+  for(auto& sock : shards)
+    sock->set_secret(secret);
+}
+
+// the workers run at the priority of the receive thread, so they only
+// wait actively if asked to (spinus):
+void ov_server_t::set_cryptthreads(int n, unsigned int spinus)
+{
+  if(n < 0) {
+    // use one thread per core besides the receive thread:
+    n = std::min(7, (int)std::thread::hardware_concurrency() - 1);
+  }
+  // the pool serves one receive thread only:
+  if(shards.size())
+    n = 0;
+  if(n > 0)
+    cryptpool.reset(new crypt_pool_t(n, prio, spinus));
+  else
+    cryptpool.reset();
+}
+
 void ov_server_t::start_services()
 {
   if(runsession)
     stop_services();
-  {
-    std::lock_guard<std::mutex> lk(settings_mtx);
-    runsession = true;
-    logthread = std::thread(&ov_server_t::ping_and_callerlist_service, this);
-    quitthread = std::thread(&ov_server_t::quitwatch, this);
-    announce_thread = std::thread(&ov_server_t::announce_service, this);
-    jittermeasurement_thread =
-        std::thread(&ov_server_t::jittermeasurement_service, this);
-  }
+  runsession = true;
+  sched.reset(new task_scheduler_t(prio - 1));
+  sched->on_quit([this]() { stop_session(); });
+  tickperiods = 1;
+  // both tasks are due at the same time, and share one wakeup; the
+  // lateness of the wakeups measures the scheduling jitter:
+  pingtask = sched->add(PINGPERIODMS, [this](double lateness) {
+    add_serverjitter(lateness);
+    ping_tick();
+    bool idle(is_idle());
+    if(idle != (tickperiods > 1))
+      set_idle(idle);
+  });
+  announcetask = sched->add(PINGPERIODMS, [this](double) {
+    try {
+      announce_tick();
+    }
+    catch(const std::exception& e) {
+      DEBUG(e.what());
+    }
+  });
+  // the first client ends the idle mode at once:
+  on_connect = [this]() {
+    if(tickperiods > 1)
+      set_idle(false);
+  };
+  if(!sched->handles_signals())
+    sched->add(QUITCHECKPERIODMS, [this](double) {
+      if(quit_app)
+        stop_session();
+    });
+  sched->start();
 }
 
 void ov_server_t::stop_services()
 {
-  runsession = false;
-  if(jittermeasurement_thread.joinable())
-    jittermeasurement_thread.join();
-  if(logthread.joinable())
-    logthread.join();
-  if(quitthread.joinable())
-    quitthread.join();
-  if(announce_thread.joinable())
-    announce_thread.join();
+  stop_session();
+  // joins the scheduler thread:
+  sched.reset();
+  on_connect = nullptr;
 }
 
-void ov_server_t::quitwatch()
+void ov_server_t::stop_session()
 {
-  while(!quit_app)
-    std::this_thread::sleep_for(std::chrono::milliseconds(100));
   runsession = false;
+  ctlqueue.wake();
+  std::lock_guard<std::mutex> lk(rxmtx);
+  for(auto th : rx_threads)
+    pthread_kill(th, WAKESIGNAL);
+}
+
+// an empty room is served less often:
+void ov_server_t::set_idle(bool idle)
+{
+  uint32_t period(idle ? IDLEPERIODMS : PINGPERIODMS);
+  tickperiods = period / PINGPERIODMS;
+  sched->set_period(pingtask, period);
+  sched->set_period(announcetask, period);
+}
+
+bool ov_server_t::is_idle()
+{
+  std::lock_guard<std::mutex> lk(ctlmtx);
+  return (get_num_clients() == 0) && trunk.peers().empty();
 }
 
 void ov_server_t::announce_new_connection(stage_device_id_t cid,
                                           const ep_desc_t& ep)
 {
+  invalidate_routes();
+  if(on_connect)
+    on_connect();
   log(portno,
       "new connection for " + std::to_string(cid) + " from " + ep2str(ep.ep) +
           " in " + ((ep.mode & B_PEER2PEER) ? "peer-to-peer" : "server") +
@@ -217,6 +743,7 @@ void ov_server_t::announce_new_connection(stage_device_id_t cid,
 
 void ov_server_t::announce_connection_lost(stage_device_id_t cid)
 {
+  invalidate_routes();
   log(portno, "connection for " + std::to_string(cid) + " lost.");
 }
 
@@ -225,56 +752,80 @@ void ov_server_t::announce_latency(stage_device_id_t cid, double lmin,
                                    uint32_t lost)
 {
   if(lmean > 0) {
-    {
-      std::lock_guard<std::mutex> lk(latfifomtx);
-      latfifo.push(latreport_t(cid, 200, lmean, lmax - lmean));
+    latreport_t rep(cid, 200, lmean, lmax - lmean);
+    evlog_record_t rec(EVLOG_LATENCY, portno, cid);
+    rec.v[0] = lmin;
+    rec.v[1] = lmean;
+    rec.v[2] = lmax;
+    // the network part of the round trip time:
+    if(pingts) {
+      std::lock_guard<std::mutex> lk(pingtsmtx);
+      if(pingts->take_stats(cid, rec.v[3], rec.v[4], rec.v[5]))
+        rep.kernel = rec.v[4];
     }
-    char ctmp[1024];
-    sprintf(ctmp, "latency %d min=%1.2fms, mean=%1.2fms, max=%1.2fms", cid,
-            lmin, lmean, lmax);
-    log(portno, ctmp);
+    queue_latreport(rep);
+    evlog().add(rec);
   }
 }
 
-// This function announces the room service to the lobby:
-void ov_server_t::announce_service()
+// Queue a latency report for the lobby, drop it if the lobby does not
+// keep up:
+void ov_server_t::queue_latreport(const latreport_t& rep)
 {
-  try {
-    // Room announcement counter:
-    uint32_t announcementCounter(0);
-    // The URL part containing the HTTP GET request:
-    char httpGetRequest[1024];
-    while(runsession) {
-      if(!announcementCounter) {
-        // Check if the room is empty:
-        bool isRoomEmpty(false);
-        // If nobody is connected, create a new pin:
-        if(get_num_clients() == 0) {
-          long int randomNumber(random());
-          secret = randomNumber & 0xfffffff;
-          socket.set_secret(secret);
-          isRoomEmpty = true;
-        }
-        {
-          std::lock_guard<std::mutex> lk(settings_mtx);
-          // Register at the lobby:
-          sprintf(httpGetRequest,
-                  "?port=%d&name=%s&pin=%d&srvjit=%1.1f&grp=%s&version=%s",
-                  portno, roomname.c_str(), secret, serverjitter, group.c_str(),
-                  OVBOXVERSION);
-          serverjitter = 0;
-          std::string url(lobbyurl);
-          url += std::string(httpGetRequest);
-          if(isRoomEmpty) {
-            // Tell the frontend that the room is not in use:
-            url += "&empty=1";
-          }
-          std::string resp;
-          CURLcode response =
-              webCURL::curl_get_http_response(url, "room:room", resp);
+  // does not block or allocate, drops the report if the queue is full:
+  latfifo.push(rep);
+}
+
+// Register at the lobby when due and send pending latency reports,
+// called once per ping period, or less often while the room is idle.
+// Lobby requests do not block; their results are handled in a later
+// call.
+void ov_server_t::announce_tick()
+{
+  uint32_t n(tickperiods);
+  lobby->poll();
+  if(!announcementCounter && !announce_pending) {
+    // Check if the room is empty:
+    bool isRoomEmpty(false);
+    // If nobody is connected, create a new pin:
+    if(get_num_clients() == 0) {
+      if(!fixed_secret) {
+        long int randomNumber(random());
+        set_room_secret(randomNumber & 0xfffffff);
+      }
+      isRoomEmpty = true;
+    }
+    std::string url;
+    {
+      std::lock_guard<std::mutex> lk(settings_mtx);
+      // The URL part containing the HTTP GET request:
+      char httpGetRequest[1024];
+      // Register at the lobby:
+      sprintf(httpGetRequest,
+              "?port=%d&name=%s&pin=%d&srvjit=%1.1f&grp=%s&version=%s",
+              portno, roomname.c_str(), secret, serverjitter, group.c_str(),
+              OVBOXVERSION);
+      serverjitter = 0;
+      url = lobbyurl + std::string(httpGetRequest);
+    }
+    // utilization of the receive threads, and the number of clients
+    // the room could serve at the current packet rate, if known:
+    char ctmp[64];
+    snprintf(ctmp, sizeof(ctmp), "&load=%1.3f", (double)utilization);
+    url += ctmp;
+    if(capacity >= 0)
+      url += "&maxclients=" + std::to_string((int)capacity);
+    if(isRoomEmpty) {
+      // Tell the frontend that the room is not in use:
+      url += "&empty=1";
+    }
+    announce_pending = lobby->get(
+        url, "room:room",
+        [this, url](CURLcode res, long, const std::string& resp) {
+          announce_pending = false;
           // If the request is successful, reconnect in 6000 periods (10
           // minutes), otherwise retry in 500 periods (50 seconds):
-          if(response == CURLE_OK) {
+          if(res == CURLE_OK) {
             if(resp.size() == 0) {
               // expect empty response
               announcementCounter =
@@ -285,256 +836,1355 @@ void ov_server_t::announce_service()
                         << resp << std::endl;
               announcementCounter =
                   ANNOUNCEMENTPERIOD_FAILURE_MS / PINGPERIODMS;
-              std::cerr << "Request to " << url << " failed (invalid response)."
-                        << std::endl;
+              std::cerr << "Request to " << url
+                        << " failed (invalid response)." << std::endl;
             }
           } else {
-            announcementCounter = ANNOUNCEMENTPERIOD_FAILURE_MS / PINGPERIODMS;
+            announcementCounter =
+                ANNOUNCEMENTPERIOD_FAILURE_MS / PINGPERIODMS;
             std::cerr << "Request to " << url
-                      << " failed: " << curl_easy_strerror(response)
+                      << " failed: " << curl_easy_strerror(res)
                       << std::endl;
           }
+        },
+        lobbyqueue);
+    if(!announce_pending)
+      announcementCounter = ANNOUNCEMENTPERIOD_FAILURE_MS / PINGPERIODMS;
+  }
+  count_down(announcementCounter, n);
+  // collect latency reports:
+  latreport_t rep;
+  while(latfifo.pop(rep)) {
+    if(latbatch.size() < LATFIFOSIZE)
+      latbatch.push_back(rep);
+    else
+      ++latreports_dropped;
+  }
+  count_down(latreportcnt, n);
+  if(!latreports_batched) {
+    send_single_latreports();
+  } else if(!latreportcnt && !latbatch_pending && !latbatch.empty()) {
+    send_latreports();
+    latreportcnt = LATREPORTPERIOD;
+  }
+}
+
+// Send all collected latency reports with one POST request, one
+// report per line:
+void ov_server_t::send_latreports()
+{
+  std::string body;
+  char ctmp[1024];
+  for(const auto& rep : latbatch) {
+    sprintf(ctmp, "src=%d&dest=%d&lat=%1.1f&jit=%1.1f", rep.src, rep.dest,
+            rep.tmean, rep.jitter);
+    body += ctmp;
+    if(rep.kernel >= 0) {
+      sprintf(ctmp, "&klat=%1.1f", rep.kernel);
+      body += ctmp;
+    }
+    body += "\n";
+  }
+  std::string url;
+  {
+    std::lock_guard<std::mutex> lk(settings_mtx);
+    url = lobbyurl + "?latreports=" + std::to_string(portno);
+  }
+  std::vector<latreport_t> reports;
+  reports.swap(latbatch);
+  latbatch_pending = lobby->post(
+      url, "room:room", body,
+      [this, url, reports](CURLcode res, long httpcode,
+                           const std::string& resp) {
+        latbatch_pending = false;
+        if(res != CURLE_OK) {
+          // reports are not resent after network errors:
+          std::cerr << "Request to " << url
+                    << " failed: " << curl_easy_strerror(res) << std::endl;
+          latreports_dropped += reports.size();
+        } else if((httpcode >= 400) || (resp != LOBBYLATREPORTSACK)) {
+          // lobbies without batch support reject the request, answer
+          // with an error message, or ignore it like an announcement;
+          // use single reports instead:
+          log(portno, "lobby does not accept batched latency reports, "
+                      "sending single reports");
+          latreports_batched = false;
+          latbatch.insert(latbatch.begin(), reports.begin(), reports.end());
         }
+      },
+      lobbyqueue);
+  if(!latbatch_pending)
+    latreports_dropped += reports.size();
+}
+
+// Send the collected latency reports with one GET request each, as
+// long as the lobby client has free transfers; the remaining reports
+// wait for the next call:
+void ov_server_t::send_single_latreports()
+{
+  std::string url;
+  {
+    std::lock_guard<std::mutex> lk(settings_mtx);
+    url = lobbyurl;
+  }
+  size_t k(0);
+  char ctmp[1024];
+  // keep one request of the queue free for the announcement:
+  while((k < latbatch.size()) &&
+        (lobby->pending(lobbyqueue) + 1 < LOBBYMAXQUEUED)) {
+    const latreport_t& rep(latbatch[k]);
+    sprintf(ctmp, "?latreport=%d&src=%d&dest=%d&lat=%1.1f&jit=%1.1f", portno,
+            rep.src, rep.dest, rep.tmean, rep.jitter);
+    std::string rurl(url + ctmp);
+    if(!lobby->get(
+           rurl, "room:room",
+           [rurl](CURLcode res, long httpcode, const std::string&) {
+             if(res != CURLE_OK)
+               std::cerr << "Request to " << rurl
+                         << " failed: " << curl_easy_strerror(res)
+                         << std::endl;
+             else if(httpcode >= 400)
+               std::cerr << "Request to " << rurl << " failed (HTTP "
+                         << httpcode << ")." << std::endl;
+           },
+           lobbyqueue))
+      break;
+    ++k;
+  }
+  latbatch.erase(latbatch.begin(), latbatch.begin() + k);
+}
+
+// Add the decrypted packet of a sender to the server side mix, and
+// send the mix to all downmix receivers when a block is complete:
+void ov_server_t::mix_and_send(rx_context_t& ctx, const route_table_t& routes,
+                               stage_device_id_t sender_id,
+                               const char* buffer, size_t n)
+{
+  if(n < HEADERLEN)
+    return;
+  mix_block_t* done[MIXMAXDONE];
+  size_t ndone(mixer.add(sender_id, buffer + HEADERLEN, n - HEADERLEN,
+                         routes.num_mix_senders(), done));
+  endpoint_metrics_t* m(ctx.metrics.ep.data());
+  for(size_t k = 0; k < ndone; ++k) {
+    const mix_block_t& b(*done[k]);
+    for(const auto& d : routes.mix_dest()) {
+      size_t len(mixer.render(b, d.id, ctx.mixbuf, BUFSIZE - HEADERLEN));
+      if(!len)
+        continue;
+      size_t plen(packmsg(ctx.cmsg, BUFSIZE, secret, STAGE_ID_SERVER, PORT_MIX,
+                          (sequence_t)b.num, ctx.mixbuf, len));
+      const char* msg(ctx.cmsg);
+      if(d.encrypt) {
+        plen = route_encrypt(ctx.mixbuf, BUFSIZE, ctx.cmsg, plen, d);
+        msg = ctx.mixbuf;
       }
-      --announcementCounter;
-      std::this_thread::sleep_for(std::chrono::milliseconds(PINGPERIODMS));
-      while(!latfifo.empty()) {
-        latreport_t latencyReport;
-        {
-          std::lock_guard<std::mutex> lockGuard(latfifomtx);
-          latencyReport = latfifo.front();
-          latfifo.pop();
-        }
-        // Provide a latency report:
-        sprintf(httpGetRequest,
-                "?latreport=%d&src=%d&dest=%d&lat=%1.1f&jit=%1.1f", portno,
-                latencyReport.src, latencyReport.dest, latencyReport.tmean,
-                latencyReport.jitter);
-        std::string url(lobbyurl);
-        url += httpGetRequest;
-        {
-          std::lock_guard<std::mutex> lk(curlmtx);
-          curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-          curl_easy_setopt(curl, CURLOPT_USERPWD, "room:room");
-          curl_easy_setopt(curl, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-          CURLcode response = curl_easy_perform(curl);
-          if(response != CURLE_OK) {
-            std::cerr << "Request to " << url
-                      << " failed: " << curl_easy_strerror(response)
-                      << std::endl;
-          }
-        }
+      if(!plen) {
+        m[d.id].drops.add(1);
+        continue;
       }
+      ctx.sock.queue_send(msg, plen, d.ep, d.id);
+      m[d.id].packets_out.add(1);
+      m[d.id].bytes_out.add(plen);
     }
+    mixer.release(done[k]);
   }
-  catch(const std::exception& e) {
-    DEBUG(e.what());
+}
+
+void ov_server_t::write_metrics(metrics_writer_t& w)
+{
+  std::string room;
+  {
+    std::lock_guard<std::mutex> lk(settings_mtx);
+    // the room name is set by the lobby, and escaped:
+    room = metrics_label("room", roomname) + "," +
+           metrics_label("port", std::to_string(portno));
+  }
+  std::vector<rx_context_t*> ctxs(1, &main_ctx);
+  for(auto& ctx : shard_ctx)
+    ctxs.push_back(ctx.get());
+  std::vector<udp_sendbatch_t*> batches(send_batches());
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+    uint64_t pin(0), bin(0), pout(0), bout(0), drops(0), cryptns(0);
+    uint64_t delayns(0);
+    uint64_t hist[METRICS_DELAYBUCKETS + 1];
+    memset(hist, 0, sizeof(hist));
+    for(auto ctx : ctxs) {
+      const endpoint_metrics_t& m(ctx->metrics.ep[cid]);
+      pin += m.packets_in.get();
+      bin += m.bytes_in.get();
+      pout += m.packets_out.get();
+      bout += m.bytes_out.get();
+      drops += m.drops.get();
+      cryptns += m.crypto_ns.get();
+      delayns += m.delay_ns.get();
+      for(size_t k = 0; k <= METRICS_DELAYBUCKETS; ++k)
+        hist[k] += m.delay_hist[k].get();
+    }
+    bool alive_ep(endpoints[cid].timeout > 0);
+    if(!(pin || pout || alive_ep))
+      continue;
+    std::string l(room + "," + metrics_label("cid", std::to_string(cid)));
+    w.add("ovserver_packets_in_total", "counter",
+          "Packets received from the endpoint.", "ovserver_packets_in_total",
+          l, pin);
+    w.add("ovserver_bytes_in_total", "counter",
+          "Bytes received from the endpoint.", "ovserver_bytes_in_total", l,
+          bin);
+    w.add("ovserver_packets_out_total", "counter",
+          "Packets sent to the endpoint.", "ovserver_packets_out_total", l,
+          pout);
+    w.add("ovserver_bytes_out_total", "counter", "Bytes sent to the endpoint.",
+          "ovserver_bytes_out_total", l, bout);
+    w.add("ovserver_drops_total", "counter",
+          "Packets from or to the endpoint which were not forwarded.",
+          "ovserver_drops_total", l, drops);
+    uint64_t senddrops(0), deferred(0), backlog(0);
+    for(auto b : batches) {
+      senddrops += b->dest_drops(cid);
+      deferred += b->dest_deferred(cid);
+      backlog += b->dest_backlog(cid);
+    }
+    w.add("ovserver_send_drops_total", "counter",
+          "Datagrams to the endpoint which were dropped because the socket "
+          "buffer was full or sending failed.",
+          "ovserver_send_drops_total", l, senddrops);
+    w.add("ovserver_send_backlog", "gauge",
+          "Datagrams to the endpoint waiting for space in the socket buffer.",
+          "ovserver_send_backlog", l, backlog);
+    w.add("ovserver_send_deferred_total", "counter",
+          "Datagrams to the endpoint which waited for space in the socket "
+          "buffer.",
+          "ovserver_send_deferred_total", l, deferred);
+    w.add("ovserver_crypto_seconds_total", "counter",
+          "Time spent on decryption and encryption of packets of the "
+          "endpoint.",
+          "ovserver_crypto_seconds_total", l, 1.0e-9 * cryptns);
+    if(alive_ep && (rtt[cid] > 0))
+      w.add("ovserver_ping_rtt_seconds", "gauge",
+            "Last ping round trip time of the endpoint.",
+            "ovserver_ping_rtt_seconds", l, 1.0e-3 * rtt[cid]);
+    // set before the services start, the round trip times are atomic:
+    if(alive_ep && pingts && (pingts->last_rtt[cid] >= 0))
+      w.add("ovserver_ping_kernel_rtt_seconds", "gauge",
+            "Last ping round trip time of the endpoint, between the kernel "
+            "time stamps of ping and pong.",
+            "ovserver_ping_kernel_rtt_seconds", l,
+            1.0e-3 * pingts->last_rtt[cid]);
+    uint64_t count(0);
+    for(size_t k = 0; k <= METRICS_DELAYBUCKETS; ++k) {
+      count += hist[k];
+      char le[32];
+      if(k < METRICS_DELAYBUCKETS)
+        snprintf(le, sizeof(le), "%g", metrics_delay_bounds[k]);
+      else
+        snprintf(le, sizeof(le), "+Inf");
+      w.add("ovserver_forward_delay_seconds", "histogram",
+            "In-server delay of forwarded packets of the endpoint.",
+            "ovserver_forward_delay_seconds_bucket",
+            l + "," + metrics_label("le", le), count);
+    }
+    w.add("ovserver_forward_delay_seconds", "histogram", "",
+          "ovserver_forward_delay_seconds_sum", l, 1.0e-9 * delayns);
+    w.add("ovserver_forward_delay_seconds", "histogram", "",
+          "ovserver_forward_delay_seconds_count", l, count);
+  }
+  double cps(cycles_per_second);
+  if(cps > 0) {
+    uint64_t cycles[PROFILE_NUMPHASES];
+    phase_cycles(cycles);
+    for(size_t k = 0; k < PROFILE_NUMPHASES; ++k)
+      w.add("ovserver_phase_seconds_total", "counter",
+            k ? "" : "Time spent by the receive and encryption threads in "
+                     "each phase.",
+            "ovserver_phase_seconds_total",
+            room + "," + metrics_label("phase", profile_phase_names[k]),
+            cycles[k] / cps);
+  }
+  w.add("ovserver_control_messages_total", "counter",
+        "Control messages handled by the control thread.",
+        "ovserver_control_messages_total", room, num_control);
+  w.add("ovserver_control_dropped_total", "counter",
+        "Control messages dropped because the control queue was full.",
+        "ovserver_control_dropped_total", room, ctlqueue.num_dropped());
+  w.add("ovserver_utilization", "gauge",
+        "Busy fraction of the receive and encryption threads, summed.",
+        "ovserver_utilization", room, utilization);
+  if(capacity >= 0)
+    w.add("ovserver_capacity_clients", "gauge",
+          "Projected number of clients at the current packet rate.",
+          "ovserver_capacity_clients", room, capacity);
+  if(trunk.peers().size()) {
+    w.add("ovserver_trunk_packets_total", "counter",
+          "Audio packets received from and sent to the peer nodes.",
+          "ovserver_trunk_packets_total", room + "," + metrics_label("direction", "in"),
+          num_trunk_in);
+    w.add("ovserver_trunk_packets_total", "counter", "",
+          "ovserver_trunk_packets_total", room + "," + metrics_label("direction", "out"),
+          num_trunk_out);
+    size_t nremote;
+    {
+      std::lock_guard<std::mutex> lk(ctlmtx);
+      nremote = trunk.num_remote();
+    }
+    w.add("ovserver_remote_endpoints", "gauge",
+          "Endpoints of the room which are connected to a peer node.",
+          "ovserver_remote_endpoints", room, nremote);
   }
 }
 
-// this thread sends ping and participant list messages
-void ov_server_t::ping_and_callerlist_service()
+void ov_server_t::log_statistics()
 {
+  uint64_t forwarded(num_forwarded);
+  uint64_t syscalls(socket.txbatch.num_syscalls);
+  uint64_t datagrams(socket.txbatch.num_datagrams);
+  for(auto& sock : shards) {
+    syscalls += sock->txbatch.num_syscalls;
+    datagrams += sock->txbatch.num_datagrams;
+  }
+  // a ring submits the sends together with the receive wait:
+  if(socket.uring)
+    syscalls += socket.uring->num_syscalls;
+  for(auto& sock : shards)
+    if(sock->uring)
+      syscalls += sock->uring->num_syscalls;
+  uint64_t dforwarded(forwarded - last_forwarded);
+  if(dforwarded) {
+    char ctmp[1024];
+    sprintf(ctmp,
+            "forwarded %lu packets as %lu datagrams in %lu syscalls "
+            "(%1.3f syscalls/packet%s%s)",
+            (unsigned long)dforwarded,
+            (unsigned long)(datagrams - last_datagrams),
+            (unsigned long)(syscalls - last_syscalls),
+            (double)(syscalls - last_syscalls) / (double)dforwarded,
+            socket.txbatch.gso_enabled() ? ", gso" : "",
+            socket.uring ? ", io_uring" : "");
+    log(portno, ctmp);
+  }
+  last_forwarded = forwarded;
+  last_syscalls = syscalls;
+  last_datagrams = datagrams;
+  double qsum(rx_queuedelay_sum);
+  uint64_t qn(rx_queuedelay_n);
+  double qmax(rx_queuedelay_max.exchange(0.0));
+  if(qn > last_queuedelay_n) {
+    char ctmp[1024];
+    sprintf(ctmp, "queueing delay mean=%1.3fms, max=%1.3fms",
+            (qsum - last_queuedelay_sum) / (double)(qn - last_queuedelay_n),
+            qmax);
+    log(portno, ctmp);
+  }
+  last_queuedelay_sum = qsum;
+  last_queuedelay_n = qn;
+  if(dforwarded) {
+    std::string phases;
+    for(size_t k = 0; k < PROFILE_NUMPHASES; ++k) {
+      char ctmp[64];
+      snprintf(ctmp, sizeof(ctmp), "%s%s %1.1f%%", k ? ", " : "",
+               profile_phase_names[k], 100.0 * load.utilization(k));
+      phases += ctmp;
+    }
+    char ctmp[1024];
+    snprintf(ctmp, sizeof(ctmp), "load %1.1f%% (%s), capacity %d clients",
+             100.0 * load.utilization(), phases.c_str(), load.capacity());
+    log(portno, ctmp);
+  }
+  uint64_t dropped(latreports_dropped + latfifo.num_dropped);
+  if(dropped != last_latreports_dropped) {
+    log(portno, "dropped " +
+                    std::to_string(dropped - last_latreports_dropped) +
+                    " latency reports (lobby too slow)");
+    last_latreports_dropped = dropped;
+  }
+  if(capture && (capture->num_dropped() != last_capture_dropped)) {
+    log(portno, "dropped " +
+                    std::to_string(capture->num_dropped() -
+                                   last_capture_dropped) +
+                    " captured datagrams (capture writer too slow)");
+    last_capture_dropped = capture->num_dropped();
+  }
+}
+
+void ov_server_t::send_roster(stage_device_id_t cid,
+                              const std::vector<std::string>& msgs)
+{
+  for(const auto& m : msgs) {
+    size_t n(packmsg(pingtx_reserve(), BUFSIZE, secret, STAGE_ID_SERVER,
+                     PORT_ROSTER, 0, m.data(), m.size()));
+    pingtx_queue(PINGTX_MSG, endpoints[cid].ep, cid, n);
+  }
+}
+
+// send the changes of the local endpoints to the peer nodes, or all
+// local endpoints if all is true; call with ctlmtx:
+void ov_server_t::send_trunk(bool all)
+{
+  std::vector<std::string> msgs;
+  trunk.pack(endpoints, all, msgs);
   char buffer[BUFSIZE];
-  // participand announcement counter:
-  uint32_t participantannouncementcnt(PARTICIPANTANNOUNCEPERIOD);
-  while(runsession) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(PINGPERIODMS));
-    // send ping message to all connected endpoints:
+  for(const auto& m : msgs) {
+    size_t n(packmsg(buffer, BUFSIZE, secret, STAGE_ID_SERVER, PORT_TRUNK, 0,
+                     m.data(), m.size()));
+    for(size_t k = 0; k < trunk.peers().size(); ++k) {
+      size_t len(trunk.seal(k, pingtx_reserve(), BUFSIZE, buffer, n));
+      if(len)
+        pingtx_queue(PINGTX_MSG, trunk.peers()[k], STAGE_ID_SERVER, len);
+    }
+  }
+}
+
+// space for a message of the ping period, valid until the next call;
+// the buffer keeps its size, so steady operation does not allocate:
+char* ov_server_t::pingtx_reserve()
+{
+  if(pingtx_data.size() < pingtx_len + BUFSIZE)
+    pingtx_data.resize(pingtx_len + BUFSIZE);
+  return &(pingtx_data[pingtx_len]);
+}
+
+// add a datagram to the ping period, a message of length len was
+// packed with pingtx_reserve():
+void ov_server_t::pingtx_queue(uint8_t type, const endpoint_t& ep,
+                               stage_device_id_t cid, size_t len)
+{
+  ping_tx_t t;
+  t.type = type;
+  t.cid = cid;
+  t.ep = ep;
+  t.pos = pingtx_len;
+  t.len = len;
+  pingtx.push_back(t);
+  pingtx_len += len;
+}
+
+// announce the connected participants to all clients without roster
+// support, call with ctlmtx after roster.update():
+void ov_server_t::announce_legacy()
+{
+  // the messages do not depend on the receiver, pack them once:
+  roster.pack_legacy(legacymsgs, secret);
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+    if(!endpoints[cid].timeout || trunk.is_remote(cid))
+      continue;
+    pingtx_queue(PINGTX_PUBKEY, endpoints[cid].ep, cid, 0);
+    if(endpoints[cid].mode & B_ROSTER)
+      continue;
+    for(const auto& m : legacymsgs) {
+      memcpy(pingtx_reserve(), m.data(), m.size());
+      pingtx_queue(PINGTX_MSG, endpoints[cid].ep, cid, m.size());
+    }
+  }
+}
+
+// send the datagrams of the ping period, without ctlmtx:
+void ov_server_t::send_pingtx()
+{
+  char buffer[BUFSIZE];
+  for(const auto& t : pingtx) {
+    switch(t.type) {
+    case PINGTX_MSG:
+      socket.send(&(pingtx_data[t.pos]), t.len, t.ep);
+      break;
+    case PINGTX_PING:
+      if(pingts) {
+        // same payload as send_ping(), the time of sending, which also
+        // identifies the pong:
+        std::chrono::high_resolution_clock::time_point t1(
+            std::chrono::high_resolution_clock::now());
+        size_t n(packmsg(buffer, BUFSIZE, secret, STAGE_ID_SERVER, PORT_PING,
+                         0, (const char*)(&t1), sizeof(t1)));
+        std::lock_guard<std::mutex> lk(pingtsmtx);
+        pingts->send(buffer, n, t.ep, t.cid, t1.time_since_epoch().count());
+      } else {
+        socket.send_ping(t.ep);
+      }
+      break;
+    case PINGTX_PUBKEY:
+      socket.send_pubkey(t.ep);
+      break;
+    }
+  }
+  pingtx.clear();
+  pingtx_len = 0;
+}
+
+// send pings, and participant lists when due, called once per ping
+// period, or once per tickperiods ping periods while the room is idle:
+void ov_server_t::ping_tick()
+{
+  uint32_t n(tickperiods);
+  bool announce(!participantannouncementcnt);
+  if(announce)
+    participantannouncementcnt = PARTICIPANTANNOUNCEPERIOD;
+  if(pingts) {
+    std::lock_guard<std::mutex> lk(pingtsmtx);
+    pingts->poll();
+  }
+  {
+    // collect the datagrams of this period, and send them after the
+    // control mutex is released:
+    std::lock_guard<std::mutex> lk(ctlmtx);
+    if(trunk.peers().size()) {
+      if(trunk.expire(endpoints))
+        invalidate_routes();
+      send_trunk(announce);
+    }
+    // send ping message to all connected endpoints when due:
     for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
-      if(endpoints[cid].timeout) {
+      if((endpoints[cid].timeout > 0) != alive[cid]) {
+        // an endpoint joined or timed out, update routing:
+        alive[cid] = (endpoints[cid].timeout > 0);
+        invalidate_routes();
+        roster_sent[cid] = false;
+        pingsched[cid].reset();
+      }
+      if(endpoints[cid].timeout && !trunk.is_remote(cid)) {
         // endpoint is connected
-        socket.send_ping(endpoints[cid].ep);
+        ping_schedule_t& ps(pingsched[cid]);
+        if(!ps.countdown) {
+          pingtx_queue(PINGTX_PING, endpoints[cid].ep, cid, 0);
+          ps.countdown = ps.interval;
+        }
+        count_down(ps.countdown, n);
       }
     }
-    if(!participantannouncementcnt) {
-      // announcement of connected participants to all clients:
-      participantannouncementcnt = PARTICIPANTANNOUNCEPERIOD;
-      for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
-        if(endpoints[cid].timeout) {
-          socket.send_pubkey(endpoints[cid].ep);
-          for(stage_device_id_t epl = 0; epl != MAX_STAGE_ID; ++epl) {
-            if(endpoints[epl].timeout) {
-              // source (epl) and target (cid) endpoint are alive, send info of
-              // epl to cid:
-              {
-                // update registry:
-                size_t n = packmsg(buffer, BUFSIZE, secret, epl, PORT_LISTCID,
-                                   endpoints[epl].mode,
-                                   (const char*)(&(endpoints[epl].ep)),
-                                   sizeof(endpoints[epl].ep));
-                socket.send(buffer, n, endpoints[cid].ep);
-              }
-              {
-                // update local IP address:
-                size_t n =
-                    packmsg(buffer, BUFSIZE, secret, epl, PORT_SETLOCALIP, 0,
-                            (const char*)(&(endpoints[epl].localep)),
-                            sizeof(endpoints[epl].localep));
-                socket.send(buffer, n, endpoints[cid].ep);
-              }
-              {
-                // update public key, if available:
-                if(endpoints[epl].has_pubkey) {
-                  // DEBUG(bin2base64((uint8_t*)(endpoints[epl].pubkey),crypto_box_PUBLICKEYBYTES));
-                  size_t n = packmsg(buffer, BUFSIZE, secret, epl, PORT_PUBKEY,
-                                     0, (const char*)(endpoints[epl].pubkey),
-                                     crypto_box_PUBLICKEYBYTES);
-                  socket.send(buffer, n, endpoints[cid].ep);
-                }
-              }
-            }
-          }
-        }
+    // roster clients get a full snapshot when they join, and deltas
+    // when the roster changed:
+    bool changed(roster.update(endpoints, groupkey_active));
+    std::vector<std::string> full;
+    std::vector<std::string> delta;
+    std::vector<std::string> version;
+    if(changed)
+      roster.pack_delta(delta);
+    if(announce)
+      roster.pack_version(version);
+    for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+      if(!(endpoints[cid].timeout && (endpoints[cid].mode & B_ROSTER)) ||
+         trunk.is_remote(cid))
+        continue;
+      if(!roster_sent[cid]) {
+        if(full.empty())
+          roster.pack_full(full);
+        send_roster(cid, full);
+        roster_sent[cid] = true;
+      } else if(changed) {
+        send_roster(cid, delta);
+      } else if(announce) {
+        send_roster(cid, version);
       }
     }
-    --participantannouncementcnt;
+    if(announce)
+      announce_legacy();
   }
+  send_pingtx();
+  count_down(participantannouncementcnt, n);
+  if(!loadcnt) {
+    loadcnt = LOADPERIOD;
+    update_load();
+  }
+  count_down(loadcnt, n);
+  if(!statisticscnt) {
+    statisticscnt = STATISTICSPERIOD;
+    log_statistics();
+  }
+  count_down(statisticscnt, n);
 }
 
-void ov_server_t::srv()
+// sum the phase profiles of the receive threads and the encryption
+// workers, returns the number of threads:
+size_t ov_server_t::phase_cycles(uint64_t* cycles)
 {
-  set_thread_prio(prio);
-  char buffer[BUFSIZE];
-  char cmsg[BUFSIZE];
-  log(portno, "Multiplex service started (version " OVBOXVERSION ")");
-  endpoint_t sender_endpoint;
-  stage_device_id_t sender_id = 0;
-  port_t destport;
-  while(runsession) {
-    // n is the packed message lenght:
-    size_t n(BUFSIZE);
-    // un is the unpacked message length:
-    size_t un(BUFSIZE);
-    sequence_t seq(0);
-    char* msg(socket.recv_sec_msg(buffer, n, un, sender_id, destport, seq,
-                                  sender_endpoint));
-    if(msg && (sender_id < MAX_STAGE_ID)) {
-      // regular destination port, forward data:
-      if(destport > MAXSPECIALPORT) {
-        auto& src = endpoints[sender_id];
-        if(src.mode & B_ENCRYPTION) {
-          auto newlen = decryptmsg(cmsg, buffer, n, socket.recipient_public,
-                                   socket.recipient_secret);
+  std::vector<const phase_profile_t*> profiles(1, &(main_ctx.profile));
+  for(auto& ctx : shard_ctx)
+    profiles.push_back(&(ctx->profile));
+  if(cryptpool)
+    for(size_t k = 0; k < cryptpool->size(); ++k)
+      profiles.push_back(&(cryptpool->profile(k)));
+  memset(cycles, 0, PROFILE_NUMPHASES * sizeof(uint64_t));
+  for(auto p : profiles)
+    for(size_t k = 0; k < PROFILE_NUMPHASES; ++k)
+      cycles[k] += p->cycles[k].get();
+  return profiles.size();
+}
+
+// estimate the utilization of the receive and encryption threads from
+// their phase profiles, and the number of clients the room could
+// serve; the receive thread waits for the encryption workers, so both
+// are counted:
+void ov_server_t::update_load()
+{
+  std::vector<rx_context_t*> ctxs(1, &main_ctx);
+  for(auto& ctx : shard_ctx)
+    ctxs.push_back(ctx.get());
+  uint64_t cycles[PROFILE_NUMPHASES];
+  size_t nthreads(phase_cycles(cycles));
+  uint64_t pin(0), pout(0);
+  for(auto ctx : ctxs)
+    for(const auto& m : ctx->metrics.ep) {
+      pin += m.packets_in.get();
+      pout += m.packets_out.get();
+    }
+  load.update(cycles, pin, pout, get_num_clients(), nthreads);
+  utilization = load.utilization();
+  capacity = load.capacity();
+  cycles_per_second = load.cycles_per_second();
+}
+
+// all batches which send to the endpoints:
+std::vector<udp_sendbatch_t*> ov_server_t::send_batches()
+{
+  std::vector<udp_sendbatch_t*> batches(1, &(socket.txbatch));
+  for(auto& sock : shards)
+    batches.push_back(&(sock->txbatch));
+  return batches;
+}
+
+// the endpoint list changed, the control thread rebuilds the routing
+// table:
+void ov_server_t::invalidate_routes()
+{
+  routes_dirty = true;
+  ctlqueue.wake();
+}
+
+// rebuild the routing table if needed and publish it to the receive
+// threads, called by the control thread, and by a receive thread
+// which got audio of a sender not yet published:
+void ov_server_t::publish_routes()
+{
+  std::lock_guard<std::mutex> plk(publishmtx);
+  if(!routes_dirty.exchange(false))
+    return;
+  std::shared_ptr<route_table_t> newroutes(new route_table_t());
+  {
+    std::lock_guard<std::mutex> lk(ctlmtx);
+    newroutes->build(endpoints, keys);
+  }
+  std::atomic_store(&routes, std::shared_ptr<const route_table_t>(newroutes));
+  ++routes_version;
+  if(newroutes->groupkey_active() != groupkey_active) {
+    groupkey_active = newroutes->groupkey_active();
+    log(portno,
+        std::string("group key mode ") + (groupkey_active ? "on" : "off"));
+  }
+}
+
+// take the current routing table, without locks:
+void ov_server_t::update_routes(rx_context_t& ctx)
+{
+  // take a new snapshot only if the table changed:
+  uint64_t version(routes_version);
+  if((ctx.routes_version != version) || !ctx.routes) {
+    ctx.routes = std::atomic_load(&routes);
+    ctx.routes_version = version;
+  }
+}
+
+void ov_server_t::process_msg(rx_context_t& ctx, char* buffer, size_t n,
+                              char* msg, size_t un,
+                              stage_device_id_t sender_id, port_t destport,
+                              sequence_t seq, endpoint_t& sender_endpoint)
+{
+  char* cmsg(ctx.cmsg);
+  if(msg && (sender_id == STAGE_ID_SERVER) && (destport == PORT_TRUNK)) {
+    // endpoint state of a peer node, sealed with the key of the node:
+    int peer(trunk.peer_index(sender_endpoint));
+    size_t len(0);
+    if(peer >= 0)
+      len = trunk.open(peer, cmsg, buffer, n);
+    if(len >= HEADERLEN)
+      queue_control(ctx, &(cmsg[HEADERLEN]), len - HEADERLEN, sender_id,
+                    destport, seq, sender_endpoint);
+    return;
+  }
+  if(msg && (sender_id < MAX_STAGE_ID)) {
+    endpoint_metrics_t* m(ctx.metrics.ep.data());
+    m[sender_id].packets_in.add(1);
+    m[sender_id].bytes_in.add(n);
+    // regular destination port, forward data:
+    if(destport > MAXSPECIALPORT) {
+      update_routes(ctx);
+      if(!ctx.routes->has_sender(sender_id) && routes_dirty) {
+        // the endpoint list changed, e.g. by the registration of this
+        // sender, and the control thread did not publish it yet:
+        publish_routes();
+        update_routes(ctx);
+      }
+      const route_table_t& routes(*ctx.routes);
+      if(routes.has_sender(sender_id)) {
+        const route_src_t& src(routes.sender(sender_id));
+        // audio of remote endpoints is accepted from their node only:
+        int owner(trunk.owner(sender_id));
+        bool trunked(owner >= 0);
+        if(trunked) {
+          if(trunk.peer_index(sender_endpoint) != owner) {
+            m[sender_id].drops.add(1);
+            return;
+          }
+          // sealed by the peer node, see trunk_t::seal():
+          size_t newlen(trunk.open(owner, cmsg, buffer, n));
+          if(!newlen) {
+            m[sender_id].drops.add(1);
+            return;
+          }
           memcpy(buffer, cmsg, newlen);
           n = newlen;
+          ++num_trunk_in;
         }
-        for(stage_device_id_t target_id = 0; target_id != MAX_STAGE_ID;
-            ++target_id) {
-          auto& dest = endpoints[target_id];
-          if((target_id != sender_id) && (dest.timeout > 0) &&
-             (!(dest.mode & B_DONOTSEND)) &&
-             ((!(dest.mode & B_PEER2PEER)) || (!(src.mode & B_PEER2PEER))) &&
-             ((bool)(dest.mode & B_RECEIVEDOWNMIX) ==
-              (bool)(src.mode & B_SENDDOWNMIX))) {
-            char* send_msg = buffer;
-            size_t send_len = n;
-            // now check for encryption:
-            if((src.mode & B_ENCRYPTION) && (dest.mode & B_ENCRYPTION) &&
-               dest.has_pubkey) {
-              send_len = encryptmsg(cmsg, BUFSIZE, buffer, n, dest.pubkey);
-              send_msg = cmsg;
-            }
-            socket.send(send_msg, send_len, dest.ep);
+        if(src.keytag && !trunked) {
+          if(n < HEADERLEN + GROUPKEY_TAGBYTES) {
+            m[sender_id].drops.add(1);
+            return;
+          }
+          if(buffer[HEADERLEN] != GROUPKEY_TAG_SERVER) {
+            // encrypted with the room key, forward unchanged to the
+            // receivers which know it:
+            forward_roomkey(ctx, routes, sender_id, buffer, n);
+            return;
           }
+          uint8_t tag;
+          n = groupkey_remove_tag(buffer, n, tag);
         }
-      } else {
-        // this is a control message:
-        switch(destport) {
-        case PORT_SEQREP:
-          // sequence error report:
-          if(un == sizeof(sequence_t) + sizeof(stage_device_id_t)) {
-            stage_device_id_t sender_cid(*(sequence_t*)msg);
-            sequence_t seq(*(sequence_t*)(&(msg[sizeof(stage_device_id_t)])));
-            char ctmp[1024];
-            sprintf(ctmp, "sequence error %d sender %d %d", sender_id,
-                    sender_cid, seq);
-            log(portno, ctmp);
+        std::chrono::steady_clock::time_point t_crypt;
+        bool crypt(false);
+        if(trunked) {
+          // opened above
+        } else if(src.mode & B_ENCRYPTION) {
+          t_crypt = std::chrono::steady_clock::now();
+          crypt = true;
+          uint64_t c0(profile_cycles());
+          size_t newlen(0);
+          if(src.sharedkey)
+            newlen = decryptmsg_afternm(cmsg, buffer, n, src.key);
+          else
+            newlen = decryptmsg(cmsg, buffer, n, socket.recipient_public,
+                                socket.recipient_secret);
+          ctx.decrypt_cycles += profile_cycles() - c0;
+          if(!newlen) {
+            m[sender_id].drops.add(1);
+            return;
           }
-          break;
-        case PORT_PEERLATREP:
-          // peer-to-peer latency report:
-          if(un == 6 * sizeof(double)) {
-            double* data((double*)msg);
-            {
-              std::lock_guard<std::mutex> lk(latfifomtx);
-              latfifo.push(
-                  latreport_t(sender_id, data[0], data[2], data[3] - data[2]));
+          memcpy(buffer, cmsg, newlen);
+          n = newlen;
+        }
+        // local senders are sent once to each peer node, which fans
+        // them out to its own clients:
+        if(!trunked)
+          for(size_t k = 0; k < trunk.peers().size(); ++k) {
+            size_t len(trunk.seal(k, cmsg, BUFSIZE, buffer, n));
+            if(len) {
+              ctx.sock.queue_send(cmsg, len, trunk.peers()[k]);
+              ++num_trunk_out;
             }
-            char ctmp[1024];
-            sprintf(ctmp,
-                    "peerlat %d-%g min=%1.2fms, mean=%1.2fms, max=%1.2fms",
-                    sender_id, data[0], data[1], data[2], data[3]);
-            log(portno, ctmp);
-            sprintf(ctmp, "packages %d-%g received=%g lost=%g (%1.2f%%)",
-                    sender_id, data[0], data[4], data[5],
-                    100.0 * data[5] / (std::max(1.0, data[4] + data[5])));
-            log(portno, ctmp);
-          }
-          break;
-        case PORT_PING_SRV:
-        case PORT_PONG_SRV:
-          if(un >= sizeof(stage_device_id_t)) {
-            stage_device_id_t* pdestid((stage_device_id_t*)msg);
-            if(*pdestid < MAX_STAGE_ID)
-              socket.send(buffer, n, endpoints[*pdestid].ep);
           }
-          break;
-        case PORT_PONG: {
-          // ping response:
-          double tms(socket.get_pingtime(msg, un));
-          if(tms > 0)
-            cid_setpingtime(sender_id, tms);
-        } break;
-        case PORT_SETLOCALIP:
-          // receive local IP address of peer:
-          if(un == sizeof(endpoint_t)) {
-            // endpoint_t* localep((endpoint_t*)msg);
-            cid_setlocalip(sender_id, msg);
+        const route_dest_t* dest_enc(routes.dest_encrypted(sender_id));
+        const route_dest_t* dest_end(routes.dest_end(sender_id));
+        for(const route_dest_t* dest = routes.dest_begin(sender_id);
+            dest != dest_enc; ++dest) {
+          ctx.sock.queue_send(buffer, n, dest->ep, dest->id);
+          m[dest->id].packets_out.add(1);
+          m[dest->id].bytes_out.add(n);
+        }
+        if((dest_enc != dest_end) && !crypt) {
+          t_crypt = std::chrono::steady_clock::now();
+          crypt = true;
+        }
+        uint64_t c0(profile_cycles());
+        if(cryptpool &&
+           (routes.num_encrypted(sender_id) >= CRYPTPOOL_MINDEST)) {
+          // encrypt for many receivers in parallel, and send the
+          // results from this thread:
+          cryptpool->encrypt(buffer, n, dest_enc, dest_end);
+          size_t i(0);
+          for(const route_dest_t* dest = dest_enc; dest != dest_end;
+              ++dest, ++i) {
+            size_t send_len(0);
+            const char* cm(cryptpool->result(i, send_len));
+            if(cm) {
+              ctx.sock.queue_send(cm, send_len, dest->ep, dest->id);
+              m[dest->id].packets_out.add(1);
+              m[dest->id].bytes_out.add(send_len);
+            } else {
+              m[dest->id].drops.add(1);
+            }
           }
-          break;
-        case PORT_REGISTER: {
-          // register new client:
-          // in the register packet the sequence is used to transmit
-          // peer2peer flag:
-          std::string rver("---");
-          if(un > 0) {
-            msg[un - 1] = 0;
-            rver = msg;
+        } else {
+          for(const route_dest_t* dest = dest_enc; dest != dest_end;
+              ++dest) {
+            size_t send_len(route_encrypt(cmsg, BUFSIZE, buffer, n, *dest));
+            if(send_len) {
+              ctx.sock.queue_send(cmsg, send_len, dest->ep, dest->id);
+              m[dest->id].packets_out.add(1);
+              m[dest->id].bytes_out.add(send_len);
+            } else {
+              m[dest->id].drops.add(1);
+            }
           }
-          cid_register(sender_id, (char*)(&sender_endpoint), seq, rver);
-        } break;
-        case PORT_PUBKEY: {
-          cid_set_pubkey(sender_id, msg, un);
-        } break;
         }
+        ctx.encrypt_cycles += profile_cycles() - c0;
+        if(crypt)
+          m[sender_id].crypto_ns.add(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::steady_clock::now() - t_crypt)
+                  .count());
+        if(routes.is_mix_sender(sender_id) && routes.mix_dest().size())
+          mix_and_send(ctx, routes, sender_id, buffer, n);
+      } else {
+        // the registration of the sender is still in the control
+        // queue, or the sender is unknown:
+        m[sender_id].drops.add(1);
+        return;
+      }
+      ++num_forwarded;
+    } else if((destport == PORT_PING_SRV) || (destport == PORT_PONG_SRV)) {
+      // peer-to-peer pings are relayed immediately, their round trip
+      // time includes the server:
+      if(un >= sizeof(stage_device_id_t)) {
+        stage_device_id_t destid(*(stage_device_id_t*)msg);
+        update_routes(ctx);
+        if((destid < MAX_STAGE_ID) && ctx.routes->has_sender(destid))
+          ctx.sock.queue_send(buffer, n, ctx.routes->endpoint(destid));
+      }
+    } else {
+      // this is a control message, handled by the control thread:
+      queue_control(ctx, msg, un, sender_id, destport, seq, sender_endpoint);
+    }
+  }
+}
+
+// forward a packet which is encrypted with the room key, with its key
+// byte, to the receivers which support the room key:
+void ov_server_t::forward_roomkey(rx_context_t& ctx,
+                                  const route_table_t& routes,
+                                  stage_device_id_t sender_id,
+                                  const char* buffer, size_t n)
+{
+  endpoint_metrics_t* m(ctx.metrics.ep.data());
+  for(const route_dest_t* dest = routes.dest_begin(sender_id);
+      dest != routes.dest_end(sender_id); ++dest) {
+    if(dest->keytag) {
+      ctx.sock.queue_send(buffer, n, dest->ep, dest->id);
+      m[dest->id].packets_out.add(1);
+      m[dest->id].bytes_out.add(n);
+    } else {
+      // the receiver cannot decrypt it:
+      m[dest->id].drops.add(1);
+    }
+  }
+  ++num_forwarded;
+}
+
+// copy a control message into the queue of the control thread, with
+// its arrival time:
+void ov_server_t::queue_control(rx_context_t& ctx, char* msg, size_t un,
+                                stage_device_id_t sender_id, port_t destport,
+                                sequence_t seq,
+                                const endpoint_t& sender_endpoint)
+{
+  if(un > sizeof(control_msg_t::msg))
+    return;
+  // the message is written in place, drop it if the queue is full:
+  size_t slot;
+  control_msg_t* cp(ctlqueue.claim(slot));
+  if(!cp)
+    return;
+  control_msg_t& c(*cp);
+  c.sender_id = sender_id;
+  c.destport = destport;
+  c.seq = seq;
+  c.sender_endpoint = sender_endpoint;
+  c.has_rxtime = ctx.has_rxtime;
+  c.arrival = std::chrono::high_resolution_clock::now();
+  if(ctx.has_rxtime) {
+    c.rxtime = ctx.rxtime;
+    c.hwrxtime = ctx.hwrxtime;
+    // go back to the kernel arrival time:
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    double age((double)(now.tv_sec - ctx.rxtime.tv_sec) +
+               1.0e-9 * (double)(now.tv_nsec - ctx.rxtime.tv_nsec));
+    if(age > 0)
+      c.arrival -= std::chrono::duration_cast<
+          std::chrono::high_resolution_clock::duration>(
+          std::chrono::duration<double>(age));
+  }
+  c.len = un;
+  memcpy(c.msg, msg, un);
+  ctlqueue.commit(slot);
+}
+
+// handle the queued control messages and publish the resulting
+// endpoint state, called by the control thread:
+void ov_server_t::process_control()
+{
+  control_msg_t* m;
+  while((m = ctlqueue.front())) {
+    {
+      std::lock_guard<std::mutex> lk(ctlmtx);
+      handle_control(*m);
+    }
+    ctlqueue.release();
+    ++num_control;
+  }
+  publish_routes();
+}
+
+// handle one control message, call with ctlmtx:
+void ov_server_t::handle_control(control_msg_t& m)
+{
+  char* msg(m.msg);
+  size_t un(m.len);
+  stage_device_id_t sender_id(m.sender_id);
+  if((sender_id == STAGE_ID_SERVER) && (m.destport == PORT_TRUNK)) {
+    int peer(trunk.peer_index(m.sender_endpoint));
+    if((peer >= 0) && trunk.apply(peer, msg, un, endpoints))
+      invalidate_routes();
+    return;
+  }
+  if(sender_id >= MAX_STAGE_ID)
+    return;
+  switch(m.destport) {
+  case PORT_SEQREP:
+    // sequence error report:
+    if(un == sizeof(sequence_t) + sizeof(stage_device_id_t)) {
+      stage_device_id_t sender_cid(*(sequence_t*)msg);
+      sequence_t seq(*(sequence_t*)(&(msg[sizeof(stage_device_id_t)])));
+      evlog_record_t rec(EVLOG_SEQERR, portno, sender_id);
+      rec.i[0] = sender_cid;
+      rec.i[1] = seq;
+      evlog().add(rec);
+    }
+    break;
+  case PORT_PEERLATREP:
+    // peer-to-peer latency report:
+    if(un == 6 * sizeof(double)) {
+      double* data((double*)msg);
+      queue_latreport(
+          latreport_t(sender_id, data[0], data[2], data[3] - data[2]));
+      evlog_record_t rec(EVLOG_PEERLAT, portno, sender_id);
+      memcpy(rec.v, data, sizeof(rec.v));
+      evlog().add(rec);
+    }
+    break;
+  case PORT_PONG: {
+    // ping response, with the time of sending of the ping:
+    std::chrono::high_resolution_clock::time_point t1;
+    if(un < sizeof(t1))
+      break;
+    memcpy(&t1, msg, sizeof(t1));
+    if(pingts && m.has_rxtime) {
+      std::lock_guard<std::mutex> lk(pingtsmtx);
+      pingts->add_pong(sender_id, t1.time_since_epoch().count(), m.rxtime,
+                       m.hwrxtime);
+    }
+    // the round trip time ends at the arrival of the pong, the time in
+    // the control queue is not counted:
+    double tms(std::chrono::duration<double, std::milli>(m.arrival - t1)
+                   .count());
+    if(tms > 0) {
+      cid_setpingtime(sender_id, tms);
+      pingsched[sender_id].add_rtt(tms);
+      rtt[sender_id] = tms;
+    }
+  } break;
+  case PORT_ROSTER:
+    // the roster version of the client differs from the announced
+    // one, send a full snapshot in the next ping period:
+    if(un == sizeof(uint32_t)) {
+      uint32_t version;
+      memcpy(&version, msg, sizeof(version));
+      if(version != roster.version())
+        roster_sent[sender_id] = false;
+    }
+    break;
+  case PORT_SETLOCALIP:
+    // receive local IP address of peer:
+    if(un == sizeof(endpoint_t)) {
+      // endpoint_t* localep((endpoint_t*)msg);
+      cid_setlocalip(sender_id, msg);
+    }
+    break;
+  case PORT_REGISTER: {
+    // register new client:
+    // in the register packet the sequence is used to transmit
+    // peer2peer flag:
+    std::string rver("---");
+    if(un > 0) {
+      msg[un - 1] = 0;
+      rver = msg;
+    }
+    epmode_t oldmode(endpoints[sender_id].mode);
+    endpoint_t oldep(endpoints[sender_id].ep);
+    // a local client replaces a remote endpoint of the same ID:
+    trunk.set_local(sender_id);
+    cid_register(sender_id, (char*)(&(m.sender_endpoint)), m.seq, rver);
+    if((oldmode != endpoints[sender_id].mode) ||
+       (oldep.sin_addr.s_addr != endpoints[sender_id].ep.sin_addr.s_addr) ||
+       (oldep.sin_port != endpoints[sender_id].ep.sin_port))
+      invalidate_routes();
+  } break;
+  case PORT_PUBKEY: {
+    uint8_t oldkey[crypto_box_PUBLICKEYBYTES];
+    bool had_pubkey(endpoints[sender_id].has_pubkey);
+    memcpy(oldkey, endpoints[sender_id].pubkey, crypto_box_PUBLICKEYBYTES);
+    if(un > crypto_box_PUBLICKEYBYTES) {
+      // public key followed by room keys for other endpoints:
+      cid_set_pubkey(sender_id, msg, crypto_box_PUBLICKEYBYTES);
+      forward_groupkeys(sender_id, msg, un);
+    } else
+      cid_set_pubkey(sender_id, msg, un);
+    if((had_pubkey != endpoints[sender_id].has_pubkey) ||
+       memcmp(oldkey, endpoints[sender_id].pubkey,
+              crypto_box_PUBLICKEYBYTES)) {
+      // precompute the shared key of the new public key:
+      if(endpoints[sender_id].has_pubkey)
+        keys.update(sender_id, endpoints[sender_id].pubkey,
+                    socket.recipient_secret);
+      else
+        keys.clear(sender_id);
+      invalidate_routes();
+    }
+  } break;
+  }
+}
+
+// send the room keys of a PORT_PUBKEY message to their receivers,
+// called by the control thread:
+void ov_server_t::forward_groupkeys(stage_device_id_t sender_id,
+                                    const char* msg, size_t un)
+{
+  if(!(endpoints[sender_id].mode & B_GROUPKEY))
+    return;
+  char payload[crypto_box_PUBLICKEYBYTES + GROUPKEY_RECORDBYTES];
+  char buffer[BUFSIZE];
+  memcpy(payload, msg, crypto_box_PUBLICKEYBYTES);
+  for(size_t pos = crypto_box_PUBLICKEYBYTES; pos + GROUPKEY_RECORDBYTES <= un;
+      pos += GROUPKEY_RECORDBYTES) {
+    stage_device_id_t target_id(msg[pos]);
+    if((target_id >= MAX_STAGE_ID) || (target_id == sender_id))
+      continue;
+    const auto& dest(endpoints[target_id]);
+    // only clients which support room keys get a room key record:
+    if((dest.timeout > 0) && (dest.mode & B_GROUPKEY)) {
+      memcpy(&(payload[crypto_box_PUBLICKEYBYTES]), &(msg[pos]),
+             GROUPKEY_RECORDBYTES);
+      size_t n(packmsg(buffer, BUFSIZE, secret, sender_id, PORT_PUBKEY, 0,
+                       payload, sizeof(payload)));
+      socket.send(buffer, n, dest.ep);
+    }
+  }
+}
+
+// receive and process pending packets, return the number of received
+// datagrams:
+size_t ov_server_t::receive_and_forward(rx_context_t& ctx)
+{
+  ovbox_batchsocket_t& sock(ctx.sock);
+  size_t nmsg(0);
+  endpoint_t sender_endpoint;
+  stage_device_id_t sender_id = 0;
+  port_t destport;
+  // un is the unpacked message length:
+  size_t un(BUFSIZE);
+  sequence_t seq(0);
+  // senders of forwarded audio packets, for the delay histogram:
+  stage_device_id_t fwd_id[RECVBATCHSIZE];
+  size_t fwd_k[RECVBATCHSIZE];
+  size_t nfwd(0);
+  std::chrono::steady_clock::time_point t_recv;
+  // cycles of the phases, the time waiting for datagrams is not
+  // counted:
+  uint64_t c_recv(0), c_proc(0);
+  ctx.decrypt_cycles = 0;
+  ctx.encrypt_cycles = 0;
+  if(sock.rxbatch) {
+    // drain all pending datagrams with one system call:
+    nmsg = sock.recv_batch();
+    uint64_t c0(profile_cycles());
+    for(size_t k = 0; k < nmsg; ++k) {
+      // capture all datagrams, before they are modified:
+      if(capture)
+        capture->add(sock.rxbatch->buffer(k), sock.rxbatch->length(k),
+                     sock.rxbatch->sender(k), sock.rxbatch->rxtime(k));
+      char* msg(sock.get_sec_msg(k, un, sender_id, destport, seq));
+      uint64_t c1(profile_cycles());
+      c_recv += c1 - c0;
+      c0 = c1;
+      if(msg && (sender_id < MAX_STAGE_ID) && (destport > MAXSPECIALPORT)) {
+        fwd_id[nfwd] = sender_id;
+        fwd_k[nfwd] = k;
+        ++nfwd;
+      }
+      if(msg) {
+        ctx.rxtime = sock.rxbatch->rxtime(k);
+        ctx.hwrxtime = sock.rxbatch->hwrxtime(k);
+        ctx.has_rxtime = true;
+        process_msg(ctx, sock.rxbatch->buffer(k), sock.rxbatch->length(k),
+                    msg, un, sender_id, destport, seq,
+                    sock.rxbatch->sender(k));
+        c1 = profile_cycles();
+        c_proc += c1 - c0;
+        c0 = c1;
+        // in-server delay since kernel arrival time:
+        double qdelay(sock.rxbatch->age_ms(k));
+        double qsum(rx_queuedelay_sum);
+        while(!rx_queuedelay_sum.compare_exchange_weak(qsum, qsum + qdelay))
+          ;
+        double qmax(rx_queuedelay_max);
+        while((qdelay > qmax) &&
+              !rx_queuedelay_max.compare_exchange_weak(qmax, qdelay))
+          ;
+        ++rx_queuedelay_n;
+      }
+    }
+  } else {
+    // n is the packed message lenght:
+    size_t n(BUFSIZE);
+    char* msg(NULL);
+    if(sock.recv_datagram(ctx.buffer, n, sender_endpoint)) {
+      // capture all datagrams, before they are modified:
+      if(capture) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        capture->add(ctx.buffer, n, sender_endpoint, now);
       }
+      msg = sock.parse_sec_msg(ctx.buffer, n, un, sender_id, destport, seq,
+                               sender_endpoint);
     }
+    if(msg) {
+      // no kernel time stamp, measure the processing time only:
+      t_recv = std::chrono::steady_clock::now();
+      if((sender_id < MAX_STAGE_ID) && (destport > MAXSPECIALPORT)) {
+        fwd_id[0] = sender_id;
+        nfwd = 1;
+      }
+      // receiving and validation are one call, only processing is
+      // counted:
+      uint64_t c0(profile_cycles());
+      ctx.has_rxtime = false;
+      process_msg(ctx, ctx.buffer, n, msg, un, sender_id, destport, seq,
+                  sender_endpoint);
+      c_proc = profile_cycles() - c0;
+      nmsg = 1;
+    }
+  }
+  // send all messages generated by the received packets in one go:
+  uint64_t c0(profile_cycles());
+  sock.flush();
+  if(nmsg) {
+    phase_profile_t& p(ctx.profile);
+    p.cycles[PHASE_RECEIVE].add(c_recv);
+    p.cycles[PHASE_DECRYPT].add(ctx.decrypt_cycles);
+    p.cycles[PHASE_ENCRYPT].add(ctx.encrypt_cycles);
+    p.cycles[PHASE_ROUTE].add(c_proc - std::min(c_proc, ctx.decrypt_cycles +
+                                                            ctx.encrypt_cycles));
+    p.cycles[PHASE_SEND].add(profile_cycles() - c0);
   }
+  if(nfwd) {
+    endpoint_metrics_t* m(ctx.metrics.ep.data());
+    if(sock.rxbatch) {
+      struct timespec now;
+      clock_gettime(CLOCK_REALTIME, &now);
+      for(size_t k = 0; k < nfwd; ++k) {
+        const struct timespec& t(sock.rxbatch->rxtime(fwd_k[k]));
+        m[fwd_id[k]].add_delay((double)(now.tv_sec - t.tv_sec) +
+                               1.0e-9 * (double)(now.tv_nsec - t.tv_nsec));
+      }
+    } else {
+      m[fwd_id[0]].add_delay(std::chrono::duration<double>(
+                                 std::chrono::steady_clock::now() - t_recv)
+                                 .count());
+    }
+  }
+  return nmsg;
+}
+
+void ov_server_t::srv()
+{
+  set_thread_prio(prio);
+  log(portno, "Multiplex service started (version " OVBOXVERSION ")");
+  std::thread control_thread(&ov_server_t::control_service, this);
+  {
+    // the receive threads block until a datagram arrives, and are
+    // interrupted when the session stops:
+    std::lock_guard<std::mutex> lk(rxmtx);
+    rx_threads.push_back(pthread_self());
+    for(size_t k = 0; k < shards.size(); ++k) {
+      shard_threads.emplace_back(&ov_server_t::shard_service, this, k);
+      rx_threads.push_back(shard_threads.back().native_handle());
+    }
+  }
+  if(shards.size())
+    log(portno, "receiving on " + std::to_string(shards.size() + 1) +
+                    " sockets");
+  while(runsession) {
+    // deferred datagrams are sent as soon as the socket is writable:
+    main_ctx.sock.txbatch.flush_when_writable(QUITCHECKPERIODMS);
+    receive_and_forward(main_ctx);
+  }
+  {
+    std::lock_guard<std::mutex> lk(rxmtx);
+    rx_threads.clear();
+  }
+  for(auto& th : shard_threads)
+    if(th.joinable())
+      th.join();
+  shard_threads.clear();
+  control_thread.join();
   log(portno, "Multiplex service stopped");
 }
 
-double get_pingtime(std::chrono::high_resolution_clock::time_point& t1)
+void ov_server_t::shard_service(size_t k)
 {
-  std::chrono::high_resolution_clock::time_point t2(
-      std::chrono::high_resolution_clock::now());
-  std::chrono::duration<double> time_span =
-      std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
-  t1 = t2;
-  return (1000.0 * time_span.count());
+  set_thread_prio(prio);
+  while(runsession) {
+    shard_ctx[k]->sock.txbatch.flush_when_writable(QUITCHECKPERIODMS);
+    receive_and_forward(*shard_ctx[k]);
+  }
 }
 
-void ov_server_t::jittermeasurement_service()
+// handle control messages at a lower priority than the forwarding of
+// audio:
+void ov_server_t::control_service()
 {
   set_thread_prio(prio - 1);
-  std::chrono::high_resolution_clock::time_point t1;
-  get_pingtime(t1);
+  std::vector<control_queue_t*> queues(1, &ctlqueue);
   while(runsession) {
-    std::this_thread::sleep_for(std::chrono::microseconds(2000));
-    double t(get_pingtime(t1));
-    t -= 2.0;
-    serverjitter = std::max(t, serverjitter);
+    process_control();
+    control_queue_t::wait(queues, RECVTIMEOUTMS,
+                          handoff ? handoff->get_fd() : -1);
+    // a new process takes over, stop receiving at once:
+    if(handoff && !handoff_requested && handoff->poll()) {
+      handoff_requested = true;
+      stop_session();
+    }
+  }
+}
+
+void ov_server_t::on_readable()
+{
+  // limit the work per event, so other rooms of the same thread are
+  // not blocked by a busy room:
+  for(size_t k = 0; k < 8; ++k)
+    if(!receive_and_forward(main_ctx))
+      break;
+  // send the deferred datagrams when the socket is writable again:
+  wait_writable(socket.txbatch.size() > 0);
+}
+
+void ov_server_t::on_writable()
+{
+  socket.flush();
+  wait_writable(socket.txbatch.size() > 0);
+}
+
+void ov_server_t::on_error()
+{
+  if(pingts) {
+    // transmit time stamps of pings, taken by the control thread:
+    pingts->read_errqueue();
+    return;
   }
+#ifdef LINUX
+  char buf[BUFSIZE];
+  while(recv(socket.get_sockfd(), buf, sizeof(buf),
+             MSG_ERRQUEUE | MSG_DONTWAIT) >= 0)
+    ;
+#endif
+}
+
+// the server jitter reported to the lobby (srvjit) is the largest
+// lateness of the ping task wakeups since the last announcement, in
+// ms; it was the jitter of a 2 ms sleep loop before the tasks moved to
+// the scheduler, so the values are not comparable to old reports:
+void ov_server_t::add_serverjitter(double t)
+{
+  serverjitter = std::max(t, serverjitter);
+}
+
+// host many rooms in one process: the sockets of all rooms are served
+// by a pool of event loop threads, and the periodic services of all
+// rooms share one scheduler thread:
+static void multiroom_service(std::vector<std::unique_ptr<ov_server_t>>& rooms,
+                              size_t nworkers, int prio)
+{
+  epoll_pool_t pool(nworkers, prio, true);
+  for(auto& room : rooms)
+    pool.add(room->get_sockfd(), room.get());
+  pool.start();
+  // the control messages of all rooms are handled by one thread, at a
+  // lower priority than the forwarding:
+  task_scheduler_t sched(prio - 1);
+  size_t pingtask(0);
+  size_t announcetask(0);
+  // the tasks run less often while all rooms are empty:
+  std::atomic<bool> idle(false);
+  auto set_idle = [&](bool v) {
+    uint32_t period(v ? IDLEPERIODMS : PINGPERIODMS);
+    idle = v;
+    for(auto& room : rooms)
+      room->set_tickperiods(period / PINGPERIODMS);
+    sched.set_period(pingtask, period);
+    sched.set_period(announcetask, period);
+  };
+  pingtask = sched.add(PINGPERIODMS, [&](double lateness) {
+    // scheduling jitter is a property of the host, measure it once:
+    bool all_idle(true);
+    for(auto& room : rooms) {
+      room->add_serverjitter(lateness);
+      room->ping_tick();
+      all_idle = all_idle && room->is_idle();
+    }
+    if(all_idle != idle)
+      set_idle(all_idle);
+  });
+  announcetask = sched.add(PINGPERIODMS, [&](double) {
+    for(auto& room : rooms) {
+      try {
+        room->announce_tick();
+      }
+      catch(const std::exception& e) {
+        DEBUG(e.what());
+      }
+    }
+  });
+  for(auto& room : rooms)
+    room->on_connect = [&]() {
+      if(idle)
+        set_idle(false);
+    };
+  std::atomic<bool> control_running(true);
+  std::thread control_thread([&]() {
+    set_thread_prio(prio - 1);
+    std::vector<control_queue_t*> queues;
+    for(auto& room : rooms)
+      queues.push_back(&(room->control_queue()));
+    while(control_running) {
+      for(auto& room : rooms)
+        room->process_control();
+      control_queue_t::wait(queues, RECVTIMEOUTMS);
+    }
+  });
+  if(!sched.handles_signals())
+    sched.add(QUITCHECKPERIODMS, [&](double) {
+      if(quit_app)
+        sched.stop();
+    });
+  log(rooms.front()->portno,
+      "Multiplex service started for " + std::to_string(rooms.size()) +
+          " rooms on " + std::to_string(pool.size()) +
+          " threads (version " OVBOXVERSION ")");
+  // returns on SIGINT or SIGTERM:
+  sched.run();
+  pool.stop();
+  control_running = false;
+  for(auto& room : rooms)
+    room->control_queue().wake();
+  control_thread.join();
+  for(auto& room : rooms)
+    room->on_connect = nullptr;
+  log(rooms.front()->portno, "Multiplex service stopped");
 }
 
 static void sighandler(int sig)
@@ -542,6 +2192,8 @@ static void sighandler(int sig)
   quit_app = true;
 }
 
+static void wakehandler(int sig) {}
+
 int main(int argc, char** argv)
 {
   TASCAR::console_log_show(true);
@@ -552,21 +2204,42 @@ int main(int argc, char** argv)
   signal(SIGTERM, &sighandler);
   signal(SIGINT, &sighandler);
   signal(SIGPIPE, SIG_IGN);
+  // without SA_RESTART, the signal interrupts a blocking receive:
+  struct sigaction wake;
+  memset(&wake, 0, sizeof(wake));
+  wake.sa_handler = &wakehandler;
+  sigemptyset(&wake.sa_mask);
+  sigaction(WAKESIGNAL, &wake, NULL);
+  // quit signals are received by the scheduler of the periodic tasks,
+  // so no thread has to poll for them:
+  task_scheduler_t::block_signals();
   try {
     curl_global_init(CURL_GLOBAL_DEFAULT);
-    {
-      std::lock_guard<std::mutex> lk(curlmtx);
-      curl = curl_easy_init();
-      if(!curl)
-        throw ErrMsg("Unable to initialize curl.");
-    }
     int portno(0);
     int prio(55);
     std::string roomname;
     std::string lobby("http://oldbox.orlandoviols.com");
     std::string group;
     bool usetcp = false;
-    const char* options = "p:qr:hvn:l:g:";
+    size_t rxbatch(1);
+    int cryptthreads(-1);
+    // active wait of idle encryption workers, in microseconds:
+    unsigned int cryptspin(0);
+    size_t numrooms(1);
+    size_t numworkers(std::thread::hardware_concurrency());
+    size_t numshards(1);
+    int64_t pin(-1);
+    int metricsport(0);
+    std::string capturefile;
+    bool iouring(false);
+    std::vector<endpoint_t> trunkpeers;
+    std::vector<std::string> trunkpubkeys;
+    std::string trunkkey;
+    std::string handoffpath;
+    std::string takeoverpath;
+    // kernel time stamps of pings, "sw" or "hw", or empty:
+    std::string kernelts;
+    const char* options = "p:qr:hvn:l:g:b:c:S:m:w:s:P:M:C:utk:Y:O:T:K:";
     struct option long_options[] = {{"rtprio", 1, 0, 'r'},
                                     {"quiet", 0, 0, 'q'},
                                     {"port", 1, 0, 'p'},
@@ -575,12 +2248,27 @@ int main(int argc, char** argv)
                                     {"name", 1, 0, 'n'},
                                     {"lobbyurl", 1, 0, 'l'},
                                     {"group", 1, 0, 'g'},
+                                    {"rxbatch", 1, 0, 'b'},
+                                    {"cryptthreads", 1, 0, 'c'},
+                                    {"cryptspin", 1, 0, 'S'},
+                                    {"rooms", 1, 0, 'm'},
+                                    {"workers", 1, 0, 'w'},
+                                    {"shards", 1, 0, 's'},
+                                    {"pin", 1, 0, 'P'},
+                                    {"metrics", 1, 0, 'M'},
+                                    {"capture", 1, 0, 'C'},
+                                    {"iouring", 0, 0, 'u'},
                                     {
                                         "tcp",
                                         0,
                                         0,
                                         't',
                                     },
+                                    {"trunk", 1, 0, 'k'},
+                                    {"trunkkey", 1, 0, 'Y'},
+                                    {"handoff", 1, 0, 'O'},
+                                    {"takeover", 1, 0, 'T'},
+                                    {"kernelts", 1, 0, 'K'},
                                     {0, 0, 0, 0}};
     int opt(0);
     int option_index(0);
@@ -614,6 +2302,83 @@ int main(int argc, char** argv)
       case 't':
         usetcp = true;
         break;
+      case 'b':
+        rxbatch = atoi(optarg);
+        break;
+      case 'c':
+        cryptthreads = atoi(optarg);
+        break;
+      case 'S':
+        cryptspin = std::max(0, atoi(optarg));
+        break;
+      case 'm':
+        numrooms = std::max(1, atoi(optarg));
+        break;
+      case 'w':
+        numworkers = std::max(1, atoi(optarg));
+        break;
+      case 's':
+        numshards = std::max(1, atoi(optarg));
+        break;
+      case 'P':
+        pin = atoll(optarg);
+        break;
+      case 'M':
+        metricsport = atoi(optarg);
+        break;
+      case 'C':
+        capturefile = optarg;
+        break;
+      case 'u':
+        iouring = true;
+        break;
+      case 'k': {
+        // room ports and public keys of the peer nodes, as
+        // IP:PORT/KEY[,IP:PORT/KEY...]:
+        std::string s(optarg);
+        size_t pos(0);
+        while(pos < s.size()) {
+          size_t end(std::min(s.find(',', pos), s.size()));
+          std::string peer(s.substr(pos, end - pos));
+          pos = end + 1;
+          size_t slash(peer.find('/'));
+          std::string pubkey;
+          if(slash != std::string::npos) {
+            pubkey = peer.substr(slash + 1);
+            peer = peer.substr(0, slash);
+          }
+          size_t colon(peer.rfind(':'));
+          endpoint_t ep;
+          memset(&ep, 0, sizeof(ep));
+          ep.sin_family = AF_INET;
+          if(colon != std::string::npos) {
+            ep.sin_addr.s_addr = inet_addr(peer.substr(0, colon).c_str());
+            ep.sin_port = htons(atoi(peer.substr(colon + 1).c_str()));
+          }
+          if(!ep.sin_port || (ep.sin_addr.s_addr == INADDR_NONE) ||
+             pubkey.empty())
+            throw ErrMsg("Invalid trunk peer \"" + peer +
+                         "\" (expected IP:PORT/KEY).");
+          trunkpeers.push_back(ep);
+          trunkpubkeys.push_back(pubkey);
+        }
+        break;
+      }
+      case 'Y':
+        trunkkey = optarg;
+        break;
+      case 'O':
+        handoffpath = optarg;
+        break;
+      case 'T':
+        takeoverpath = optarg;
+        break;
+      case 'K':
+        kernelts = optarg;
+        if((kernelts != "sw") && (kernelts != "hw"))
+          throw ErrMsg("Invalid kernel time stamp mode \"" + kernelts +
+                       "\" (expected sw or hw).");
+        break;
       }
     }
     std::chrono::high_resolution_clock::time_point end(
@@ -624,25 +2389,140 @@ int main(int argc, char** argv)
     seed += portno;
     // initialize random generator:
     srandom(seed);
-    {
-      ov_server_t rec(portno, prio, group);
+    if(numrooms > 1) {
+      // the event loop waits for readable sockets with epoll:
+      if(iouring)
+        log(portno, "io_uring is not used with several rooms");
+      if(trunkpeers.size())
+        log(portno, "trunk mode is not available with several rooms");
+      if(!(handoffpath.empty() && takeoverpath.empty()))
+        log(portno, "hand-over is not available with several rooms");
+      // rooms on consecutive ports, served by one event loop pool; the
+      // announcements of all rooms run in one thread, and share the
+      // connections to the lobby:
+      std::vector<std::unique_ptr<ov_server_t>> rooms;
+      std::shared_ptr<lobby_client_t> lobbyclient(
+          std::make_shared<lobby_client_t>());
+      for(size_t k = 0; k < numrooms; ++k) {
+        rooms.emplace_back(
+            new ov_server_t(portno ? portno + k : 0, prio, group));
+        if(!roomname.empty())
+          rooms.back()->set_roomname(roomname + std::to_string(k + 1));
+        if(!lobby.empty())
+          rooms.back()->set_lobbyurl(lobby);
+        rooms.back()->set_lobby_client(lobbyclient);
+        if(pin >= 0)
+          rooms.back()->set_fixed_secret(pin);
+        // the event loop needs to drain the sockets:
+        rooms.back()->set_rxbatch(std::max((size_t)16, rxbatch));
+        // rooms are already distributed among the cores:
+        rooms.back()->set_cryptthreads(std::max(0, cryptthreads), cryptspin);
+        if(!kernelts.empty())
+          rooms.back()->set_kernelts(kernelts == "hw");
+        // one capture file per room:
+        if(!capturefile.empty())
+          rooms.back()->set_capture(capturefile + "." +
+                                    std::to_string(rooms.back()->portno));
+      }
+      // declared after the rooms, so it stops before they are deleted:
+      std::unique_ptr<metrics_server_t> metrics;
+      if(metricsport) {
+        metrics.reset(new metrics_server_t(metricsport));
+        for(auto& room : rooms)
+          metrics->add_source(room.get());
+        metrics->add_source(&evlog());
+      }
+      std::vector<std::unique_ptr<tcp_relay_t>> relays;
+      if(usetcp)
+        for(auto& room : rooms) {
+          relays.emplace_back(
+              new tcp_relay_t(room->portno, room->portno, prio));
+          relays.back()->start();
+        }
+      multiroom_service(rooms, numworkers, prio);
+    } else {
+      // take the sockets and endpoints of a running process:
+      std::unique_ptr<handoff_state_t> takeover;
+      if(!takeoverpath.empty()) {
+        takeover.reset(new handoff_state_t());
+        handoff_receive(takeoverpath, *takeover);
+      }
+      ov_server_t rec(portno, prio, group, numshards, takeover.get());
       if(!roomname.empty())
         rec.set_roomname(roomname);
       if(!lobby.empty())
         rec.set_lobbyurl(lobby);
-      ovtcpsocket_t tcp;
+      if(pin >= 0)
+        rec.set_fixed_secret(pin);
+      rec.set_rxbatch(rxbatch);
+      if(iouring)
+        rec.set_iouring();
+      if(!kernelts.empty())
+        rec.set_kernelts(kernelts == "hw");
+      rec.set_cryptthreads(cryptthreads, cryptspin);
+      if(!capturefile.empty())
+        rec.set_capture(capturefile);
+      if(trunkpeers.size()) {
+        if(trunkkey.empty())
+          throw ErrMsg("trunk mode needs a key of this node (--trunkkey)");
+        rec.set_trunk_key(trunkkey);
+      }
+      for(size_t k = 0; k < trunkpeers.size(); ++k)
+        rec.add_trunk_peer(trunkpeers[k], trunkpubkeys[k]);
+      // all nodes of a trunk need the same pin:
+      if(trunkpeers.size() && (pin < 0))
+        log(rec.portno, "trunk mode without fixed pin, the peer nodes "
+                        "need the same pin (--pin)");
+      std::unique_ptr<metrics_server_t> metrics;
+      if(metricsport) {
+        metrics.reset(new metrics_server_t(metricsport));
+        metrics->add_source(&rec);
+        metrics->add_source(&evlog());
+      }
+      // clients without UDP connect to the same port number with TCP:
+      std::unique_ptr<tcp_relay_t> relay;
+      int tcpfd(takeover ? takeover->tcpfd : -1);
       if(usetcp) {
-        tcp.bind(portno);
+        relay.reset(new tcp_relay_t(rec.portno, rec.portno, prio, tcpfd));
+        relay->start();
+        log(rec.portno, "TCP relay listening on port " +
+                            std::to_string(relay->get_port()));
+      } else if(tcpfd >= 0) {
+        close(tcpfd);
       }
+      if(!handoffpath.empty())
+        rec.set_handoff(handoffpath);
       rec.start_services();
-      rec.srv();
+      while(true) {
+        rec.srv();
+        if(!rec.handoff_pending())
+          break;
+        // the new process binds its own metrics port, and takes over
+        // the listening socket of the relay; relayed connections are
+        // closed and reconnect:
+        metrics.reset();
+        if(relay)
+          relay->stop();
+        try {
+          rec.hand_over(relay ? relay->get_listenfd() : -1);
+          break;
+        }
+        catch(const std::exception& e) {
+          // the new process is gone, continue to serve the room:
+          log(rec.portno, std::string("hand-over failed: ") + e.what());
+          if(metricsport) {
+            metrics.reset(new metrics_server_t(metricsport));
+            metrics->add_source(&rec);
+            metrics->add_source(&evlog());
+          }
+          if(relay)
+            relay->start();
+          rec.resume();
+        }
+      }
       rec.stop_services();
     }
-    {
-      std::lock_guard<std::mutex> lk(curlmtx);
-      curl_easy_cleanup(curl);
-      curl_global_cleanup();
-    }
+    curl_global_cleanup();
   }
   catch(const std::exception& e) {
     std::cerr << e.what() << std::endl;
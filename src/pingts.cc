@@ -0,0 +1,273 @@
+#include "pingts.h"
+#include "errmsg.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#ifdef LINUX
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#endif
+
+static bool ts_valid(const struct timespec& t)
+{
+  return t.tv_sec || t.tv_nsec;
+}
+
+static double ts_diff_ms(const struct timespec& t2, const struct timespec& t1)
+{
+  return 1000.0 * (double)(t2.tv_sec - t1.tv_sec) +
+         1.0e-6 * (double)(t2.tv_nsec - t1.tv_nsec);
+}
+
+ping_timestamps_t::ping_timestamps_t(int fd_, bool hardware_)
+    : last_rtt(MAX_STAGE_ID), fd(fd_), hardware(hardware_),
+      pings(PINGTSQUEUELEN), recent(MAX_STAGE_ID * PINGTSHISTORY, 0),
+      recentpos(MAX_STAGE_ID, 0), stats(MAX_STAGE_ID),
+      txstamps(PINGTSQUEUELEN)
+{
+#ifdef LINUX
+  for(auto& t : last_rtt)
+    t = -1.0;
+  // transmit time stamps are requested per datagram, and reported
+  // without the datagram; receive time stamps of software are already
+  // enabled by the batch receiver (SO_TIMESTAMPNS):
+  uint32_t flags(SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                 SOF_TIMESTAMPING_OPT_TSONLY);
+  if(hardware)
+    flags |= SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE;
+  if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    throw ErrMsg("Unable to enable kernel time stamps.", errno);
+#else
+  throw ErrMsg("Kernel time stamps are not supported on this system.");
+#endif
+}
+
+void ping_timestamps_t::enable_rx(int fd, bool hardware)
+{
+#ifdef LINUX
+  if(!hardware)
+    return;
+  uint32_t flags(SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE);
+  if(setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0)
+    throw ErrMsg("Unable to enable kernel time stamps.", errno);
+#endif
+}
+
+void ping_timestamps_t::send(const char* buf, size_t len,
+                             const endpoint_t& ep, stage_device_id_t cid,
+                             uint64_t tag)
+{
+#ifdef LINUX
+  struct iovec iov;
+  iov.iov_base = (void*)buf;
+  iov.iov_len = len;
+  char ctrl[CMSG_SPACE(sizeof(uint32_t))];
+  memset(ctrl, 0, sizeof(ctrl));
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_name = (void*)(&ep);
+  mh.msg_namelen = sizeof(ep);
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = ctrl;
+  mh.msg_controllen = sizeof(ctrl);
+  struct cmsghdr* cm(CMSG_FIRSTHDR(&mh));
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SO_TIMESTAMPING;
+  cm->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+  uint32_t tsflags(SOF_TIMESTAMPING_TX_SOFTWARE);
+  if(hardware)
+    tsflags |= SOF_TIMESTAMPING_TX_HARDWARE;
+  memcpy(CMSG_DATA(cm), &tsflags, sizeof(tsflags));
+  struct timespec sent;
+  clock_gettime(CLOCK_REALTIME, &sent);
+  if(sendmsg(fd, &mh, MSG_DONTWAIT) < 0) {
+    // the kernel may have counted the datagram anyway:
+    resync = true;
+    return;
+  }
+  ping_t& p(pings[nextkey % PINGTSQUEUELEN]);
+  p = ping_t();
+  p.pending = true;
+  p.key = nextkey;
+  p.tag = tag;
+  p.cid = cid;
+  p.sent = sent;
+  recent[cid * PINGTSHISTORY + recentpos[cid]] = nextkey;
+  recentpos[cid] = (recentpos[cid] + 1) % PINGTSHISTORY;
+  ++nextkey;
+#endif
+}
+
+void ping_timestamps_t::read_errqueue()
+{
+#ifdef LINUX
+  char data[64];
+  char ctrl[512];
+  while(true) {
+    struct iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+    if(recvmsg(fd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+      break;
+    struct timespec sw, hw;
+    memset(&sw, 0, sizeof(sw));
+    memset(&hw, 0, sizeof(hw));
+    bool has_key(false);
+    uint32_t key(0);
+    for(struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm != NULL;
+        cm = CMSG_NXTHDR(&mh, cm)) {
+      if((cm->cmsg_level == SOL_SOCKET) &&
+         (cm->cmsg_type == SCM_TIMESTAMPING)) {
+        struct scm_timestamping ts;
+        memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+        sw = ts.ts[0];
+        hw = ts.ts[2];
+      } else if(((cm->cmsg_level == IPPROTO_IP) &&
+                 (cm->cmsg_type == IP_RECVERR)) ||
+                ((cm->cmsg_level == IPPROTO_IPV6) &&
+                 (cm->cmsg_type == IPV6_RECVERR))) {
+        struct sock_extended_err ee;
+        memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+        if((ee.ee_errno == ENOMSG) &&
+           (ee.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)) {
+          key = ee.ee_data;
+          has_key = true;
+        }
+      }
+    }
+    if(has_key) {
+      tx_stamp_t t;
+      t.key = key;
+      t.sw = sw;
+      t.hw = hw;
+      txstamps.push(t);
+    }
+  }
+#endif
+}
+
+void ping_timestamps_t::poll()
+{
+  read_errqueue();
+  tx_stamp_t t;
+  while(txstamps.pop(t))
+    add_tx(t.key, t.sw, t.hw);
+}
+
+void ping_timestamps_t::add_tx(uint32_t kernelkey, const struct timespec& sw,
+                               const struct timespec& hw)
+{
+  uint32_t key(kernelkey + keyoffset);
+  ping_t* p(&(pings[key % PINGTSQUEUELEN]));
+  if(!(p->pending && (p->key == key)))
+    p = NULL;
+  // a software time stamp follows the send call within a short time:
+  if(p && ts_valid(sw)) {
+    double dt(ts_diff_ms(sw, p->sent));
+    if((dt < 0) || (dt > PINGTSMAXTXDELAYMS))
+      p = NULL;
+  }
+  if((!p || resync) && ts_valid(sw)) {
+    // time stamps arrive in the order of sending: take the oldest
+    // ping without time stamp which was sent shortly before
+    ping_t* found(NULL);
+    for(auto& c : pings) {
+      if(!c.pending || c.has_tx)
+        continue;
+      double dt(ts_diff_ms(sw, c.sent));
+      if((dt >= 0) && (dt <= PINGTSMAXTXDELAYMS) &&
+         (!found || (c.key - found->key > 0x80000000u)))
+        found = &c;
+    }
+    if(found) {
+      p = found;
+      keyoffset = p->key - kernelkey;
+      resync = false;
+    }
+  }
+  if(!p)
+    return;
+  if(ts_valid(sw))
+    p->tx_sw = sw;
+  if(ts_valid(hw))
+    p->tx_hw = hw;
+  p->has_tx = true;
+  if(p->has_rx)
+    complete(*p);
+}
+
+void ping_timestamps_t::add_pong(stage_device_id_t cid, uint64_t tag,
+                                 const struct timespec& rx_sw,
+                                 const struct timespec& rx_hw)
+{
+  if(cid >= MAX_STAGE_ID)
+    return;
+  for(size_t k = 0; k < PINGTSHISTORY; ++k) {
+    uint32_t key(recent[cid * PINGTSHISTORY + k]);
+    ping_t& p(pings[key % PINGTSQUEUELEN]);
+    if(p.pending && (p.key == key) && (p.cid == cid) && (p.tag == tag) &&
+       !p.has_rx) {
+      p.rx_sw = rx_sw;
+      p.rx_hw = rx_hw;
+      p.has_rx = true;
+      if(p.has_tx)
+        complete(p);
+      return;
+    }
+  }
+}
+
+void ping_timestamps_t::complete(ping_t& p)
+{
+  double t(-1.0);
+  if(ts_valid(p.tx_hw) && ts_valid(p.rx_hw)) {
+    // the hardware clock of the NIC:
+    t = ts_diff_ms(p.rx_hw, p.tx_hw);
+    ++num_hardware;
+  } else if(ts_valid(p.tx_sw) && ts_valid(p.rx_sw)) {
+    t = ts_diff_ms(p.rx_sw, p.tx_sw);
+    ++num_software;
+  } else {
+    // wait for the software time stamp:
+    return;
+  }
+  p.pending = false;
+  if(t < 0)
+    return;
+  last_rtt[p.cid] = t;
+  stats_t& s(stats[p.cid]);
+  if(!s.n || (t < s.tmin))
+    s.tmin = t;
+  if(!s.n || (t > s.tmax))
+    s.tmax = t;
+  s.sum += t;
+  ++s.n;
+}
+
+bool ping_timestamps_t::take_stats(stage_device_id_t cid, double& tmin,
+                                   double& tmean, double& tmax)
+{
+  stats_t& s(stats[cid]);
+  if(!s.n)
+    return false;
+  tmin = s.tmin;
+  tmean = s.sum / s.n;
+  tmax = s.tmax;
+  s = stats_t();
+  return true;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,135 @@
+#ifndef PINGTS_H
+#define PINGTS_H
+
+#include "common.h"
+#include "ringbuffer.h"
+#include <atomic>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+// number of pings waiting for their time stamps:
+#define PINGTSQUEUELEN 1024
+
+// pings per endpoint which can be answered, older ones are ignored:
+#define PINGTSHISTORY 4
+
+// largest plausible time from the ping send call to its software
+// transmit time stamp, in ms:
+#define PINGTSMAXTXDELAYMS 100
+
+/**
+ * Round trip times of pings measured with kernel time stamps
+ * (SO_TIMESTAMPING), to tell network latency apart from the delay
+ * which the server itself adds.
+ *
+ * Pings are sent with send(), which requests a transmit time stamp
+ * for that datagram only. The time stamps are read from the error
+ * queue of the socket with read_errqueue(), either by poll() or by
+ * the event loop thread of the socket, which epoll wakes up with
+ * EPOLLERR until the error queue is empty. The arrival time of the pong, as
+ * time stamped by the kernel on reception, is passed to add_pong().
+ * A round trip time is complete when both are known; hardware time
+ * stamps are used if the NIC provides them for both datagrams,
+ * otherwise software time stamps.
+ *
+ * Transmit time stamps are identified by the counter of
+ * SOF_TIMESTAMPING_OPT_ID, which counts the time stamped datagrams of
+ * the socket. If a send fails, the counter is re-synchronized with
+ * the software time stamps.
+ *
+ * Only read_errqueue() is thread safe, all other methods are called
+ * by the control thread. Linux only, the constructor throws elsewhere.
+ */
+class ping_timestamps_t {
+public:
+  /**
+   * @param fd Socket which sends the pings
+   * @param hardware Request hardware time stamps, the NIC must be
+   * configured for them (e.g. with hwstamp_ctl)
+   */
+  ping_timestamps_t(int fd, bool hardware);
+  /// Enable hardware receive time stamps on another socket of the room
+  static void enable_rx(int fd, bool hardware);
+  /**
+   * Send a ping with a transmit time stamp request.
+   *
+   * @param buf Packed ping message
+   * @param len Length of the message
+   * @param tag Ping identifier, echoed in the pong
+   */
+  void send(const char* buf, size_t len, const endpoint_t& ep,
+            stage_device_id_t cid, uint64_t tag);
+  /// Move the transmit time stamps from the error queue to poll()
+  void read_errqueue();
+  /// Read and process the transmit time stamps
+  void poll();
+  /// Add the kernel arrival time of a pong
+  void add_pong(stage_device_id_t cid, uint64_t tag,
+                const struct timespec& rx_sw, const struct timespec& rx_hw);
+  /**
+   * Take the statistics of an endpoint since the last call.
+   *
+   * @return False if no round trip time was measured.
+   */
+  bool take_stats(stage_device_id_t cid, double& tmin, double& tmean,
+                  double& tmax);
+  /// Last round trip time of each endpoint in ms, any thread
+  std::vector<std::atomic<double>> last_rtt;
+  uint64_t num_hardware = 0;
+  uint64_t num_software = 0;
+
+private:
+  class ping_t {
+  public:
+    bool pending = false;
+    uint32_t key = 0;
+    uint64_t tag = 0;
+    stage_device_id_t cid = 0;
+    // user space send time, CLOCK_REALTIME:
+    struct timespec sent = {0, 0};
+    struct timespec tx_sw = {0, 0};
+    struct timespec tx_hw = {0, 0};
+    struct timespec rx_sw = {0, 0};
+    struct timespec rx_hw = {0, 0};
+    bool has_tx = false;
+    bool has_rx = false;
+  };
+  class tx_stamp_t {
+  public:
+    uint32_t key = 0;
+    struct timespec sw = {0, 0};
+    struct timespec hw = {0, 0};
+  };
+  class stats_t {
+  public:
+    double tmin = 0;
+    double tmax = 0;
+    double sum = 0;
+    uint32_t n = 0;
+  };
+  void add_tx(uint32_t kernelkey, const struct timespec& sw,
+              const struct timespec& hw);
+  void complete(ping_t& p);
+  int fd;
+  bool hardware;
+  // key of the next ping, and difference to the kernel counter:
+  uint32_t nextkey = 0;
+  uint32_t keyoffset = 0;
+  bool resync = false;
+  std::vector<ping_t> pings;
+  // keys of the recent pings of each endpoint:
+  std::vector<uint32_t> recent;
+  std::vector<uint8_t> recentpos;
+  std::vector<stats_t> stats;
+  mpsc_ring_t<tx_stamp_t> txstamps;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
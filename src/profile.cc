@@ -0,0 +1,92 @@
+#include "profile.h"
+#include "common.h"
+#include <algorithm>
+#include <string.h>
+
+const char* profile_phase_names[PROFILE_NUMPHASES] = {
+    "receive", "decrypt", "route", "encrypt", "send"};
+
+load_estimator_t::load_estimator_t()
+{
+  memset(&last_wall, 0, sizeof(last_wall));
+  memset(last_cycles, 0, sizeof(last_cycles));
+  for(size_t k = 0; k < PROFILE_NUMPHASES; ++k)
+    phase_util[k] = 0.0;
+}
+
+static double smooth(double old, double v)
+{
+  if(old <= 0.0)
+    return v;
+  return old + PROFILE_SMOOTHING * (v - old);
+}
+
+void load_estimator_t::update(const uint64_t* cycles, uint64_t packets_in,
+                              uint64_t packets_out, size_t nclients,
+                              size_t nthreads)
+{
+  uint64_t wall_cycles(profile_cycles());
+  struct timespec wall;
+  clock_gettime(CLOCK_MONOTONIC, &wall);
+  uint64_t dc[PROFILE_NUMPHASES];
+  for(size_t k = 0; k < PROFILE_NUMPHASES; ++k) {
+    dc[k] = cycles[k] - last_cycles[k];
+    last_cycles[k] = cycles[k];
+  }
+  uint64_t din(packets_in - last_in);
+  uint64_t dout(packets_out - last_out);
+  last_in = packets_in;
+  last_out = packets_out;
+  double dw(wall_cycles - last_wall_cycles);
+  double dt((double)(wall.tv_sec - last_wall.tv_sec) +
+            1.0e-9 * (double)(wall.tv_nsec - last_wall.tv_nsec));
+  last_wall_cycles = wall_cycles;
+  last_wall = wall;
+  if(first || (dw <= 0.0) || (dt <= 0.0)) {
+    first = false;
+    return;
+  }
+  cps = dw / dt;
+  double busy(0.0);
+  for(size_t k = 0; k < PROFILE_NUMPHASES; ++k) {
+    phase_util[k] = smooth(phase_util[k], dc[k] / dw);
+    busy += dc[k];
+  }
+  util = smooth(util, busy / dw);
+  if(!(din && nclients && nthreads)) {
+    // no traffic, the packet rate of the clients is unknown:
+    maxclients = -1;
+    return;
+  }
+  if(dout) {
+    cost_in = smooth(cost_in,
+                     (double)(dc[PHASE_RECEIVE] + dc[PHASE_DECRYPT]) / din);
+    cost_out = smooth(cost_out, (double)(dc[PHASE_ROUTE] + dc[PHASE_ENCRYPT] +
+                                         dc[PHASE_SEND]) /
+                                    dout);
+  } else {
+    // nobody to send to, all work is per received packet:
+    cost_in = smooth(cost_in, busy / din);
+  }
+  // the sending cost is not measured yet, assume the receiving cost:
+  double cout(cost_out > 0.0 ? cost_out : cost_in);
+  // packets per client and period, and the fraction of the other
+  // clients which receive them:
+  double rate((double)din / (double)nclients);
+  double fanout(1.0);
+  if(nclients > 1)
+    fanout = std::min(1.0, (double)dout / (double)din / (nclients - 1));
+  double limit(PROFILE_MAXUTIL * nthreads * dw);
+  maxclients = 0;
+  for(int n = 1; n <= MAX_STAGE_ID; ++n) {
+    if(rate * n * (cost_in + fanout * (n - 1) * cout) > limit)
+      break;
+    maxclients = n;
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
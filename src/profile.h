@@ -0,0 +1,119 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "metrics.h"
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// phases of the forwarding path:
+// validation and unpacking of received datagrams:
+#define PHASE_RECEIVE 0
+// decryption of sender packets:
+#define PHASE_DECRYPT 1
+// routing, copying and mixing, everything else per datagram:
+#define PHASE_ROUTE 2
+// encryption for the receivers:
+#define PHASE_ENCRYPT 3
+// sending of the queued datagrams:
+#define PHASE_SEND 4
+#define PROFILE_NUMPHASES 5
+
+// utilization of the receive threads which is considered full load:
+#define PROFILE_MAXUTIL 0.8
+
+// weight of a new measurement period in the smoothed estimates:
+#define PROFILE_SMOOTHING 0.25
+
+/// Names of the phases, for logs and metrics
+extern const char* profile_phase_names[PROFILE_NUMPHASES];
+
+/**
+ * Read the cycle counter, or a monotonic clock in nanoseconds on
+ * systems without one. Only differences are meaningful.
+ */
+inline uint64_t profile_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t v;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+  return v;
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+/**
+ * Time spent in each phase, in counter cycles, written by one receive
+ * thread. Waiting for datagrams is not counted.
+ */
+class phase_profile_t {
+public:
+  metrics_counter_t cycles[PROFILE_NUMPHASES];
+};
+
+/**
+ * Utilization and capacity estimate of a room, from the phase
+ * profiles of its receive and encryption threads and the packet
+ * counts.
+ *
+ * Receive and decryption costs are per received packet, routing,
+ * encryption and sending costs are per sent datagram. The capacity is
+ * the number of clients at which the threads would reach
+ * PROFILE_MAXUTIL, assuming each client sends at the current rate to
+ * all others. Used by one thread.
+ */
+class load_estimator_t {
+public:
+  load_estimator_t();
+  /**
+   * Add a measurement period.
+   *
+   * @param cycles Cycle counts of all phases, summed over all threads,
+   * including the encryption workers
+   * @param packets_in Received audio packets, summed over all threads
+   * @param packets_out Sent audio datagrams, summed over all threads
+   * @param nclients Connected clients
+   * @param nthreads Receive and encryption threads
+   */
+  void update(const uint64_t* cycles, uint64_t packets_in,
+              uint64_t packets_out, size_t nclients, size_t nthreads);
+  /// Busy fraction of the threads, 0 to nthreads
+  double utilization() const { return util; };
+  /// Busy fraction of each phase
+  double utilization(size_t phase) const { return phase_util[phase]; };
+  /// Projected maximum number of clients, or -1 if unknown
+  int capacity() const { return maxclients; };
+  /// Counter cycles per second, or zero before the second update
+  double cycles_per_second() const { return cps; };
+
+private:
+  bool first = true;
+  uint64_t last_wall_cycles = 0;
+  struct timespec last_wall;
+  uint64_t last_cycles[PROFILE_NUMPHASES];
+  uint64_t last_in = 0;
+  uint64_t last_out = 0;
+  double cps = 0.0;
+  double util = 0.0;
+  double phase_util[PROFILE_NUMPHASES];
+  // smoothed cycles per received packet and per sent datagram:
+  double cost_in = 0.0;
+  double cost_out = 0.0;
+  int maxclients = -1;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,136 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+/*
+ * Extensions of the ovbox protocol implemented by this server.
+ *
+ * Endpoint mode flags are transmitted in the sequence field of the
+ * PORT_REGISTER message. The flags defined in libov occupy the low
+ * bits, the server side extensions are allocated from the top. A
+ * client sets an extension flag only if it implements the extension,
+ * so old clients keep the original behaviour.
+ */
+
+// Client exchanges encrypted data with the server using
+// crypto_box_easy_afternm() with the precomputed key of its own key
+// pair and the server key pair, instead of sealed boxes:
+#define B_SHAREDKEY 0x8000
+
+// Client supports a symmetric room key shared among all clients. If
+// all endpoints of a room set this flag, the server forwards the
+// encrypted audio unchanged and never decrypts it. The server
+// announces the flag in PORT_LISTCID messages only while the room is
+// in group key mode; clients then encrypt audio with the room key.
+#define B_GROUPKEY 0x4000
+
+// Audio between two endpoints which both set B_ENCRYPTION and
+// B_GROUPKEY carries a key byte after the header, in front of the
+// encrypted payload, so the key of each packet is known without the
+// mode announcement, which lags behind membership changes. With
+// GROUPKEY_TAG_SERVER the rest is encrypted as without the extension,
+// for the server (from a client) or for the receiver (from the
+// server). Any other value is the version of the room key which
+// encrypted the rest; the server forwards these packets unchanged to
+// receivers which support the room key, and drops them for all others.
+#define GROUPKEY_TAG_SERVER 0
+#define GROUPKEY_TAGBYTES 1
+
+// Size of the symmetric room key:
+#define GROUPKEYBYTES 32
+
+// A PORT_PUBKEY message may carry room keys after the public key of
+// the sender, one record for each receiver: the stage device ID of the
+// receiver and the room key, sealed with the public key of the
+// receiver. The server forwards each record to its receiver, again
+// behind the public key of the sender.
+#define GROUPKEY_RECORDBYTES                                                   \
+  (sizeof(stage_device_id_t) + crypto_box_SEALBYTES + GROUPKEYBYTES)
+
+// Client understands PORT_ROSTER messages. The server then sends the
+// participant list as compact roster messages instead of one
+// PORT_LISTCID, PORT_SETLOCALIP and PORT_PUBKEY message per peer:
+#define B_ROSTER 0x2000
+
+// Extension ports are allocated from the top of the special port
+// range:
+#define PORT_ROSTER (MAXSPECIALPORT - 1)
+
+// The payload of a PORT_ROSTER message from the server starts with a
+// roster_header_t, followed by nentries entries. Each entry starts with
+// the stage device ID and a flags byte. Unless ROSTER_REMOVED is set,
+// the mode (epmode_t), the public and the local endpoint (endpoint_t)
+// follow, and with ROSTER_HASPUBKEY the public key. All values are
+// in host byte order, like the rest of the protocol.
+//
+// A full snapshot of version v may be split into several parts; it
+// replaces the roster of the client. A delta changes version base into
+// version v. A version message carries no entries; clients whose
+// roster version differs send a PORT_ROSTER message with their
+// version (uint32_t) to the server, which answers with a full
+// snapshot.
+#define ROSTER_FULL 0
+#define ROSTER_DELTA 1
+#define ROSTER_VERSION 2
+
+#define ROSTER_REMOVED 1
+#define ROSTER_HASPUBKEY 2
+
+struct roster_header_t {
+  uint32_t version;
+  uint32_t base;
+  uint8_t kind;
+  uint8_t part;
+  uint8_t nparts;
+  uint8_t nentries;
+};
+
+// payload limit of a roster message, to avoid IP fragmentation:
+#define ROSTER_MAXPAYLOAD 1200
+
+// Servers which span one room across several nodes (trunk mode)
+// exchange the state of their local endpoints with PORT_TRUNK
+// messages from STAGE_ID_SERVER. The payload is a list of entries
+// like in PORT_ROSTER messages, without the endpoint addresses: the
+// stage device ID and a flags byte, and unless ROSTER_REMOVED is set
+// the mode (epmode_t), followed by the public key with
+// ROSTER_HASPUBKEY. Audio of local senders is forwarded to the peer
+// nodes decrypted. All packets between two nodes are sealed with the
+// shared key of their node key pairs: the header is followed by a
+// nonce and the authenticated cipher text of a 64 bit packet counter
+// of the sending node and the complete packet; receivers drop
+// counters they have seen before, see trunk_t.
+#define PORT_TRUNK (MAXSPECIALPORT - 2)
+
+// Audio payloads of the client are PCM blocks in the mix format below
+// and may be mixed by the server. A client which sets B_MIXPCM
+// together with B_RECEIVEDOWNMIX receives one mixed block of all
+// other B_MIXPCM senders per period, from STAGE_ID_SERVER, instead of
+// one stream per sender. Mixing is not possible in group key mode.
+#define B_MIXPCM 0x1000
+
+// Mixed blocks are sent to PORT_MIX, with the block number in the
+// frame field and, truncated, in the sequence field:
+#define PORT_MIX (MAXSPECIALPORT - 3)
+
+// The mix format: a mix_header_t followed by nframes interleaved
+// frames of nchannels samples, in host byte order.
+#define MIX_FLOAT32 0
+#define MIX_INT16 1
+
+struct mix_header_t {
+  uint32_t frame;
+  uint16_t nframes;
+  uint8_t nchannels;
+  uint8_t format;
+};
+
+#define MIX_MAXCHANNELS 8
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,183 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <atomic>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+
+// size of a cache line, used to keep producer and consumer indices
+// apart:
+#define RING_CACHELINE 64
+
+inline size_t ring_capacity(size_t n)
+{
+  size_t c(2);
+  while(c < n)
+    c <<= 1;
+  return c;
+}
+
+/**
+ * Bounded wait-free queue for one producer and one consumer thread.
+ *
+ * Storage is allocated in the constructor; push() and pop() never
+ * allocate and never block. If the queue is full, push() drops the
+ * element and counts it in num_dropped. The capacity is rounded up to
+ * a power of two.
+ */
+template <class T> class spsc_ring_t {
+public:
+  spsc_ring_t(size_t capacity)
+      : mask(ring_capacity(capacity) - 1), buf(new T[mask + 1]){};
+  /// Add an element, false if the queue is full (producer thread)
+  bool push(const T& v)
+  {
+    size_t t(tail.load(std::memory_order_relaxed));
+    if(t - head.load(std::memory_order_acquire) > mask) {
+      num_dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    buf[t & mask] = v;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  };
+  /// Take the oldest element, false if the queue is empty (consumer
+  /// thread)
+  bool pop(T& v)
+  {
+    size_t h(head.load(std::memory_order_relaxed));
+    if(h == tail.load(std::memory_order_acquire))
+      return false;
+    v = buf[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  };
+  bool empty() const
+  {
+    return head.load(std::memory_order_acquire) ==
+           tail.load(std::memory_order_acquire);
+  };
+  size_t capacity() const { return mask + 1; };
+  /// Number of elements rejected because the queue was full
+  std::atomic<uint64_t> num_dropped{0};
+
+private:
+  const size_t mask;
+  std::unique_ptr<T[]> buf;
+  alignas(RING_CACHELINE) std::atomic<size_t> head{0};
+  alignas(RING_CACHELINE) std::atomic<size_t> tail{0};
+};
+
+/**
+ * Bounded lock-free queue for many producer threads and one consumer
+ * thread.
+ *
+ * Each cell carries a sequence number which tells producers and the
+ * consumer whether the cell is free or filled (D. Vyukov's bounded
+ * queue). Producers only compete for the write index, so a producer
+ * never waits for a stalled consumer; if the queue is full the
+ * element is dropped and counted in num_dropped. No allocation
+ * happens after construction. Large elements can be filled and read
+ * in place, with claim()/commit() and front()/release().
+ */
+template <class T> class mpsc_ring_t {
+public:
+  mpsc_ring_t(size_t capacity)
+      : mask(ring_capacity(capacity) - 1), cells(new cell_t[mask + 1])
+  {
+    for(size_t k = 0; k <= mask; ++k)
+      cells[k].seq.store(k, std::memory_order_relaxed);
+  };
+  /// Reserve the next cell, to be filled in place and published with
+  /// commit(); NULL if the queue is full (any thread)
+  T* claim(size_t& pos)
+  {
+    pos = tail.load(std::memory_order_relaxed);
+    cell_t* cell;
+    while(true) {
+      cell = &(cells[pos & mask]);
+      size_t seq(cell->seq.load(std::memory_order_acquire));
+      intptr_t diff((intptr_t)seq - (intptr_t)pos);
+      if(diff == 0) {
+        if(tail.compare_exchange_weak(pos, pos + 1,
+                                      std::memory_order_relaxed))
+          break;
+      } else if(diff < 0) {
+        num_dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+      } else {
+        pos = tail.load(std::memory_order_relaxed);
+      }
+    }
+    return &(cell->data);
+  };
+  /// Publish a cell reserved by claim()
+  void commit(size_t pos)
+  {
+    cells[pos & mask].seq.store(pos + 1, std::memory_order_release);
+  };
+  /// Add an element, false if the queue is full (any thread)
+  bool push(const T& v)
+  {
+    size_t pos;
+    T* data(claim(pos));
+    if(!data)
+      return false;
+    *data = v;
+    commit(pos);
+    return true;
+  };
+  /// The oldest element in place, NULL if the queue is empty; free it
+  /// with release() (consumer thread)
+  T* front()
+  {
+    cell_t* cell(&(cells[head & mask]));
+    if(cell->seq.load(std::memory_order_acquire) != head + 1)
+      return NULL;
+    return &(cell->data);
+  };
+  /// Free the element returned by front() (consumer thread)
+  void release()
+  {
+    cells[head & mask].seq.store(head + mask + 1, std::memory_order_release);
+    ++head;
+  };
+  /// Take the oldest element, false if the queue is empty (consumer
+  /// thread)
+  bool pop(T& v)
+  {
+    T* data(front());
+    if(!data)
+      return false;
+    v = *data;
+    release();
+    return true;
+  };
+  /// True if no element is ready (consumer thread)
+  bool empty() { return front() == NULL; };
+  size_t capacity() const { return mask + 1; };
+  /// Number of elements rejected because the queue was full
+  std::atomic<uint64_t> num_dropped{0};
+
+private:
+  class cell_t {
+  public:
+    std::atomic<size_t> seq;
+    T data;
+  };
+  const size_t mask;
+  std::unique_ptr<cell_t[]> cells;
+  // read index, used by the consumer only:
+  alignas(RING_CACHELINE) size_t head = 0;
+  alignas(RING_CACHELINE) std::atomic<size_t> tail{0};
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,156 @@
+#include "roster.h"
+#include <string.h>
+
+static bool same_endpoint(const endpoint_t& a, const endpoint_t& b)
+{
+  return (a.sin_family == b.sin_family) &&
+         (a.sin_addr.s_addr == b.sin_addr.s_addr) &&
+         (a.sin_port == b.sin_port);
+}
+
+bool roster_entry_t::operator==(const roster_entry_t& o) const
+{
+  if(present != o.present)
+    return false;
+  if(!present)
+    return true;
+  return (mode == o.mode) && same_endpoint(ep, o.ep) &&
+         same_endpoint(localep, o.localep) && (has_pubkey == o.has_pubkey) &&
+         ((!has_pubkey) ||
+          (memcmp(pubkey, o.pubkey, crypto_box_PUBLICKEYBYTES) == 0));
+}
+
+roster_t::roster_t() : entries(MAX_STAGE_ID)
+{
+  changed.reserve(MAX_STAGE_ID);
+}
+
+bool roster_t::update(const std::vector<ep_desc_t>& endpoints,
+                      bool groupkey_active)
+{
+  changed.clear();
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+    const ep_desc_t& ep(endpoints[cid]);
+    roster_entry_t e;
+    e.present = (ep.timeout > 0);
+    if(e.present) {
+      e.mode = ep.mode;
+      // the room key flag is only announced in group key mode:
+      if(!groupkey_active)
+        e.mode &= ~B_GROUPKEY;
+      e.ep = ep.ep;
+      e.localep = ep.localep;
+      e.has_pubkey = ep.has_pubkey;
+      if(e.has_pubkey)
+        memcpy(e.pubkey, ep.pubkey, crypto_box_PUBLICKEYBYTES);
+    }
+    if(e != entries[cid]) {
+      entries[cid] = e;
+      changed.push_back(cid);
+    }
+  }
+  if(changed.empty())
+    return false;
+  ++ver;
+  return true;
+}
+
+size_t roster_t::size() const
+{
+  size_t n(0);
+  for(const auto& e : entries)
+    if(e.present)
+      ++n;
+  return n;
+}
+
+void roster_t::pack_full(std::vector<std::string>& msgs) const
+{
+  std::vector<stage_device_id_t> ids;
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid)
+    if(entries[cid].present)
+      ids.push_back(cid);
+  pack(msgs, ROSTER_FULL, ids);
+}
+
+void roster_t::pack_delta(std::vector<std::string>& msgs) const
+{
+  pack(msgs, ROSTER_DELTA, changed);
+}
+
+void roster_t::pack_version(std::vector<std::string>& msgs) const
+{
+  pack(msgs, ROSTER_VERSION, {});
+}
+
+void roster_t::pack_legacy(std::vector<std::string>& msgs,
+                           secret_t secret) const
+{
+  msgs.clear();
+  char buffer[BUFSIZE];
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+    const roster_entry_t& e(entries[cid]);
+    if(!e.present)
+      continue;
+    size_t n(packmsg(buffer, BUFSIZE, secret, cid, PORT_LISTCID, e.mode,
+                     (const char*)(&(e.ep)), sizeof(e.ep)));
+    msgs.push_back(std::string(buffer, n));
+    n = packmsg(buffer, BUFSIZE, secret, cid, PORT_SETLOCALIP, 0,
+                (const char*)(&(e.localep)), sizeof(e.localep));
+    msgs.push_back(std::string(buffer, n));
+    if(e.has_pubkey) {
+      n = packmsg(buffer, BUFSIZE, secret, cid, PORT_PUBKEY, 0,
+                  (const char*)(e.pubkey), crypto_box_PUBLICKEYBYTES);
+      msgs.push_back(std::string(buffer, n));
+    }
+  }
+}
+
+void roster_t::pack(std::vector<std::string>& msgs, uint8_t kind,
+                    const std::vector<stage_device_id_t>& ids) const
+{
+  msgs.clear();
+  roster_header_t hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.version = ver;
+  hdr.base = (kind == ROSTER_DELTA) ? ver - 1 : ver;
+  hdr.kind = kind;
+  auto start_msg = [&]() {
+    msgs.push_back(std::string((const char*)(&hdr), sizeof(hdr)));
+  };
+  start_msg();
+  for(auto cid : ids) {
+    const roster_entry_t& e(entries[cid]);
+    uint8_t flags(0);
+    if(!e.present)
+      flags |= ROSTER_REMOVED;
+    else if(e.has_pubkey)
+      flags |= ROSTER_HASPUBKEY;
+    std::string rec;
+    rec.append((const char*)(&cid), sizeof(cid));
+    rec.append((const char*)(&flags), sizeof(flags));
+    if(e.present) {
+      rec.append((const char*)(&(e.mode)), sizeof(e.mode));
+      rec.append((const char*)(&(e.ep)), sizeof(e.ep));
+      rec.append((const char*)(&(e.localep)), sizeof(e.localep));
+      if(e.has_pubkey)
+        rec.append((const char*)(e.pubkey), crypto_box_PUBLICKEYBYTES);
+    }
+    if((msgs.back().size() + rec.size() > ROSTER_MAXPAYLOAD) ||
+       (((const roster_header_t*)(msgs.back().data()))->nentries == 255))
+      start_msg();
+    msgs.back() += rec;
+    ++(((roster_header_t*)(&(msgs.back()[0])))->nentries);
+  }
+  for(size_t k = 0; k < msgs.size(); ++k) {
+    roster_header_t* h((roster_header_t*)(&(msgs[k][0])));
+    h->part = k;
+    h->nparts = msgs.size();
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,67 @@
+#ifndef ROSTER_H
+#define ROSTER_H
+
+#include "callerlist.h"
+#include "protocol.h"
+#include <string>
+#include <vector>
+
+/**
+ * Participant information announced to the clients.
+ */
+class roster_entry_t {
+public:
+  bool present = false;
+  epmode_t mode = 0;
+  endpoint_t ep;
+  endpoint_t localep;
+  bool has_pubkey = false;
+  uint8_t pubkey[crypto_box_PUBLICKEYBYTES];
+  bool operator==(const roster_entry_t& o) const;
+  bool operator!=(const roster_entry_t& o) const { return !(*this == o); };
+};
+
+/**
+ * Versioned participant list of a room.
+ *
+ * update() compares the endpoint list with the last version and
+ * increments the version if anything changed. The roster can then be
+ * packed either as full snapshot or as delta to the previous version,
+ * see PORT_ROSTER in protocol.h.
+ */
+class roster_t {
+public:
+  roster_t();
+  /// Take over the endpoint list, true if the roster changed
+  bool update(const std::vector<ep_desc_t>& endpoints, bool groupkey_active);
+  uint32_t version() const { return ver; };
+  size_t size() const;
+  /// Pack a full snapshot into one or more message payloads
+  void pack_full(std::vector<std::string>& msgs) const;
+  /// Pack the changes of the last update()
+  void pack_delta(std::vector<std::string>& msgs) const;
+  /// Pack a version message without entries
+  void pack_version(std::vector<std::string>& msgs) const;
+  /**
+   * Pack the announcement for clients without roster support: list
+   * entry, local IP address and public key of each member, as complete
+   * datagrams. They are the same for all receivers.
+   */
+  void pack_legacy(std::vector<std::string>& msgs, secret_t secret) const;
+
+private:
+  void pack(std::vector<std::string>& msgs, uint8_t kind,
+            const std::vector<stage_device_id_t>& ids) const;
+  std::vector<roster_entry_t> entries;
+  std::vector<stage_device_id_t> changed;
+  uint32_t ver = 0;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
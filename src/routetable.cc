@@ -0,0 +1,102 @@
+#include "routetable.h"
+#include "protocol.h"
+#include <string.h>
+
+route_table_t::route_table_t()
+    : first(MAX_STAGE_ID + 1, 0), first_enc(MAX_STAGE_ID, 0),
+      alive(MAX_STAGE_ID, false), eps(MAX_STAGE_ID), senders(MAX_STAGE_ID),
+      mixsrc(MAX_STAGE_ID, false)
+{
+  dest.reserve(MAX_STAGE_ID);
+}
+
+void route_table_t::build(const std::vector<ep_desc_t>& endpoints,
+                          const shared_key_cache_t& keys)
+{
+  dest.clear();
+  // group key mode requires that all live endpoints support it:
+  size_t num_alive(0);
+  groupkey = true;
+  for(const auto& ep : endpoints)
+    if(ep.timeout > 0) {
+      ++num_alive;
+      if(!((ep.mode & B_ENCRYPTION) && (ep.mode & B_GROUPKEY)))
+        groupkey = false;
+    }
+  if(!num_alive)
+    groupkey = false;
+  for(stage_device_id_t sid = 0; sid != MAX_STAGE_ID; ++sid) {
+    first[sid] = dest.size();
+    first_enc[sid] = dest.size();
+    const ep_desc_t& src(endpoints[sid]);
+    alive[sid] = (src.timeout > 0);
+    eps[sid] = src.ep;
+    if(!alive[sid])
+      continue;
+    route_src_t& rsrc(senders[sid]);
+    rsrc.mode = src.mode;
+    rsrc.keytag = route_has_keytag(src.mode);
+    rsrc.sharedkey = (src.mode & B_SHAREDKEY) && src.has_pubkey &&
+                     keys.valid(sid, src.pubkey);
+    if(rsrc.sharedkey)
+      memcpy(rsrc.key, keys.key(sid), crypto_box_BEFORENMBYTES);
+    // first pass: plain receivers, second pass: encrypted receivers
+    for(uint32_t pass = 0; pass < 2; ++pass) {
+      if(pass == 1)
+        first_enc[sid] = dest.size();
+      for(stage_device_id_t did = 0; did != MAX_STAGE_ID; ++did) {
+        const ep_desc_t& ep(endpoints[did]);
+        if(!route_is_receiver(sid, src, did, ep))
+          continue;
+        // also in group key mode, for packets which are still
+        // encrypted for the server:
+        bool encrypt((src.mode & B_ENCRYPTION) && (ep.mode & B_ENCRYPTION) &&
+                     ep.has_pubkey);
+        if(encrypt != (pass == 1))
+          continue;
+        route_dest_t d;
+        d.ep = ep.ep;
+        d.id = did;
+        d.encrypt = encrypt;
+        d.keytag = rsrc.keytag && route_has_keytag(ep.mode);
+        d.sharedkey = encrypt && (ep.mode & B_SHAREDKEY) &&
+                      keys.valid(did, ep.pubkey);
+        if(encrypt)
+          memcpy(d.pubkey, ep.pubkey, crypto_box_PUBLICKEYBYTES);
+        if(d.sharedkey)
+          memcpy(d.key, keys.key(did), crypto_box_BEFORENMBYTES);
+        dest.push_back(d);
+      }
+    }
+  }
+  first[MAX_STAGE_ID] = dest.size();
+  // server side mix, not possible if the server cannot decrypt:
+  mixdest.clear();
+  nmixsrc = 0;
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+    const ep_desc_t& ep(endpoints[cid]);
+    bool live((ep.timeout > 0) && !groupkey && (ep.mode & B_MIXPCM));
+    mixsrc[cid] = live && !(ep.mode & B_SENDDOWNMIX);
+    if(mixsrc[cid])
+      ++nmixsrc;
+    if(live && (ep.mode & B_RECEIVEDOWNMIX) && !(ep.mode & B_DONOTSEND)) {
+      route_dest_t d;
+      d.ep = ep.ep;
+      d.id = cid;
+      d.encrypt = (ep.mode & B_ENCRYPTION) && ep.has_pubkey;
+      d.sharedkey = d.encrypt && (ep.mode & B_SHAREDKEY) &&
+                    keys.valid(cid, ep.pubkey);
+      if(d.encrypt)
+        memcpy(d.pubkey, ep.pubkey, crypto_box_PUBLICKEYBYTES);
+      if(d.sharedkey)
+        memcpy(d.key, keys.key(cid), crypto_box_BEFORENMBYTES);
+      mixdest.push_back(d);
+    }
+  }
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
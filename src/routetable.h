@@ -0,0 +1,176 @@
+#ifndef ROUTETABLE_H
+#define ROUTETABLE_H
+
+#include "boxcrypt.h"
+#include "callerlist.h"
+#include "protocol.h"
+#include <vector>
+
+/**
+ * Check if audio of the sender src is forwarded to dest.
+ *
+ * This is the routing predicate of the server: the receiver must be
+ * alive and accept data, peer-to-peer pairs exchange data directly,
+ * and downmix receivers only get data from downmix senders.
+ */
+inline bool route_is_receiver(stage_device_id_t src_id, const ep_desc_t& src,
+                              stage_device_id_t dest_id, const ep_desc_t& dest)
+{
+  return (dest_id != src_id) && (dest.timeout > 0) &&
+         (!(dest.mode & B_DONOTSEND)) &&
+         ((!(dest.mode & B_PEER2PEER)) || (!(src.mode & B_PEER2PEER))) &&
+         ((bool)(dest.mode & B_RECEIVEDOWNMIX) ==
+          (bool)(src.mode & B_SENDDOWNMIX));
+}
+
+/**
+ * Compact description of one forwarding destination.
+ */
+class route_dest_t {
+public:
+  endpoint_t ep;
+  stage_device_id_t id;
+  // re-encrypt data for this receiver:
+  bool encrypt;
+  // sender and receiver exchange audio with a key byte, see
+  // GROUPKEY_TAG_SERVER:
+  bool keytag = false;
+  // use the precomputed shared key instead of a sealed box:
+  bool sharedkey;
+  uint8_t pubkey[crypto_box_PUBLICKEYBYTES];
+  uint8_t key[crypto_box_BEFORENMBYTES];
+};
+
+/**
+ * Sender properties needed on the forwarding path.
+ */
+class route_src_t {
+public:
+  epmode_t mode = 0;
+  // audio of this sender starts with a key byte:
+  bool keytag = false;
+  // decrypt data of this sender with the precomputed shared key:
+  bool sharedkey = false;
+  uint8_t key[crypto_box_BEFORENMBYTES];
+};
+
+/**
+ * True if both endpoints exchange audio with a key byte.
+ */
+inline bool route_has_keytag(epmode_t mode)
+{
+  return (mode & B_ENCRYPTION) && (mode & B_GROUPKEY);
+}
+
+/**
+ * Encrypt a message for the receiver d, with a key byte if the
+ * receiver expects one.
+ *
+ * @return Length of the encrypted message, or zero on error.
+ */
+inline size_t route_encrypt(char* dest, size_t maxlen, const char* msg,
+                            size_t len, const route_dest_t& d)
+{
+  size_t n(0);
+  if(d.sharedkey)
+    n = encryptmsg_afternm(dest, maxlen, msg, len, d.key);
+  else
+    n = encryptmsg(dest, maxlen, msg, len, d.pubkey);
+  if(n && d.keytag)
+    n = groupkey_add_tag(dest, n, maxlen, GROUPKEY_TAG_SERVER);
+  return n;
+}
+
+/**
+ * Length of a message of len bytes after route_encrypt().
+ */
+inline size_t route_encrypted_len(size_t len, const route_dest_t& d)
+{
+  if(d.keytag)
+    len += GROUPKEY_TAGBYTES;
+  if(d.sharedkey)
+    return len + crypto_box_NONCEBYTES + crypto_box_MACBYTES;
+  return len + crypto_box_SEALBYTES;
+}
+
+/**
+ * Precomputed list of receivers for each live sender.
+ *
+ * The destinations of all senders are stored in one contiguous array,
+ * so forwarding a packet only touches the entries of live receivers.
+ * Within the range of a sender, receivers which need encryption are
+ * stored after all others. Packets encrypted with the room key are
+ * forwarded unchanged to the receivers with a key byte (keytag), the
+ * table is the same for both kinds of packets. The table has to be
+ * rebuilt whenever registration, modes, public keys or liveness of
+ * endpoints change. A table is not modified after build(), so it can
+ * be shared among threads as an immutable snapshot. Without group key
+ * mode the table also lists the senders and receivers of the server
+ * side mix.
+ */
+class route_table_t {
+public:
+  route_table_t();
+  void build(const std::vector<ep_desc_t>& endpoints,
+             const shared_key_cache_t& keys);
+  /// True if all endpoints use the room key, see B_GROUPKEY
+  bool groupkey_active() const { return groupkey; };
+  /// True if the sender was alive when the table was built
+  bool has_sender(stage_device_id_t sid) const { return alive[sid]; };
+  /// Address of an endpoint when the table was built
+  const endpoint_t& endpoint(stage_device_id_t sid) const
+  {
+    return eps[sid];
+  };
+  const route_src_t& sender(stage_device_id_t sid) const
+  {
+    return senders[sid];
+  };
+  const route_dest_t* dest_begin(stage_device_id_t sid) const
+  {
+    return dest.data() + first[sid];
+  };
+  /// First receiver which needs encryption
+  const route_dest_t* dest_encrypted(stage_device_id_t sid) const
+  {
+    return dest.data() + first_enc[sid];
+  };
+  const route_dest_t* dest_end(stage_device_id_t sid) const
+  {
+    return dest.data() + first[sid + 1];
+  };
+  size_t num_dest(stage_device_id_t sid) const
+  {
+    return first[sid + 1] - first[sid];
+  };
+  size_t num_encrypted(stage_device_id_t sid) const
+  {
+    return first[sid + 1] - first_enc[sid];
+  };
+  /// True if the data of the sender is mixed by the server, see B_MIXPCM
+  bool is_mix_sender(stage_device_id_t sid) const { return mixsrc[sid]; };
+  size_t num_mix_senders() const { return nmixsrc; };
+  /// Receivers of the server side mix
+  const std::vector<route_dest_t>& mix_dest() const { return mixdest; };
+
+private:
+  std::vector<route_dest_t> dest;
+  std::vector<uint32_t> first;
+  std::vector<uint32_t> first_enc;
+  std::vector<bool> alive;
+  std::vector<endpoint_t> eps;
+  std::vector<route_src_t> senders;
+  bool groupkey = false;
+  std::vector<bool> mixsrc;
+  size_t nmixsrc = 0;
+  std::vector<route_dest_t> mixdest;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,256 @@
+#include "scheduler.h"
+#include "common.h"
+#include "errmsg.h"
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
+
+task_scheduler_t::task_scheduler_t(int prio_)
+    : prio(prio_), epoch(clock_t::now())
+{
+#ifdef LINUX
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if(timerfd < 0)
+    throw ErrMsg("Unable to create timer.", errno);
+  wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if(wakefd < 0) {
+    ::close(timerfd);
+    throw ErrMsg("Unable to create event file descriptor.", errno);
+  }
+  // receive quit signals only if they are not delivered to a handler:
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigset_t blocked;
+  if((pthread_sigmask(SIG_BLOCK, NULL, &blocked) == 0) &&
+     sigismember(&blocked, SIGINT) && sigismember(&blocked, SIGTERM))
+    sigfd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+#endif
+}
+
+task_scheduler_t::~task_scheduler_t()
+{
+  stop();
+  if(thread.joinable())
+    thread.join();
+  for(auto fd : {timerfd, sigfd, wakefd})
+    if(fd >= 0)
+      ::close(fd);
+}
+
+bool task_scheduler_t::block_signals()
+{
+#ifdef LINUX
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  return pthread_sigmask(SIG_BLOCK, &mask, NULL) == 0;
+#else
+  return false;
+#endif
+}
+
+size_t task_scheduler_t::add(double period_ms, task_fn_t fn)
+{
+  size_t id(0);
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    tasks.emplace_back();
+    task_t& t(tasks.back());
+    t.fn = fn;
+    t.period = std::chrono::duration_cast<clock_t::duration>(
+        std::chrono::duration<double, std::milli>(std::max(0.0, period_ms)));
+    set_deadline(t, clock_t::now());
+    id = tasks.size() - 1;
+  }
+  wake();
+  return id;
+}
+
+void task_scheduler_t::set_period(size_t id, double period_ms)
+{
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    if(id >= tasks.size())
+      return;
+    task_t& t(tasks[id]);
+    t.period = std::chrono::duration_cast<clock_t::duration>(
+        std::chrono::duration<double, std::milli>(std::max(0.0, period_ms)));
+    set_deadline(t, clock_t::now());
+  }
+  wake();
+}
+
+void task_scheduler_t::on_quit(std::function<void()> fn)
+{
+  std::lock_guard<std::mutex> lk(mtx);
+  quit_fn = fn;
+}
+
+// next multiple of the period after now, counted from the common
+// epoch, so tasks with the same period are due at the same time:
+void task_scheduler_t::set_deadline(task_t& t, clock_t::time_point now)
+{
+  if(t.period.count() <= 0)
+    return;
+  t.deadline = epoch + ((now - epoch) / t.period + 1) * t.period;
+}
+
+void task_scheduler_t::run()
+{
+  running = true;
+  service();
+}
+
+void task_scheduler_t::start()
+{
+  stop();
+  if(thread.joinable())
+    thread.join();
+  running = true;
+  thread = std::thread(&task_scheduler_t::service, this);
+}
+
+void task_scheduler_t::stop()
+{
+  running = false;
+  wake();
+}
+
+void task_scheduler_t::wake()
+{
+#ifdef LINUX
+  uint64_t v(1);
+  if(::write(wakefd, &v, sizeof(v)) < 0) {
+    // the counter is already set, the scheduler wakes up anyway
+  }
+#else
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    changed = true;
+  }
+  cv.notify_all();
+#endif
+}
+
+void task_scheduler_t::service()
+{
+  set_thread_prio(prio);
+  std::vector<std::pair<task_t*, double>> due;
+  while(running) {
+    clock_t::time_point next(clock_t::time_point::max());
+    {
+      std::lock_guard<std::mutex> lk(mtx);
+      for(const auto& t : tasks)
+        if(t.period.count() > 0)
+          next = std::min(next, t.deadline);
+    }
+    wait_until(next);
+    if(!running)
+      break;
+    ++num_wakeups;
+    clock_t::time_point now(clock_t::now());
+    due.clear();
+    {
+      std::lock_guard<std::mutex> lk(mtx);
+      for(auto& t : tasks)
+        if((t.period.count() > 0) && (t.deadline <= now)) {
+          due.emplace_back(
+              &t, std::chrono::duration<double, std::milli>(now - t.deadline)
+                      .count());
+          // skip missed periods of overloaded hosts:
+          set_deadline(t, now);
+        }
+    }
+    // tasks are not removed, and their functions are not modified, so
+    // they can run without the lock:
+    for(auto& d : due) {
+      d.first->fn(d.second);
+      if(!running)
+        break;
+    }
+  }
+}
+
+void task_scheduler_t::wait_until(clock_t::time_point t)
+{
+#ifdef LINUX
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  if(t != clock_t::time_point::max()) {
+    int64_t ns(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   t.time_since_epoch())
+                   .count());
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    // a zero time disarms the timer:
+    if(!its.it_value.tv_sec && !its.it_value.tv_nsec)
+      its.it_value.tv_nsec = 1;
+  }
+  // steady_clock is CLOCK_MONOTONIC:
+  timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+  struct pollfd pfd[3];
+  pfd[0].fd = timerfd;
+  pfd[1].fd = wakefd;
+  pfd[2].fd = sigfd;
+  for(auto& p : pfd) {
+    p.events = POLLIN;
+    p.revents = 0;
+  }
+  if(poll(pfd, (sigfd >= 0) ? 3 : 2, -1) <= 0)
+    return;
+  uint64_t v(0);
+  if(pfd[0].revents & POLLIN)
+    if(::read(timerfd, &v, sizeof(v)) < 0) {
+      // spurious wakeup, deadlines are checked by the caller
+    }
+  if(pfd[1].revents & POLLIN)
+    if(::read(wakefd, &v, sizeof(v)) < 0) {
+      // already reset
+    }
+  if(pfd[2].revents & POLLIN)
+    handle_signal();
+#else
+  std::unique_lock<std::mutex> lk(mtx);
+  if(t == clock_t::time_point::max())
+    cv.wait(lk, [this]() { return changed; });
+  else
+    cv.wait_until(lk, t, [this]() { return changed; });
+  changed = false;
+#endif
+}
+
+void task_scheduler_t::handle_signal()
+{
+#ifdef LINUX
+  struct signalfd_siginfo si;
+  if(::read(sigfd, &si, sizeof(si)) != sizeof(si))
+    return;
+  std::function<void()> fn;
+  {
+    std::lock_guard<std::mutex> lk(mtx);
+    fn = quit_fn;
+  }
+  if(fn)
+    fn();
+  else
+    stop();
+#endif
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,96 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Run periodic tasks of all rooms in one thread.
+ *
+ * On Linux the thread sleeps in poll() on a timerfd, which is armed
+ * for the earliest deadline of all tasks, and on a signalfd for
+ * SIGINT and SIGTERM. Deadlines are multiples of the task period, so
+ * tasks with the same period run in one wakeup, and an idle server
+ * only wakes up when a task is due. Other systems wait on a condition
+ * variable.
+ *
+ * Each task gets its lateness, the time between its deadline and the
+ * wakeup of the scheduler, which is a measure of the scheduling
+ * jitter of the host.
+ */
+class task_scheduler_t {
+public:
+  /// Task function, called with the lateness in milliseconds
+  typedef std::function<void(double)> task_fn_t;
+  task_scheduler_t(int prio);
+  ~task_scheduler_t();
+  /**
+   * Block SIGINT and SIGTERM in the calling thread, and in all threads
+   * created by it afterwards, so they are received by the signalfd.
+   * Call early in main(), before any thread is created.
+   *
+   * @return True if signals are delivered to the scheduler.
+   */
+  static bool block_signals();
+  /// Add a task with a period in milliseconds, return its ID
+  size_t add(double period_ms, task_fn_t fn);
+  /// Change the period of a task, zero pauses the task
+  void set_period(size_t id, double period_ms);
+  /// Function called on SIGINT or SIGTERM, default is stop()
+  void on_quit(std::function<void()> fn);
+  /// Run the tasks in the calling thread until stop() is called
+  void run();
+  /// Run the tasks in a new thread
+  void start();
+  /// Stop the scheduler, can be called from any thread and from tasks
+  void stop();
+  /// True if quit signals are handled by the scheduler
+  bool handles_signals() const { return sigfd >= 0; };
+  std::atomic<uint64_t> num_wakeups{0};
+
+private:
+  typedef std::chrono::steady_clock clock_t;
+  class task_t {
+  public:
+    clock_t::duration period;
+    clock_t::time_point deadline;
+    task_fn_t fn;
+  };
+  void service();
+  void wait_until(clock_t::time_point t);
+  void wake();
+  void handle_signal();
+  void set_deadline(task_t& t, clock_t::time_point now);
+  int prio;
+  // a deque keeps the tasks in place when new tasks are added while
+  // others are running:
+  std::deque<task_t> tasks;
+  std::function<void()> quit_fn;
+  std::atomic<bool> running{false};
+  std::thread thread;
+  // guards the task periods and deadlines:
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool changed = false;
+  // common origin of the deadlines of all tasks:
+  clock_t::time_point epoch;
+  int timerfd = -1;
+  int sigfd = -1;
+  // eventfd to wake up the scheduler after stop() or a task change:
+  int wakefd = -1;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
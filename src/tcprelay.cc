@@ -0,0 +1,426 @@
+#include "tcprelay.h"
+#include "errmsg.h"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef LINUX
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+
+// maximum number of events handled per epoll_wait call:
+#define RELAYMAXEVENTS 64
+
+// epoll timeout, to check for termination, in ms:
+#define RELAYTIMEOUTMS 100
+
+// frames written with one writev() call:
+#define RELAYMAXIOV 64
+
+// datagrams read from the UDP side of a connection per event:
+#define RELAYMAXREAD 64
+
+// frames in the receive buffer of a registered connection; until
+// registration it holds one frame:
+#define RELAYRXFRAMES 16
+
+// epoll tag of the listening socket; connection k has the tags 2k
+// (TCP) and 2k+1 (UDP):
+#define LISTENTAG UINT64_MAX
+
+#ifdef LINUX
+
+static int64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+tcp_relay_t::tcp_relay_t(int tcpport, int udpport_, int prio_, int listenfd_)
+    : udpport(udpport_), prio(prio_), listenfd(listenfd_),
+      conns(TCPRELAYMAXCONN)
+{
+  endpoint_t ep;
+  memset(&ep, 0, sizeof(ep));
+  socklen_t len(sizeof(ep));
+  if(listenfd >= 0) {
+    // the socket is already bound and listening:
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    if(getsockname(listenfd, (struct sockaddr*)(&ep), &len) < 0) {
+      int err(errno);
+      ::close(listenfd);
+      throw ErrMsg("Invalid TCP relay socket.", err);
+    }
+  } else {
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(listenfd < 0)
+      throw ErrMsg("Unable to create TCP relay socket.", errno);
+    int on(1);
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    ep.sin_family = AF_INET;
+    ep.sin_addr.s_addr = htonl(INADDR_ANY);
+    ep.sin_port = htons(tcpport);
+    if((bind(listenfd, (struct sockaddr*)(&ep), sizeof(ep)) < 0) ||
+       (listen(listenfd, 16) < 0) ||
+       (getsockname(listenfd, (struct sockaddr*)(&ep), &len) < 0)) {
+      int err(errno);
+      ::close(listenfd);
+      throw ErrMsg("Unable to bind TCP relay to port " +
+                       std::to_string(tcpport) + ".",
+                   err);
+    }
+  }
+  port = ntohs(ep.sin_port);
+  epfd = epoll_create1(0);
+  if(epfd < 0) {
+    int err(errno);
+    ::close(listenfd);
+    throw ErrMsg("Unable to create epoll instance.", err);
+  }
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.u64 = LISTENTAG;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev);
+}
+
+tcp_relay_t::~tcp_relay_t()
+{
+  stop();
+  for(size_t k = 0; k < conns.size(); ++k)
+    close_conn(k);
+  ::close(epfd);
+  ::close(listenfd);
+}
+
+void tcp_relay_t::start()
+{
+  stop();
+  run = true;
+  thread = std::thread(&tcp_relay_t::service, this);
+}
+
+void tcp_relay_t::stop()
+{
+  run = false;
+  if(thread.joinable())
+    thread.join();
+}
+
+void tcp_relay_t::service()
+{
+  set_thread_prio(prio);
+  struct epoll_event events[RELAYMAXEVENTS];
+  while(run) {
+    int n(epoll_wait(epfd, events, RELAYMAXEVENTS, RELAYTIMEOUTMS));
+    for(int e = 0; e < n; ++e) {
+      uint64_t tag(events[e].data.u64);
+      if(tag == LISTENTAG) {
+        accept_all();
+        continue;
+      }
+      size_t k(tag >> 1);
+      // the connection may have been closed by an earlier event:
+      if(!conns[k])
+        continue;
+      if(tag & 1) {
+        read_udp(k);
+        continue;
+      }
+      if(events[e].events & (EPOLLHUP | EPOLLERR)) {
+        close_conn(k);
+        continue;
+      }
+      if(events[e].events & EPOLLIN)
+        read_tcp(k);
+      if(conns[k] && (events[e].events & EPOLLOUT) && !flush(k))
+        close_conn(k);
+    }
+    close_unregistered(now_ns());
+  }
+}
+
+void tcp_relay_t::close_unregistered(int64_t now)
+{
+  // checked at the rate of the epoll timeout:
+  if(now - t_regcheck < RELAYTIMEOUTMS * 1000000ll)
+    return;
+  t_regcheck = now;
+  int64_t limit(now - TCPRELAYREGTIMEOUTMS * 1000000ll);
+  for(size_t k = 0; k < conns.size(); ++k)
+    if(conns[k] && !conns[k]->registered && (conns[k]->t_accept < limit)) {
+      log(port, "TCP relay connection from " + ep2str(conns[k]->peer) +
+                    " did not register, closing");
+      close_conn(k);
+    }
+}
+
+void tcp_relay_t::accept_all()
+{
+  while(true) {
+    endpoint_t peer;
+    socklen_t len(sizeof(peer));
+    int fd(accept4(listenfd, (struct sockaddr*)(&peer), &len, SOCK_NONBLOCK));
+    if(fd < 0)
+      return;
+    size_t k(conns.size());
+    size_t sameaddr(0);
+    for(size_t j = 0; j < conns.size(); ++j) {
+      if(!conns[j])
+        k = std::min(k, j);
+      else if(conns[j]->peer.sin_addr.s_addr == peer.sin_addr.s_addr)
+        ++sameaddr;
+    }
+    if(k == conns.size()) {
+      log(port, "TCP relay is full, rejecting " + ep2str(peer));
+      ::close(fd);
+      continue;
+    }
+    if(sameaddr >= TCPRELAYMAXPERADDR) {
+      log(port, "Too many TCP relay connections, rejecting " + ep2str(peer));
+      ::close(fd);
+      continue;
+    }
+    // audio frames are small and latency matters:
+    int on(1);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    int udpfd(socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0));
+    endpoint_t srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.sin_family = AF_INET;
+    srv.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    srv.sin_port = htons(udpport);
+    if((udpfd < 0) ||
+       (connect(udpfd, (struct sockaddr*)(&srv), sizeof(srv)) < 0)) {
+      if(udpfd >= 0)
+        ::close(udpfd);
+      ::close(fd);
+      continue;
+    }
+    conn_t* c(new conn_t());
+    c->tcpfd = fd;
+    c->udpfd = udpfd;
+    c->peer = peer;
+    c->t_accept = now_ns();
+    c->rxbuf.resize(TCPFRAMEHEADERLEN + BUFSIZE);
+    conns[k].reset(c);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u64 = 2 * k;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    ev.data.u64 = 2 * k + 1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, udpfd, &ev);
+    ++num_connections;
+    log(port, "TCP relay connection from " + ep2str(peer));
+  }
+}
+
+void tcp_relay_t::close_conn(size_t k)
+{
+  if(!conns[k])
+    return;
+  // closing removes the sockets from the epoll set:
+  ::close(conns[k]->tcpfd);
+  ::close(conns[k]->udpfd);
+  conns[k].reset();
+  --num_connections;
+}
+
+void tcp_relay_t::read_tcp(size_t k)
+{
+  conn_t& c(*conns[k]);
+  while(true) {
+    ssize_t r(::recv(c.tcpfd, &(c.rxbuf[c.rxlen]), c.rxbuf.size() - c.rxlen,
+                     0));
+    if(r == 0) {
+      close_conn(k);
+      return;
+    }
+    if(r < 0) {
+      if((errno != EAGAIN) && (errno != EINTR))
+        close_conn(k);
+      return;
+    }
+    c.rxlen += r;
+    // forward all complete frames to the server:
+    size_t pos(0);
+    while(c.rxlen - pos >= TCPFRAMEHEADERLEN) {
+      size_t len(tcp_frame_len(&(c.rxbuf[pos])));
+      if((len == 0) || (len > BUFSIZE)) {
+        // framing is lost, the stream can not be resynchronized:
+        close_conn(k);
+        return;
+      }
+      if(c.rxlen - pos < TCPFRAMEHEADERLEN + len)
+        break;
+      char* msg(&(c.rxbuf[pos + TCPFRAMEHEADERLEN]));
+      port_t destport(0);
+      if(len >= HEADERLEN)
+        memcpy(&destport,
+               &(msg[sizeof(secret_t) + sizeof(stage_device_id_t)]),
+               sizeof(port_t));
+      if(destport == PORT_REGISTER) {
+        // the sequence field of registration messages carries the
+        // mode:
+        sequence_t mode;
+        size_t seqpos(HEADERLEN - sizeof(sequence_t));
+        memcpy(&mode, &(msg[seqpos]), sizeof(mode));
+        mode &= ~B_PEER2PEER;
+        memcpy(&(msg[seqpos]), &mode, sizeof(mode));
+        c.sent_register = true;
+      }
+      // a full socket buffer drops the datagram, as UDP would:
+      ::send(c.udpfd, msg, len, 0);
+      ++num_frames_in;
+      pos += TCPFRAMEHEADERLEN + len;
+    }
+    if(pos) {
+      memmove(c.rxbuf.data(), &(c.rxbuf[pos]), c.rxlen - pos);
+      c.rxlen -= pos;
+    }
+  }
+}
+
+void tcp_relay_t::read_udp(size_t k)
+{
+  conn_t& c(*conns[k]);
+  char buf[BUFSIZE];
+  int64_t now(now_ns());
+  for(size_t n = 0; n < RELAYMAXREAD; ++n) {
+    ssize_t r(::recv(c.udpfd, buf, BUFSIZE, 0));
+    if(r <= 0)
+      break;
+    if(!c.registered && c.sent_register) {
+      // the server accepted the registration:
+      c.registered = true;
+      c.rxbuf.resize(RELAYRXFRAMES * (TCPFRAMEHEADERLEN + BUFSIZE));
+    }
+    enqueue(c, buf, r, now);
+  }
+  if(!flush(k))
+    close_conn(k);
+}
+
+void tcp_relay_t::enqueue(conn_t& c, const char* buf, size_t len, int64_t now)
+{
+  if(c.freeframes.empty() && (c.pool.size() < TCPRELAYQUEUELEN)) {
+    c.pool.emplace_back(new frame_t());
+    c.freeframes.push_back(c.pool.back().get());
+  }
+  if(c.freeframes.empty()) {
+    // drop the oldest audio frame which is not partially written:
+    auto it(c.txq.begin());
+    if((it != c.txq.end()) && c.txoff)
+      ++it;
+    while((it != c.txq.end()) && !(*it)->audio)
+      ++it;
+    if(it == c.txq.end()) {
+      ++num_dropped;
+      return;
+    }
+    c.freeframes.push_back(*it);
+    c.txq.erase(it);
+    ++num_dropped;
+  }
+  frame_t* f(c.freeframes.back());
+  c.freeframes.pop_back();
+  port_t destport(0);
+  if(len >= HEADERLEN)
+    memcpy(&destport, &(buf[sizeof(secret_t) + sizeof(stage_device_id_t)]),
+           sizeof(port_t));
+  f->t_ns = now;
+  f->audio = destport > MAXSPECIALPORT;
+  f->len = TCPFRAMEHEADERLEN + len;
+  tcp_frame_header(f->data, len);
+  memcpy(&(f->data[TCPFRAMEHEADERLEN]), buf, len);
+  c.txq.push_back(f);
+}
+
+bool tcp_relay_t::flush(size_t k)
+{
+  conn_t& c(*conns[k]);
+  // stale audio would only add latency to all following frames:
+  int64_t limit(now_ns() - TCPRELAYMAXAGEMS * 1000000ll);
+  for(auto it = c.txq.begin(); it != c.txq.end();) {
+    if((*it)->audio && ((*it)->t_ns < limit) &&
+       !((it == c.txq.begin()) && c.txoff)) {
+      c.freeframes.push_back(*it);
+      it = c.txq.erase(it);
+      ++num_dropped;
+    } else
+      ++it;
+  }
+  while(!c.txq.empty()) {
+    struct iovec iov[RELAYMAXIOV];
+    size_t niov(std::min(c.txq.size(), (size_t)RELAYMAXIOV));
+    for(size_t f = 0; f < niov; ++f) {
+      iov[f].iov_base = c.txq[f]->data;
+      iov[f].iov_len = c.txq[f]->len;
+    }
+    iov[0].iov_base = c.txq[0]->data + c.txoff;
+    iov[0].iov_len -= c.txoff;
+    ssize_t r(writev(c.tcpfd, iov, niov));
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno != EAGAIN)
+        return false;
+      break;
+    }
+    // release all completely written frames:
+    size_t w(r + c.txoff);
+    while(!c.txq.empty() && (w >= c.txq.front()->len)) {
+      w -= c.txq.front()->len;
+      c.freeframes.push_back(c.txq.front());
+      c.txq.pop_front();
+      ++num_frames_out;
+    }
+    c.txoff = w;
+    if(c.txoff)
+      break;
+  }
+  // wait for the socket to become writable only while data is queued:
+  set_want_write(k, !c.txq.empty());
+  return true;
+}
+
+void tcp_relay_t::set_want_write(size_t k, bool w)
+{
+  conn_t& c(*conns[k]);
+  if(c.want_write == w)
+    return;
+  struct epoll_event ev;
+  ev.events = EPOLLIN | (w ? EPOLLOUT : 0);
+  ev.data.u64 = 2 * k;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c.tcpfd, &ev);
+  c.want_write = w;
+}
+
+#else
+
+tcp_relay_t::tcp_relay_t(int, int, int, int)
+{
+  throw ErrMsg("The TCP relay is not supported on this system.");
+}
+
+tcp_relay_t::~tcp_relay_t() {}
+
+void tcp_relay_t::start() {}
+
+void tcp_relay_t::stop() {}
+
+#endif
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
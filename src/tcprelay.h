@@ -0,0 +1,146 @@
+#ifndef TCPRELAY_H
+#define TCPRELAY_H
+
+#include "common.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// length of the frame header, the datagram length in network byte
+// order:
+#define TCPFRAMEHEADERLEN 2
+
+// maximum number of relayed connections:
+#define TCPRELAYMAXCONN 256
+
+// maximum number of relayed connections from one address:
+#define TCPRELAYMAXPERADDR 8
+
+// connections which are not registered after this time are closed,
+// in ms:
+#define TCPRELAYREGTIMEOUTMS 5000
+
+// maximum number of queued frames per connection:
+#define TCPRELAYQUEUELEN 64
+
+// queued audio older than this is dropped, in ms:
+#define TCPRELAYMAXAGEMS 60
+
+/// Write the frame header of a datagram of len bytes
+inline void tcp_frame_header(char* hdr, size_t len)
+{
+  hdr[0] = (char)((len >> 8) & 0xff);
+  hdr[1] = (char)(len & 0xff);
+}
+
+/// Datagram length from a frame header
+inline size_t tcp_frame_len(const char* hdr)
+{
+  return ((size_t)(uint8_t)hdr[0] << 8) | (size_t)(uint8_t)hdr[1];
+}
+
+/**
+ * Relay for clients which can not use UDP.
+ *
+ * Clients connect with TCP and send each datagram as a frame of a two
+ * byte length in network byte order followed by the datagram. For
+ * each connection the relay opens a UDP socket connected to the
+ * server port on the loopback interface, so relayed clients pass the
+ * same registration and routing as all others. Datagrams sent by the
+ * server to that socket are framed and written back to the client.
+ *
+ * TCP clients can not receive peer-to-peer data, so their
+ * registration is forwarded with B_PEER2PEER cleared. Each connection
+ * has a bounded send queue; when it is full or the client is too
+ * slow, the oldest audio frames are dropped instead of delaying all
+ * following frames. Control messages are kept as long as possible.
+ *
+ * A connection counts as registered once it forwarded a PORT_REGISTER
+ * message and the server sent a datagram back, which it does only to
+ * clients with the right secret. Connections which are not registered
+ * within TCPRELAYREGTIMEOUTMS are closed, and each address may hold at
+ * most TCPRELAYMAXPERADDR connections. Frame buffers are allocated on
+ * demand, and the full receive buffer only after registration.
+ *
+ * One thread serves all connections with epoll and non-blocking
+ * sockets. Linux only; the constructor throws on other systems.
+ */
+class tcp_relay_t {
+public:
+  /**
+   * @param tcpport TCP port to listen on, or zero for any
+   * @param udpport UDP port of the server
+   * @param prio Thread priority
+   * @param listenfd Listening socket to use instead of tcpport, e.g.
+   * of a previous process, or -1
+   */
+  tcp_relay_t(int tcpport, int udpport, int prio, int listenfd = -1);
+  ~tcp_relay_t();
+  void start();
+  void stop();
+  int get_port() const { return port; };
+  int get_listenfd() const { return listenfd; };
+  // statistics, can be read from any thread:
+  std::atomic<uint64_t> num_connections{0};
+  std::atomic<uint64_t> num_frames_in{0};
+  std::atomic<uint64_t> num_frames_out{0};
+  std::atomic<uint64_t> num_dropped{0};
+
+private:
+  class frame_t {
+  public:
+    int64_t t_ns;
+    bool audio;
+    size_t len;
+    char data[TCPFRAMEHEADERLEN + BUFSIZE];
+  };
+  class conn_t {
+  public:
+    int tcpfd = -1;
+    int udpfd = -1;
+    endpoint_t peer;
+    int64_t t_accept = 0;
+    bool sent_register = false;
+    bool registered = false;
+    // partially received frames:
+    std::vector<char> rxbuf;
+    size_t rxlen = 0;
+    // send queue, with bytes of the first frame already written:
+    std::deque<frame_t*> txq;
+    size_t txoff = 0;
+    bool want_write = false;
+    // frames are allocated on demand, up to TCPRELAYQUEUELEN:
+    std::vector<std::unique_ptr<frame_t>> pool;
+    std::vector<frame_t*> freeframes;
+  };
+  void service();
+  void accept_all();
+  void close_unregistered(int64_t now);
+  void close_conn(size_t k);
+  void read_tcp(size_t k);
+  void read_udp(size_t k);
+  void enqueue(conn_t& c, const char* buf, size_t len, int64_t now);
+  bool flush(size_t k);
+  void set_want_write(size_t k, bool w);
+  int udpport;
+  int prio;
+  int port = 0;
+  int listenfd = -1;
+  int epfd = -1;
+  std::atomic<bool> run{false};
+  std::thread thread;
+  std::vector<std::unique_ptr<conn_t>> conns;
+  int64_t t_regcheck = 0;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,306 @@
+#include "trunk.h"
+#include "errmsg.h"
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+trunk_t::trunk_t()
+    : owners(MAX_STAGE_ID), age(MAX_STAGE_ID, 0), announced(MAX_STAGE_ID)
+{
+  for(auto& o : owners)
+    o = -1;
+  // a restarted node continues above the counters of its predecessor:
+  uint64_t t0(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count());
+  for(auto& c : txcounter)
+    c = t0;
+}
+
+void trunk_t::set_node_key(const std::string& path)
+{
+  char hex[2 * crypto_box_SECRETKEYBYTES + 1];
+  int fd(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if(fd >= 0) {
+    ssize_t n(::read(fd, hex, sizeof(hex) - 1));
+    ::close(fd);
+    if(n < 0)
+      throw ErrMsg("Unable to read trunk key file " + path + ".", errno);
+    hex[n] = 0;
+    size_t len(0);
+    if((sodium_hex2bin(node_secret, sizeof(node_secret), hex, n, " \n", &len,
+                       NULL) != 0) ||
+       (len != sizeof(node_secret)))
+      throw ErrMsg("Invalid trunk key file " + path + ".");
+    crypto_scalarmult_base(node_public, node_secret);
+  } else {
+    if(errno != ENOENT)
+      throw ErrMsg("Unable to open trunk key file " + path + ".", errno);
+    // the secret key is readable by the owner only:
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(fd < 0)
+      throw ErrMsg("Unable to create trunk key file " + path + ".", errno);
+    crypto_box_keypair(node_public, node_secret);
+    sodium_bin2hex(hex, sizeof(hex), node_secret, sizeof(node_secret));
+    std::string s(std::string(hex) + "\n");
+    bool ok(::write(fd, s.data(), s.size()) == (ssize_t)s.size());
+    ::close(fd);
+    if(!ok)
+      throw ErrMsg("Unable to write trunk key file " + path + ".", errno);
+  }
+  has_node_key = true;
+}
+
+std::string trunk_t::public_key() const
+{
+  char hex[2 * crypto_box_PUBLICKEYBYTES + 1];
+  sodium_bin2hex(hex, sizeof(hex), node_public, sizeof(node_public));
+  return hex;
+}
+
+void trunk_t::add_peer(const endpoint_t& ep, const std::string& pubkey)
+{
+  if(peer_eps.size() >= TRUNKMAXPEERS)
+    throw ErrMsg("too many trunk peers (max " +
+                 std::to_string(TRUNKMAXPEERS) + ")");
+  if(!has_node_key)
+    throw ErrMsg("trunk peers need a key of this node (--trunkkey)");
+  uint8_t pk[crypto_box_PUBLICKEYBYTES];
+  size_t len(0);
+  if((sodium_hex2bin(pk, sizeof(pk), pubkey.c_str(), pubkey.size(), NULL,
+                     &len, NULL) != 0) ||
+     (len != sizeof(pk)))
+    throw ErrMsg("Invalid public key \"" + pubkey + "\" of trunk peer.");
+  std::array<uint8_t, crypto_box_BEFORENMBYTES> key;
+  if(crypto_box_beforenm(key.data(), pk, node_secret) != 0)
+    throw ErrMsg("Invalid public key \"" + pubkey + "\" of trunk peer.");
+  peer_eps.push_back(ep);
+  peer_keys.push_back(key);
+}
+
+size_t trunk_t::seal(size_t peer, char* dest, size_t maxlen, const char* src,
+                     size_t len) const
+{
+  if((peer >= peer_keys.size()) || (len < HEADERLEN) ||
+     (len + TRUNKSEALBYTES > maxlen))
+    return 0;
+  memcpy(dest, src, HEADERLEN);
+  uint8_t* nonce((uint8_t*)(&(dest[HEADERLEN])));
+  randombytes_buf(nonce, crypto_box_NONCEBYTES);
+  // the counter and the header are sealed as well, so they can not be
+  // altered; the plain text is assembled behind the MAC, where the
+  // cipher text is written in place:
+  uint8_t* text(nonce + crypto_box_NONCEBYTES + crypto_box_MACBYTES);
+  uint64_t counter(txcounter[peer].fetch_add(1, std::memory_order_relaxed));
+  memcpy(text, &counter, sizeof(counter));
+  memcpy(text + sizeof(counter), src, len);
+  if(crypto_box_easy_afternm(nonce + crypto_box_NONCEBYTES, text,
+                             sizeof(counter) + len, nonce,
+                             peer_keys[peer].data()) != 0)
+    return 0;
+  return len + TRUNKSEALBYTES;
+}
+
+size_t trunk_t::open(size_t peer, char* dest, const char* src,
+                     size_t len) const
+{
+  if((peer >= peer_keys.size()) || (len < HEADERLEN + TRUNKSEALBYTES))
+    return 0;
+  const uint8_t* nonce((const uint8_t*)(&(src[HEADERLEN])));
+  if(crypto_box_open_easy_afternm(
+         (uint8_t*)dest, nonce + crypto_box_NONCEBYTES,
+         len - HEADERLEN - crypto_box_NONCEBYTES, nonce,
+         peer_keys[peer].data()) != 0)
+    return 0;
+  uint64_t counter;
+  memcpy(&counter, dest, sizeof(counter));
+  size_t n(len - TRUNKSEALBYTES);
+  memmove(dest, dest + sizeof(counter), n);
+  if(memcmp(dest, src, HEADERLEN) != 0)
+    return 0;
+  if(!check_replay(peer, counter))
+    return 0;
+  return n;
+}
+
+// accept each counter of an authenticated packet once; true if the
+// packet is new:
+bool trunk_t::check_replay(size_t peer, uint64_t counter) const
+{
+  replay_window_t& w(rxwindow[peer]);
+  std::lock_guard<std::mutex> lk(w.mtx);
+  if(counter > w.newest) {
+    uint64_t shift(counter - w.newest);
+    w.seen = (shift < 64) ? (w.seen << shift) : 0;
+    w.seen |= 1;
+    w.newest = counter;
+    return true;
+  }
+  uint64_t age(w.newest - counter);
+  if(age >= TRUNKREPLAYWINDOW)
+    return false;
+  if(w.seen & (1ull << age))
+    return false;
+  w.seen |= (1ull << age);
+  return true;
+}
+
+int trunk_t::peer_index(const endpoint_t& ep) const
+{
+  for(size_t k = 0; k < peer_eps.size(); ++k)
+    if((peer_eps[k].sin_addr.s_addr == ep.sin_addr.s_addr) &&
+       (peer_eps[k].sin_port == ep.sin_port))
+      return k;
+  return -1;
+}
+
+void trunk_t::set_local(stage_device_id_t cid)
+{
+  owners[cid] = -1;
+}
+
+void trunk_t::pack(const std::vector<ep_desc_t>& endpoints, bool all,
+                   std::vector<std::string>& msgs)
+{
+  msgs.clear();
+  std::string msg;
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+    const ep_desc_t& ep(endpoints[cid]);
+    roster_entry_t e;
+    // addresses are not exchanged:
+    memset(&(e.ep), 0, sizeof(e.ep));
+    memset(&(e.localep), 0, sizeof(e.localep));
+    e.present = (!is_remote(cid)) && (ep.timeout > 0);
+    if(e.present) {
+      e.mode = ep.mode;
+      e.has_pubkey = ep.has_pubkey;
+      if(e.has_pubkey)
+        memcpy(e.pubkey, ep.pubkey, crypto_box_PUBLICKEYBYTES);
+    }
+    if((e == announced[cid]) && !(all && e.present))
+      continue;
+    announced[cid] = e;
+    uint8_t flags(0);
+    if(!e.present)
+      flags |= ROSTER_REMOVED;
+    else if(e.has_pubkey)
+      flags |= ROSTER_HASPUBKEY;
+    std::string rec;
+    rec.append((const char*)(&cid), sizeof(cid));
+    rec.append((const char*)(&flags), sizeof(flags));
+    if(e.present) {
+      rec.append((const char*)(&(e.mode)), sizeof(e.mode));
+      if(e.has_pubkey)
+        rec.append((const char*)(e.pubkey), crypto_box_PUBLICKEYBYTES);
+    }
+    if(msg.size() + rec.size() > ROSTER_MAXPAYLOAD) {
+      msgs.push_back(msg);
+      msg.clear();
+    }
+    msg += rec;
+  }
+  if(msg.size())
+    msgs.push_back(msg);
+}
+
+bool trunk_t::apply(size_t peer, const char* msg, size_t len,
+                    std::vector<ep_desc_t>& endpoints)
+{
+  bool changed(false);
+  size_t pos(0);
+  while(pos + sizeof(stage_device_id_t) + 1 <= len) {
+    stage_device_id_t cid;
+    memcpy(&cid, &(msg[pos]), sizeof(cid));
+    pos += sizeof(cid);
+    uint8_t flags(msg[pos]);
+    ++pos;
+    epmode_t mode(0);
+    const char* pubkey(NULL);
+    if(!(flags & ROSTER_REMOVED)) {
+      if(pos + sizeof(mode) > len)
+        break;
+      memcpy(&mode, &(msg[pos]), sizeof(mode));
+      pos += sizeof(mode);
+      if(flags & ROSTER_HASPUBKEY) {
+        if(pos + crypto_box_PUBLICKEYBYTES > len)
+          break;
+        pubkey = &(msg[pos]);
+        pos += crypto_box_PUBLICKEYBYTES;
+      }
+    }
+    if(cid >= MAX_STAGE_ID)
+      continue;
+    ep_desc_t& ep(endpoints[cid]);
+    if(flags & ROSTER_REMOVED) {
+      if(owners[cid] == (int)peer) {
+        remove(cid, endpoints);
+        changed = true;
+      }
+      continue;
+    }
+    // local endpoints take precedence:
+    if((!is_remote(cid)) && (ep.timeout > 0))
+      continue;
+    // the server forwards all data of remote endpoints, and never
+    // sends to them:
+    mode &= ~(B_PEER2PEER | B_GROUPKEY);
+    mode |= B_DONOTSEND;
+    if((owners[cid] != (int)peer) || (ep.timeout <= 0) || (ep.mode != mode) ||
+       (ep.has_pubkey != (pubkey != NULL)) ||
+       (pubkey && memcmp(ep.pubkey, pubkey, crypto_box_PUBLICKEYBYTES)))
+      changed = true;
+    owners[cid] = peer;
+    age[cid] = 0;
+    ep.mode = mode;
+    // announced addresses of remote endpoints point to their node:
+    ep.ep = peer_eps[peer];
+    ep.localep = peer_eps[peer];
+    ep.has_pubkey = (pubkey != NULL);
+    if(pubkey)
+      memcpy(ep.pubkey, pubkey, crypto_box_PUBLICKEYBYTES);
+    ep.timeout = TRUNKTIMEOUT;
+  }
+  return changed;
+}
+
+bool trunk_t::expire(std::vector<ep_desc_t>& endpoints)
+{
+  bool changed(false);
+  for(stage_device_id_t cid = 0; cid != MAX_STAGE_ID; ++cid) {
+    if(!is_remote(cid))
+      continue;
+    if(++age[cid] >= TRUNKEXPIREPERIODS) {
+      remove(cid, endpoints);
+      changed = true;
+    } else {
+      endpoints[cid].timeout = TRUNKTIMEOUT;
+    }
+  }
+  return changed;
+}
+
+size_t trunk_t::num_remote() const
+{
+  size_t n(0);
+  for(const auto& o : owners)
+    if(o >= 0)
+      ++n;
+  return n;
+}
+
+void trunk_t::remove(stage_device_id_t cid, std::vector<ep_desc_t>& endpoints)
+{
+  owners[cid] = -1;
+  age[cid] = 0;
+  endpoints[cid].timeout = 0;
+  endpoints[cid].has_pubkey = false;
+  endpoints[cid].mode = 0;
+}
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
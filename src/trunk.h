@@ -0,0 +1,154 @@
+#ifndef TRUNK_H
+#define TRUNK_H
+
+#include "callerlist.h"
+#include "protocol.h"
+#include "roster.h"
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <sodium.h>
+#include <string>
+#include <vector>
+
+// maximum number of peer nodes:
+#define TRUNKMAXPEERS 16
+
+// remote endpoints expire if their node does not mention them for
+// this number of ping periods:
+#define TRUNKEXPIREPERIODS 60
+
+// endpoint timeout of remote endpoints, refreshed in every ping
+// period:
+#define TRUNKTIMEOUT 10
+
+// additional bytes of a packet sealed for a peer node:
+#define TRUNKSEALBYTES                                                         \
+  (HEADERLEN + crypto_box_NONCEBYTES + crypto_box_MACBYTES + sizeof(uint64_t))
+
+// number of packets of a peer which may arrive out of order, at most
+// 64:
+#define TRUNKREPLAYWINDOW 64
+
+/**
+ * Federation of one room across several server nodes.
+ *
+ * Each node knows the room ports of its peer nodes. It announces its
+ * local endpoints to all peers (see PORT_TRUNK in protocol.h) and
+ * sends the audio of each local sender once to every peer, which fans
+ * it out to its own clients. Bandwidth per node therefore grows with
+ * the number of local participants, not with the room size.
+ *
+ * Endpoints of other nodes are entered into the endpoint list of the
+ * room as remote endpoints: they are announced to the local clients,
+ * but with B_DONOTSEND and without B_PEER2PEER, so local clients send
+ * their audio to the server and the server never sends to them.
+ * Remote endpoints are not pinged and do not take part in group key
+ * mode. A local registration always takes precedence over a remote
+ * endpoint with the same stage device ID.
+ *
+ * Each node has a key pair, and each peer is configured with its
+ * public key. All packets between two nodes, PORT_TRUNK messages as
+ * well as audio, are sealed with the shared key of the pair (see
+ * seal()): the header stays readable, the payload is encrypted, and
+ * header and payload are authenticated. Packets which can not be
+ * opened with the key of the peer they come from are dropped, so
+ * audio of encrypted rooms never leaves the node in plain text and
+ * the pin is not sufficient to inject data into the trunk.
+ *
+ * The sealed text starts with a counter of the sending node, which is
+ * increased for every packet to that peer. It starts at the real time
+ * in ns, so it keeps growing over restarts and hand-overs. Packets
+ * whose counter was seen before, or which are more than
+ * TRUNKREPLAYWINDOW packets older than the newest one, are dropped,
+ * so captured packets can not be replayed.
+ *
+ * The keys and the peer list are set before the room starts. owner() and
+ * peer_index() are lock free and used on the forwarding path; all
+ * other methods have to be called with the control mutex of the room.
+ */
+class trunk_t {
+public:
+  trunk_t();
+  /**
+   * Load the secret key of this node from a file, or create a new key
+   * pair and store it there if the file does not exist.
+   */
+  void set_node_key(const std::string& path);
+  /// Public key of this node, as hex string
+  std::string public_key() const;
+  /// Add a peer node with its public key as hex string
+  void add_peer(const endpoint_t& ep, const std::string& pubkey);
+  const std::vector<endpoint_t>& peers() const { return peer_eps; };
+  /// Index of the peer with endpoint ep, or -1
+  int peer_index(const endpoint_t& ep) const;
+  /// Peer index of the node of a remote endpoint, -1 for local ones
+  int owner(stage_device_id_t cid) const { return owners[cid]; };
+  bool is_remote(stage_device_id_t cid) const { return owners[cid] >= 0; };
+  /**
+   * Seal a packet for a peer node: the header is copied, followed by
+   * a nonce and the cipher text of the packet counter and the
+   * complete packet. Thread safe.
+   *
+   * @return Length of the sealed packet, or zero on error.
+   */
+  size_t seal(size_t peer, char* dest, size_t maxlen, const char* src,
+              size_t len) const;
+  /**
+   * Open a packet sealed by a peer node.
+   *
+   * @return Length of the original packet, or zero if it was not
+   * sealed with the key of this peer or was received before. Thread
+   * safe.
+   */
+  size_t open(size_t peer, char* dest, const char* src, size_t len) const;
+  /// A local client registered with this ID
+  void set_local(stage_device_id_t cid);
+  /**
+   * Pack the changes of the local endpoints since the last call, or
+   * all local endpoints if all is true.
+   */
+  void pack(const std::vector<ep_desc_t>& endpoints, bool all,
+            std::vector<std::string>& msgs);
+  /// Apply a message of a peer, true if the endpoint list changed
+  bool apply(size_t peer, const char* msg, size_t len,
+             std::vector<ep_desc_t>& endpoints);
+  /// Refresh and expire remote endpoints, once per ping period
+  bool expire(std::vector<ep_desc_t>& endpoints);
+  size_t num_remote() const;
+
+private:
+  void remove(stage_device_id_t cid, std::vector<ep_desc_t>& endpoints);
+  bool check_replay(size_t peer, uint64_t counter) const;
+  class replay_window_t {
+  public:
+    std::mutex mtx;
+    // newest counter, and the counters seen before it, bit k for
+    // newest-k:
+    uint64_t newest = 0;
+    uint64_t seen = 0;
+  };
+  std::vector<endpoint_t> peer_eps;
+  // shared keys of this node with each peer:
+  std::vector<std::array<uint8_t, crypto_box_BEFORENMBYTES>> peer_keys;
+  // packet counters of the sent and received packets of each peer:
+  mutable std::array<std::atomic<uint64_t>, TRUNKMAXPEERS> txcounter;
+  mutable std::array<replay_window_t, TRUNKMAXPEERS> rxwindow;
+  bool has_node_key = false;
+  uint8_t node_public[crypto_box_PUBLICKEYBYTES];
+  uint8_t node_secret[crypto_box_SECRETKEYBYTES];
+  std::vector<std::atomic<int>> owners;
+  // ping periods since the last update of each remote endpoint:
+  std::vector<uint32_t> age;
+  // local endpoints, as announced to the peers:
+  std::vector<roster_entry_t> announced;
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,396 @@
+#include "uring.h"
+#include "errmsg.h"
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifdef HAS_IOURING
+
+// request types, in the user data of a request:
+#define URING_RECV (1ull << 63)
+#define URING_SEND (1ull << 62)
+#define URING_GSO (1ull << 61)
+#define URING_COUNTMASK 0xffffffffull
+#define URING_DESTSHIFT 32
+#define URING_DESTMASK 0xffffull
+
+udp_uring_t::udp_uring_t(int fd_) : fd(fd_)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  ringfd = syscall(__NR_io_uring_setup, URINGENTRIES, &p);
+  if(ringfd < 0)
+    throw ErrMsg("Unable to create io_uring instance.", errno);
+  try {
+    if(!(p.features & IORING_FEAT_EXT_ARG) ||
+       !(p.features & IORING_FEAT_NODROP))
+      throw ErrMsg("The io_uring implementation of this kernel is too old.");
+    sq_maplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_maplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single(p.features & IORING_FEAT_SINGLE_MMAP);
+    if(single)
+      sq_maplen = cq_maplen = std::max(sq_maplen, cq_maplen);
+    sq_map = mmap(NULL, sq_maplen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+    if(sq_map == MAP_FAILED) {
+      sq_map = NULL;
+      throw ErrMsg("Unable to map io_uring submission queue.", errno);
+    }
+    if(single) {
+      cq_map = sq_map;
+    } else {
+      cq_map = mmap(NULL, cq_maplen, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+      if(cq_map == MAP_FAILED) {
+        cq_map = NULL;
+        throw ErrMsg("Unable to map io_uring completion queue.", errno);
+      }
+    }
+    sqes_maplen = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* m(mmap(NULL, sqes_maplen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQES));
+    if(m == MAP_FAILED)
+      throw ErrMsg("Unable to map io_uring submission entries.", errno);
+    sqes = (struct io_uring_sqe*)m;
+    char* sq((char*)sq_map);
+    sq_head = (unsigned*)(sq + p.sq_off.head);
+    sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    sq_mask = *(unsigned*)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned*)(sq + p.sq_off.array);
+    char* cq((char*)cq_map);
+    cq_head = (unsigned*)(cq + p.cq_off.head);
+    cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    cq_mask = *(unsigned*)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    // each receive buffer holds the message header, the sender
+    // address, the time stamp and the datagram:
+    memset(&recvhdr, 0, sizeof(recvhdr));
+    recvhdr.msg_namelen = sizeof(endpoint_t);
+    recvhdr.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+    bufsize = sizeof(struct io_uring_recvmsg_out) + recvhdr.msg_namelen +
+              recvhdr.msg_controllen + BUFSIZE;
+    m = mmap(NULL, URINGRECVBUFS * bufsize, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(m == MAP_FAILED)
+      throw ErrMsg("Unable to allocate io_uring receive buffers.", errno);
+    bufs = (char*)m;
+    bufring_len = URINGRECVBUFS * sizeof(struct io_uring_buf);
+    m = mmap(NULL, bufring_len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if(m == MAP_FAILED)
+      throw ErrMsg("Unable to allocate io_uring buffer ring.", errno);
+    bufring = (struct io_uring_buf_ring*)m;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)bufring;
+    reg.ring_entries = URINGRECVBUFS;
+    reg.bgid = 0;
+    if(syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_PBUF_RING,
+               &reg, 1) < 0)
+      throw ErrMsg("Unable to register io_uring receive buffers.", errno);
+    for(uint16_t k = 0; k < URINGRECVBUFS; ++k) {
+      struct io_uring_buf& b(ringbufs()[k]);
+      b.addr = (uint64_t)(bufs + k * bufsize);
+      b.len = bufsize;
+      b.bid = k;
+    }
+    __atomic_store_n(&(bufring->tail), (uint16_t)URINGRECVBUFS,
+                     __ATOMIC_RELEASE);
+    ready.reserve(URINGRECVBUFS);
+    int on(1);
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+    // kernels without multishot receive fail the request immediately:
+    arm_recv();
+    enter(0);
+    unsigned head(*cq_head);
+    if(head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      const struct io_uring_cqe& cqe(cqes[head & cq_mask]);
+      if((cqe.user_data & URING_RECV) && (cqe.res < 0) &&
+         !(cqe.flags & IORING_CQE_F_MORE))
+        throw ErrMsg("Multishot receive is not supported by this kernel.",
+                     -cqe.res);
+    }
+  }
+  catch(...) {
+    unmap();
+    ::close(ringfd);
+    throw;
+  }
+}
+
+udp_uring_t::~udp_uring_t()
+{
+  // the kernel cancels pending requests when the ring is closed:
+  ::close(ringfd);
+  unmap();
+}
+
+void udp_uring_t::unmap()
+{
+  if(bufring)
+    munmap(bufring, bufring_len);
+  if(bufs)
+    munmap(bufs, URINGRECVBUFS * bufsize);
+  if(sqes)
+    munmap(sqes, sqes_maplen);
+  if(cq_map && (cq_map != sq_map))
+    munmap(cq_map, cq_maplen);
+  if(sq_map)
+    munmap(sq_map, sq_maplen);
+  bufring = NULL;
+  bufs = NULL;
+  sqes = NULL;
+  cq_map = NULL;
+  sq_map = NULL;
+}
+
+// the entries of the buffer ring start at the ring address, with the
+// tail overlaid; the flexible array declaration of the kernel header
+// adds an offset in C++, so do not use bufring->bufs:
+struct io_uring_buf* udp_uring_t::ringbufs()
+{
+  return (struct io_uring_buf*)bufring;
+}
+
+struct io_uring_sqe* udp_uring_t::get_sqe()
+{
+  unsigned tail(*sq_tail);
+  if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask) {
+    // the queue is full, submit the queued requests first:
+    enter(0);
+    if(tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > sq_mask)
+      return NULL;
+  }
+  unsigned idx(tail & sq_mask);
+  struct io_uring_sqe* sqe(&(sqes[idx]));
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[idx] = idx;
+  // the kernel reads the entry in the next io_uring_enter() call,
+  // after the caller filled it in:
+  __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ++pending;
+  return sqe;
+}
+
+int udp_uring_t::enter(unsigned min_complete)
+{
+  if(!pending && !min_complete)
+    return 0;
+  struct __kernel_timespec ts;
+  ts.tv_sec = URINGTIMEOUTMS / 1000;
+  ts.tv_nsec = (URINGTIMEOUTMS % 1000) * 1000000ll;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uint64_t)(&ts);
+  unsigned flags(IORING_ENTER_EXT_ARG);
+  if(min_complete)
+    flags |= IORING_ENTER_GETEVENTS;
+  int r(syscall(__NR_io_uring_enter, ringfd, pending, min_complete, flags,
+                &arg, sizeof(arg)));
+  ++num_syscalls;
+  // the return value is the number of submitted requests:
+  if(r > 0)
+    pending -= std::min((unsigned)r, pending);
+  return r;
+}
+
+void udp_uring_t::arm_recv()
+{
+  struct io_uring_sqe* sqe(get_sqe());
+  if(!sqe)
+    return;
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(&recvhdr);
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = URING_RECV;
+  armed = true;
+}
+
+void udp_uring_t::queue_sendmsg(const struct msghdr* mh, size_t ndatagrams,
+                                bool gso, stage_device_id_t dest)
+{
+  struct io_uring_sqe* sqe(get_sqe());
+  if(!sqe) {
+    num_send_errors += ndatagrams;
+    if(on_send_error)
+      on_send_error(dest, ndatagrams, EBUSY);
+    return;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)mh;
+  sqe->len = 1;
+  // fail instead of waiting for space in the socket buffer:
+  sqe->msg_flags = MSG_DONTWAIT;
+  sqe->user_data = URING_SEND | (gso ? URING_GSO : 0) |
+                   (((uint64_t)dest & URING_DESTMASK) << URING_DESTSHIFT) |
+                   (ndatagrams & URING_COUNTMASK);
+  ++nsends;
+}
+
+void udp_uring_t::complete_sends()
+{
+  while(nsends) {
+    if((enter(1) < 0) && (errno != ETIME) && (errno != EINTR)) {
+      // the ring failed, the messages are lost:
+      nsends = 0;
+      return;
+    }
+    reap();
+  }
+}
+
+// return the buffers of the datagrams handed out by the last recv()
+// call to the kernel:
+void udp_uring_t::recycle()
+{
+  if(!handed_out)
+    return;
+  uint16_t tail(bufring->tail);
+  for(size_t k = 0; k < handed_out; ++k) {
+    uint16_t bid(ready[k].bid);
+    struct io_uring_buf& b(ringbufs()[(tail + k) & (URINGRECVBUFS - 1)]);
+    b.addr = (uint64_t)(bufs + bid * bufsize);
+    b.len = bufsize;
+    b.bid = bid;
+  }
+  __atomic_store_n(&(bufring->tail), (uint16_t)(tail + handed_out),
+                   __ATOMIC_RELEASE);
+  ready.erase(ready.begin(), ready.begin() + handed_out);
+  handed_out = 0;
+}
+
+void udp_uring_t::reap()
+{
+  unsigned head(*cq_head);
+  unsigned tail(__atomic_load_n(cq_tail, __ATOMIC_ACQUIRE));
+  for(; head != tail; ++head) {
+    const struct io_uring_cqe& cqe(cqes[head & cq_mask]);
+    if(cqe.user_data & URING_SEND) {
+      if(nsends)
+        --nsends;
+      if(cqe.res < 0) {
+        size_t n(cqe.user_data & URING_COUNTMASK);
+        num_send_errors += n;
+        if(on_send_error)
+          on_send_error((cqe.user_data >> URING_DESTSHIFT) & URING_DESTMASK,
+                        n, -cqe.res);
+        if((cqe.user_data & URING_GSO) &&
+           ((cqe.res == -EIO) || (cqe.res == -EINVAL)))
+          gso_failed = true;
+      }
+      continue;
+    }
+    if(!(cqe.flags & IORING_CQE_F_MORE))
+      armed = false;
+    if(!(cqe.flags & IORING_CQE_F_BUFFER))
+      continue;
+    rxmsg_t msg;
+    msg.bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    char* b(bufs + msg.bid * bufsize);
+    const struct io_uring_recvmsg_out* out(
+        (const struct io_uring_recvmsg_out*)b);
+    char* name(b + sizeof(*out));
+    char* control(name + recvhdr.msg_namelen);
+    msg.buf = control + recvhdr.msg_controllen;
+    msg.len = out->payloadlen;
+    if((cqe.res < 0) || (out->flags & MSG_TRUNC) || (msg.len > BUFSIZE) ||
+       (out->namelen < sizeof(endpoint_t))) {
+      // no usable datagram, hand the buffer back with the next batch:
+      msg.len = 0;
+    }
+    memcpy(&(msg.ep), name, sizeof(endpoint_t));
+    bool has_ts(false);
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_control = control;
+    mh.msg_controllen = out->controllen;
+    for(struct cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm != NULL;
+        cm = CMSG_NXTHDR(&mh, cm)) {
+      if((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_TIMESTAMPNS)) {
+        memcpy(&(msg.tstamp), CMSG_DATA(cm), sizeof(struct timespec));
+        has_ts = true;
+      }
+    }
+    if(!has_ts)
+      clock_gettime(CLOCK_REALTIME, &(msg.tstamp));
+    ready.push_back(msg);
+  }
+  __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+}
+
+size_t udp_uring_t::recv(size_t maxmsg, char** buf, size_t* len,
+                         endpoint_t* eps, struct timespec* tstamp)
+{
+  recycle();
+  reap();
+  // the multishot request ends when all buffers are in use:
+  if(!armed)
+    arm_recv();
+  // submit the sends of the previous cycle, and wait for datagrams if
+  // none are queued; send completions do not end the wait:
+  if(pending && !ready.empty()) {
+    enter(0);
+    reap();
+  }
+  while(ready.empty()) {
+    if(!armed)
+      arm_recv();
+    // the submitted sends complete first, do not return for them:
+    int r(enter(nsends + 1));
+    reap();
+    if(r < 0)
+      break;
+  }
+  size_t n(0);
+  for(; (handed_out < ready.size()) && (n < maxmsg); ++handed_out) {
+    const rxmsg_t& msg(ready[handed_out]);
+    if(!msg.len)
+      continue;
+    buf[n] = msg.buf;
+    len[n] = msg.len;
+    eps[n] = msg.ep;
+    tstamp[n] = msg.tstamp;
+    ++n;
+  }
+  return n;
+}
+
+#else
+
+udp_uring_t::udp_uring_t(int)
+{
+  throw ErrMsg("io_uring is not supported on this system.");
+}
+
+udp_uring_t::~udp_uring_t() {}
+
+void udp_uring_t::queue_sendmsg(const struct msghdr*, size_t, bool,
+                                stage_device_id_t)
+{
+}
+
+void udp_uring_t::complete_sends() {}
+
+size_t udp_uring_t::recv(size_t, char**, size_t*, endpoint_t*,
+                         struct timespec*)
+{
+  return 0;
+}
+
+#endif
+
+/*
+ * Local Variables:
+ * compile-command: "make -C .."
+ * End:
+ */
@@ -0,0 +1,147 @@
+#ifndef URING_H
+#define URING_H
+
+#include "common.h"
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+#if defined(LINUX) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAS_IOURING
+#endif
+#endif
+
+#ifdef HAS_IOURING
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#endif
+
+// number of provided receive buffers, a power of two:
+#define URINGRECVBUFS 256
+
+// size of the submission queue, large enough for the headers of a
+// full send batch and the receive request:
+#define URINGENTRIES 512
+
+// receive timeout, to check for termination, in ms; a signal ends the
+// wait earlier:
+#define URINGTIMEOUTMS 1000
+
+/**
+ * io_uring instance serving the receive and send path of one UDP
+ * socket.
+ *
+ * Datagrams are received by a single multishot recvmsg request into
+ * a ring of buffers which are registered with the kernel (provided
+ * buffers), so the request does not need to be submitted again for
+ * every datagram. Outgoing messages are queued as sendmsg requests
+ * and submitted together with the wait for the next datagrams, which
+ * takes one io_uring_enter() call for the whole receive and fan-out
+ * cycle.
+ *
+ * Multishot receive requires Linux 6.0. The constructor throws an
+ * exception if the kernel does not provide the required features, so
+ * the caller can fall back to the recvmmsg/sendmmsg path. An instance
+ * is not thread safe; use it from the receive thread of the socket
+ * only.
+ */
+class udp_uring_t {
+public:
+  udp_uring_t(int fd);
+  ~udp_uring_t();
+  /**
+   * Queue a sendmsg request. The message, its buffers and its control
+   * data must stay valid until sends_done() returns true.
+   *
+   * @param mh Message header
+   * @param ndatagrams Number of datagrams in the message (GSO)
+   * @param gso The message uses UDP_SEGMENT
+   * @param dest Destination ID, passed to on_send_error
+   */
+  void queue_sendmsg(const struct msghdr* mh, size_t ndatagrams, bool gso,
+                     stage_device_id_t dest);
+  /// True if no send request is queued or in flight
+  bool sends_done() const { return nsends == 0; };
+  /// Submit queued requests and wait until all sends are complete
+  void complete_sends();
+  /**
+   * Submit queued requests, wait for datagrams up to the receive
+   * timeout and return up to maxmsg of them. Buffers stay valid until
+   * the next call.
+   */
+  size_t recv(size_t maxmsg, char** buf, size_t* len, endpoint_t* eps,
+              struct timespec* tstamp);
+  std::atomic<uint64_t> num_syscalls{0};
+  std::atomic<uint64_t> num_send_errors{0};
+  /// A GSO send failed, the sender should use plain datagrams
+  bool gso_failed = false;
+  /// Called for failed sends with destination, datagrams and errno
+  std::function<void(stage_device_id_t, size_t, int)> on_send_error;
+
+#ifdef HAS_IOURING
+private:
+  struct io_uring_sqe* get_sqe();
+  struct io_uring_buf* ringbufs();
+  int enter(unsigned min_complete);
+  void reap();
+  void arm_recv();
+  void recycle();
+  void unmap();
+  int fd;
+  int ringfd = -1;
+  // submission queue:
+  unsigned* sq_head = NULL;
+  unsigned* sq_tail = NULL;
+  unsigned sq_mask = 0;
+  unsigned* sq_array = NULL;
+  struct io_uring_sqe* sqes = NULL;
+  // completion queue:
+  unsigned* cq_head = NULL;
+  unsigned* cq_tail = NULL;
+  unsigned cq_mask = 0;
+  struct io_uring_cqe* cqes = NULL;
+  void* sq_map = NULL;
+  size_t sq_maplen = 0;
+  void* cq_map = NULL;
+  size_t cq_maplen = 0;
+  size_t sqes_maplen = 0;
+  // requests which are queued, but not submitted:
+  unsigned pending = 0;
+  // send requests without completion:
+  size_t nsends = 0;
+  bool armed = false;
+  // layout of the received messages:
+  struct msghdr recvhdr;
+  size_t bufsize = 0;
+  char* bufs = NULL;
+  struct io_uring_buf_ring* bufring = NULL;
+  size_t bufring_len = 0;
+  // received datagrams, in the order of arrival:
+  class rxmsg_t {
+  public:
+    char* buf;
+    size_t len;
+    endpoint_t ep;
+    struct timespec tstamp;
+    uint16_t bid;
+  };
+  std::vector<rxmsg_t> ready;
+  // number of datagrams handed out by the last recv() call:
+  size_t handed_out = 0;
+#else
+private:
+  size_t nsends = 0;
+#endif
+};
+
+#endif
+
+/*
+ * Local Variables:
+ * mode: c++
+ * compile-command: "make -C .."
+ * End:
+ */